@@ -0,0 +1,178 @@
+#ifndef _BSDF_H_
+#define _BSDF_H_
+
+#include "math_util.h"
+#include "scene.h"
+
+// Materials are a mix of two lobes. Reflection is the share of the specular lobe, the rest is Lambert.
+// Dielectrics (refractiveIndex != 0) are all specular whatever their reflection is, like before the lobes,
+// and refract some of their bounces, picked by Schlick's Fresnel.
+// Rough specular lobes (roughness != 0) reflect and refract around a GGX microfacet normal instead of the surface
+// normal. Microfacet normals are drawn from the visible normal distribution, so only masking is left in the weight.
+// Sampling picks a lobe by its share, so the weight is the material color times Fresnel and masking terms.
+// Samples are the BSDF sample set of the bounce: two for the Lambert direction or microfacet normal, the lobe choice
+// and the Fresnel choice. Pure diffuse materials only use the first two.
+#define BSDF_SAMPLE_COUNT 4
+
+struct BSDFSample {
+    Vector3 direction;
+    // BSDF * cos / pdf. Path attenuation gets multiplied with this.
+    Vector3 weight;
+    // Solid angle density of direction. Smooth mirror and refraction are delta lobes, they get 0.
+    float pdf;
+};
+
+inline bool IsDiffuseMaterial(Material* material) {
+    return material->reflection == 0.0f && material->refractiveIndex == 0.0f;
+}
+
+inline float GetSpecularShare(Material* material) {
+    return material->refractiveIndex != 0.0f ? 1.0f : material->reflection;
+}
+
+// Normal on the side the incoming ray comes from.
+inline Vector3 FaceForward(Vector3 normal, Vector3 incoming) {
+    return DotProduct(normal, incoming) > 0.0f ? -normal : normal;
+}
+
+inline float LambertPdf(Vector3 normal, Vector3 direction) {
+    return Max(DotProduct(normal, direction), 0.0f) / PI;
+}
+
+// Lambert BRDF times cosine, for light sampling.
+inline Vector3 EvaluateLambert(Vector3 albedo, Vector3 normal, Vector3 direction) {
+    return albedo * LambertPdf(normal, direction);
+}
+
+inline Vector3 Reflect(Vector3 incoming, Vector3 normal) {
+    return incoming - normal * DotProduct(normal, incoming) * 2.0f;
+}
+
+// GGX (Trowbridge-Reitz) normal distribution. Cos is between the microfacet normal and the surface normal.
+inline float GGXDistribution(float cosTheta, float alpha) {
+    float alphaSquared = alpha * alpha;
+    float denominator = cosTheta * cosTheta * (alphaSquared - 1.0f) + 1.0f;
+    return alphaSquared / (PI * denominator * denominator);
+}
+
+// Smith's lambda for GGX. Masking of a single direction is 1 / (1 + lambda), masking and shadowing together
+// is 1 / (1 + lambdaOut + lambdaIn).
+inline float GGXLambda(float cosTheta, float alpha) {
+    float cosSquared = cosTheta * cosTheta;
+    float tanSquared = Max(1.0f - cosSquared, 0.0f) / cosSquared;
+    return 0.5f * (sqrtf(1.0f + alpha * alpha * tanSquared) - 1.0f);
+}
+
+// Heitz 2018, Sampling the GGX Distribution of Visible Normals. Outgoing points away from the surface,
+// on the side of normal. Returned microfacet normal always faces outgoing.
+inline Vector3 SampleGGXVisibleNormal(Vector3 normal, Vector3 outgoing, float alpha, float u1, float u2) {
+    Vector3 tangent, bitangent;
+    OrthonormalBasis(normal, &tangent, &bitangent);
+    // Stretch the microfacets to a unit hemisphere, there visible normals are a projected disk.
+    Vector3 view = Normalize(Vector3(alpha * DotProduct(outgoing, tangent), alpha * DotProduct(outgoing, bitangent),
+                                     DotProduct(outgoing, normal)));
+    float lengthSquared = view.x * view.x + view.y * view.y;
+    Vector3 axis1 = lengthSquared > 0.0f ? Vector3(-view.y, view.x, 0.0f) / sqrtf(lengthSquared)
+                                         : Vector3(1.0f, 0.0f, 0.0f);
+    Vector3 axis2 = CrossProduct(view, axis1);
+
+    // Point on the disk, with the half that is hidden behind the hemisphere squashed away.
+    float radius = sqrtf(u1);
+    float phi = 2.0f * PI * u2;
+    float p1 = radius * cosf(phi);
+    float p2 = radius * sinf(phi);
+    float s = 0.5f * (1.0f + view.z);
+    p2 = (1.0f - s) * sqrtf(1.0f - p1 * p1) + s * p2;
+
+    Vector3 hemisphereNormal = axis1 * p1 + axis2 * p2 + view * sqrtf(Max(1.0f - p1 * p1 - p2 * p2, 0.0f));
+    Vector3 m = Normalize(Vector3(alpha * hemisphereNormal.x, alpha * hemisphereNormal.y,
+                                  Max(hemisphereNormal.z, 0.0f)));
+    return tangent * m.x + bitangent * m.y + normal * m.z;
+}
+
+// Schlick's Fresnel with a colored reflectance at normal incidence, for conductors.
+inline Vector3 SchlickConductor(Vector3 f0, float cosTheta) {
+    float m = Clamp(0.0f, 1.0f - cosTheta, 1.0f);
+    float m5 = m * m * m * m * m;
+    return f0 + (Vector3(1.0f, 1.0f, 1.0f) - f0) * m5;
+}
+
+inline BSDFSample SampleBSDF(Material* material, Vector3 hitNormal, Vector3 incoming, float* samples) {
+    BSDFSample result;
+    result.weight = material->color;
+    Vector3 normal = FaceForward(hitNormal, incoming);
+
+    float specularShare = GetSpecularShare(material);
+    if (IsDiffuseMaterial(material) || samples[2] >= specularShare) {
+        result.direction = SampleCosineHemisphere(normal, samples[0], samples[1]);
+        result.pdf = (1.0f - specularShare) * LambertPdf(normal, result.direction);
+        return result;
+    }
+
+    Vector3 outgoing = -incoming;
+    float alpha = material->roughness * material->roughness;
+    Vector3 microfacetNormal = normal;
+    if (alpha > 0.0f) {
+        microfacetNormal = SampleGGXVisibleNormal(normal, outgoing, alpha, samples[0], samples[1]);
+    }
+
+    result.direction = Reflect(incoming, microfacetNormal);
+    float lobePdf = specularShare;
+    bool isRefracted = false;
+    // Outside and inside of the medium, seen from the sampled direction and from outgoing.
+    float directionIor = 1.0f;
+    float outgoingIor = 1.0f;
+    if (material->refractiveIndex != 0.0f) {
+        // Refract tells entering from exiting by the side of the normal, so keep the microfacet normal on the side of hitNormal.
+        bool isEntering = DotProduct(hitNormal, normal) > 0.0f;
+        Vector3 orientedNormal = isEntering ? microfacetNormal : -microfacetNormal;
+        Vector3 refractedDirection;
+        if (Refract(incoming, orientedNormal, material->refractiveIndex, &refractedDirection)) {
+            float fresnel = Schlick(incoming, microfacetNormal, material->refractiveIndex);
+            isRefracted = samples[3] > fresnel;
+            if (isRefracted) {
+                result.direction = Normalize(refractedDirection);
+                directionIor = isEntering ? material->refractiveIndex : 1.0f;
+                outgoingIor = isEntering ? 1.0f : material->refractiveIndex;
+            }
+            lobePdf *= isRefracted ? 1.0f - fresnel : fresnel;
+        }
+    } else if (material->metalness > 0.0f) {
+        Vector3 fresnel = SchlickConductor(material->color, DotProduct(outgoing, microfacetNormal));
+        result.weight = Lerp(material->color, material->metalness, fresnel);
+    }
+
+    result.pdf = 0.0f;
+    if (alpha == 0.0f) {
+        return result;
+    }
+
+    // Microfacets can send reflections under the surface and refractions back out. Those paths carry nothing.
+    float cosOutgoing = DotProduct(normal, outgoing);
+    float cosDirection = DotProduct(normal, result.direction);
+    if (isRefracted ? cosDirection >= 0.0f : cosDirection <= 0.0f) {
+        result.weight = Vector3(0.0f, 0.0f, 0.0f);
+        return result;
+    }
+
+    float lambdaOutgoing = GGXLambda(cosOutgoing, alpha);
+    float lambdaDirection = GGXLambda(cosDirection, alpha);
+    result.weight = result.weight * ((1.0f + lambdaOutgoing) / (1.0f + lambdaOutgoing + lambdaDirection));
+
+    // Visible normal density is G1(outgoing) * D(m) * (outgoing . m) / (outgoing . n), then the Jacobian of
+    // reflection or refraction takes it to the bounce direction.
+    float microfacetOutgoing = DotProduct(microfacetNormal, outgoing);
+    float microfacetDirection = DotProduct(microfacetNormal, result.direction);
+    float visibleNormalPdf = GGXDistribution(DotProduct(normal, microfacetNormal), alpha) * microfacetOutgoing /
+                             (cosOutgoing * (1.0f + lambdaOutgoing));
+    if (isRefracted) {
+        float denominator = outgoingIor * microfacetOutgoing + directionIor * microfacetDirection;
+        result.pdf = lobePdf * visibleNormalPdf * directionIor * directionIor * fabsf(microfacetDirection) /
+                     (denominator * denominator);
+    } else {
+        result.pdf = lobePdf * visibleNormalPdf / (4.0f * microfacetOutgoing);
+    }
+    return result;
+}
+
+#endif
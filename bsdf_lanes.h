@@ -0,0 +1,58 @@
+// Lane versions of the GGX helpers in bsdf.h, for shading a lane of wavefront paths together.
+// Lane width comes from the backend, so simd_backends.cpp includes this once per backend. No include guard on purpose.
+
+using ::GGXDistribution;
+using ::GGXLambda;
+using ::SampleGGXVisibleNormal;
+using ::SchlickConductor;
+
+inline LaneF32 GGXDistribution(LaneF32 cosTheta, LaneF32 alpha) {
+    LaneF32 alphaSquared = alpha * alpha;
+    LaneF32 denominator = FMulAdd(cosTheta * cosTheta, alphaSquared - LaneF32(1.0f), LaneF32(1.0f));
+    return alphaSquared / (LaneF32(PI) * denominator * denominator);
+}
+
+inline LaneF32 GGXLambda(LaneF32 cosTheta, LaneF32 alpha) {
+    LaneF32 cosSquared = cosTheta * cosTheta;
+    LaneF32 tanSquared = Max(LaneF32(1.0f) - cosSquared, LaneF32(0.0f)) / cosSquared;
+    return LaneF32(0.5f) * (SquareRoot(FMulAdd(alpha * alpha, tanSquared, LaneF32(1.0f))) - LaneF32(1.0f));
+}
+
+// Same distribution as the scalar one, phi goes from -PI to PI for SinCos like in SampleCosineHemisphere.
+// Static, so it gets inlined into its only caller instead of being compiled on its own.
+static inline LaneVector3 SampleGGXVisibleNormal(LaneVector3 normal, LaneVector3 outgoing, LaneF32 alpha,
+                                                 LaneF32 u1, LaneF32 u2) {
+    LaneVector3 tangent, bitangent;
+    OrthonormalBasis(normal, &tangent, &bitangent);
+    LaneVector3 view = NormalizeExact(LaneVector3(alpha * DotProduct(outgoing, tangent),
+                                                  alpha * DotProduct(outgoing, bitangent),
+                                                  DotProduct(outgoing, normal)));
+    LaneF32 lengthSquared = view.x * view.x + view.y * view.y;
+    LaneF32 inverseLength = LaneF32(1.0f) / SquareRoot(lengthSquared);
+    LaneVector3 axis1(LaneF32(1.0f), LaneF32(0.0f), LaneF32(0.0f));
+    Select(&axis1, lengthSquared > LaneF32(0.0f),
+           LaneVector3(-view.y * inverseLength, view.x * inverseLength, LaneF32(0.0f)));
+    LaneVector3 axis2 = CrossProduct(view, axis1);
+
+    LaneF32 radius = SquareRoot(u1);
+    LaneF32 phi = LaneF32(PI) * FMulSub(LaneF32(2.0f), u2, LaneF32(1.0f));
+    LaneF32 sinPhi, cosPhi;
+    SinCos(phi, &sinPhi, &cosPhi);
+    LaneF32 p1 = radius * cosPhi;
+    LaneF32 p2 = radius * sinPhi;
+    LaneF32 s = LaneF32(0.5f) * (LaneF32(1.0f) + view.z);
+    p2 = FMulAdd(LaneF32(1.0f) - s, SquareRoot(Max(LaneF32(1.0f) - p1 * p1, LaneF32(0.0f))), s * p2);
+
+    LaneVector3 hemisphereNormal = axis1 * p1 + axis2 * p2 +
+                                   view * SquareRoot(Max(LaneF32(1.0f) - p1 * p1 - p2 * p2, LaneF32(0.0f)));
+    LaneVector3 m = NormalizeExact(LaneVector3(alpha * hemisphereNormal.x, alpha * hemisphereNormal.y,
+                                               Max(hemisphereNormal.z, LaneF32(0.0f))));
+    return tangent * m.x + bitangent * m.y + normal * m.z;
+}
+
+inline LaneVector3 SchlickConductor(LaneVector3 f0, LaneF32 cosTheta) {
+    LaneF32 m = Clamp(LaneF32(0.0f), LaneF32(1.0f) - cosTheta, LaneF32(1.0f));
+    LaneF32 m2 = m * m;
+    LaneF32 m5 = m2 * m2 * m;
+    return f0 + (LaneVector3(LaneF32(1.0f), LaneF32(1.0f), LaneF32(1.0f)) - f0) * m5;
+}
@@ -1,5 +1,6 @@
 @echo off
-set compilerFlags=/Zi /fp:fast /arch:AVX2 -DPLATFORM_WIN32=1
+:: No /arch here. SIMD backends are selected at startup by what the CPU supports.
+set compilerFlags=/Zi /fp:fast -DPLATFORM_WIN32=1
 
 IF "%~1"=="-d" (
     :: Debug build
@@ -1,4 +1,5 @@
-compileArguments=(-std=c++11 -Wall -march=native)
+# No -march here. SIMD backends pick their own instruction sets and the best one is selected at startup.
+compileArguments=(-std=c++11 -Wall)
 
 if [ "$1" == "-d" ]; then
     # Debug build
@@ -0,0 +1,366 @@
+#include "bvh.h"
+
+// SAH cost constants. We intersect leaf primitives a lane pack at a time,
+// so intersection cost is counted per pack instead of per primitive.
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_INTERSECTION_COST 2.0f
+
+inline uint32_t LanePackCount(uint32_t primitiveCount) {
+    return (primitiveCount + LANE_WIDTH - 1) / LANE_WIDTH;
+}
+
+static AABB GetSphereBounds(Sphere* sphere) {
+    Vector3 radius(sphere->radius, sphere->radius, sphere->radius);
+    AABB result;
+    result.min = sphere->position - radius;
+    result.max = sphere->position + radius;
+    return result;
+}
+
+static AABB GetRectangleBounds(RectangleXY* rect) {
+    // Rectangle transform matrices are inverted on scene initialization. We need the actual transform to find the corners.
+    Matrix4 transform = Inverse(rect->transformMatrix);
+
+    AABB result = EmptyAABB();
+    result = Union(result, (transform * Vector4(rectDefaultMinPoint.x, rectDefaultMinPoint.y, 0.0f, 1.0f)).xyz());
+    result = Union(result, (transform * Vector4(rectDefaultMinPoint.x, rectDefaultMaxPoint.y, 0.0f, 1.0f)).xyz());
+    result = Union(result, (transform * Vector4(rectDefaultMaxPoint.x, rectDefaultMinPoint.y, 0.0f, 1.0f)).xyz());
+    result = Union(result, (transform * Vector4(rectDefaultMaxPoint.x, rectDefaultMaxPoint.y, 0.0f, 1.0f)).xyz());
+
+    // Axis aligned rectangles have flat bounding boxes. Inflate them a little bit to make slab tests robust.
+    Vector3 padding(0.001f, 0.001f, 0.001f);
+    result.min = result.min - padding;
+    result.max = result.max + padding;
+    return result;
+}
+
+static AABB GetTriangleBounds(Mesh* mesh, uint32_t triangleIndex) {
+    uint32_t* indices = mesh->indices + 3 * triangleIndex;
+    AABB result = EmptyAABB();
+    result = Union(result, mesh->vertices[indices[0]]);
+    result = Union(result, mesh->vertices[indices[1]]);
+    result = Union(result, mesh->vertices[indices[2]]);
+    return result;
+}
+
+struct BVHBin {
+    AABB bounds;
+    uint32_t count;
+};
+
+inline uint32_t GetBinIndex(float centroid, float centroidMin, float binScale) {
+    uint32_t binIndex = (uint32_t) ((centroid - centroidMin) * binScale);
+    return binIndex < BVH_BIN_COUNT ? binIndex : BVH_BIN_COUNT - 1;
+}
+
+static void MakeLeaf(BVH* bvh, BVHNode* node, uint32_t firstPrimitive, uint32_t primitiveCount) {
+    BVHLeaf* leaf = bvh->leaves + bvh->leafCount;
+    leaf->primitiveOffset = firstPrimitive;
+    leaf->primitiveCount = primitiveCount;
+
+    node->firstChildIndex = 0;
+    node->leafIndex = bvh->leafCount++;
+}
+
+static void BuildNode(BVH* bvh, uint32_t nodeIndex, uint32_t firstPrimitive, uint32_t primitiveCount, uint32_t depth) {
+    BVHNode* node = bvh->nodes + nodeIndex;
+    BVHPrimitive* primitives = bvh->primitives + firstPrimitive;
+
+    if (depth > bvh->maxDepth) {
+        bvh->maxDepth = depth;
+    }
+
+    AABB bounds = EmptyAABB();
+    AABB centroidBounds = EmptyAABB();
+    for (uint32_t primitiveIndex = 0; primitiveIndex < primitiveCount; ++primitiveIndex) {
+        bounds = Union(bounds, primitives[primitiveIndex].bounds);
+        centroidBounds = Union(centroidBounds, (primitives[primitiveIndex].bounds.min + primitives[primitiveIndex].bounds.max) * 0.5f);
+    }
+    node->bounds = bounds;
+
+    float boundsArea = SurfaceArea(bounds);
+    if (primitiveCount == 1 || depth >= BVH_MAX_DEPTH - 1 || boundsArea <= 0.0f) {
+        MakeLeaf(bvh, node, firstPrimitive, primitiveCount);
+        return;
+    }
+
+    // Binned SAH. Project centroids into fixed number of bins on each axis
+    // and evaluate split candidates only between the bins.
+    float leafCost = BVH_INTERSECTION_COST * LanePackCount(primitiveCount);
+    float bestCost = F32Max;
+    uint32_t bestAxis = 0;
+    uint32_t bestSplit = 0;
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        float centroidMin = centroidBounds.min[axis];
+        float centroidExtent = centroidBounds.max[axis] - centroidMin;
+        if (centroidExtent <= 0.0f) {
+            continue;
+        }
+
+        BVHBin bins[BVH_BIN_COUNT];
+        for (uint32_t binIndex = 0; binIndex < BVH_BIN_COUNT; ++binIndex) {
+            bins[binIndex].bounds = EmptyAABB();
+            bins[binIndex].count = 0;
+        }
+
+        float binScale = BVH_BIN_COUNT / centroidExtent;
+        for (uint32_t primitiveIndex = 0; primitiveIndex < primitiveCount; ++primitiveIndex) {
+            BVHPrimitive* primitive = primitives + primitiveIndex;
+            BVHBin* bin = bins + GetBinIndex(GetCentroid(primitive, axis), centroidMin, binScale);
+            bin->bounds = Union(bin->bounds, primitive->bounds);
+            bin->count++;
+        }
+
+        // Sweep from right to find the area and primitive count on the right side of each split plane.
+        float rightAreas[BVH_BIN_COUNT];
+        uint32_t rightCounts[BVH_BIN_COUNT];
+        AABB rightBounds = EmptyAABB();
+        uint32_t rightCount = 0;
+        for (uint32_t binIndex = BVH_BIN_COUNT - 1; binIndex > 0; --binIndex) {
+            rightBounds = Union(rightBounds, bins[binIndex].bounds);
+            rightCount += bins[binIndex].count;
+            rightAreas[binIndex] = SurfaceArea(rightBounds);
+            rightCounts[binIndex] = rightCount;
+        }
+
+        AABB leftBounds = EmptyAABB();
+        uint32_t leftCount = 0;
+        for (uint32_t split = 1; split < BVH_BIN_COUNT; ++split) {
+            leftBounds = Union(leftBounds, bins[split - 1].bounds);
+            leftCount += bins[split - 1].count;
+            if (leftCount == 0 || rightCounts[split] == 0) {
+                continue;
+            }
+
+            float cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST *
+                (SurfaceArea(leftBounds) * LanePackCount(leftCount) + rightAreas[split] * LanePackCount(rightCounts[split])) / boundsArea;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+            }
+        }
+    }
+
+    // No split candidate means all centroids are on the same point. We can't do anything better than a leaf.
+    if (bestCost == F32Max || (bestCost >= leafCost && primitiveCount <= BVH_MAX_LEAF_SIZE)) {
+        MakeLeaf(bvh, node, firstPrimitive, primitiveCount);
+        return;
+    }
+
+    // Partition primitives in place by the chosen bin split.
+    float centroidMin = centroidBounds.min[bestAxis];
+    float binScale = BVH_BIN_COUNT / (centroidBounds.max[bestAxis] - centroidMin);
+    uint32_t left = 0;
+    uint32_t right = primitiveCount;
+    while (left < right) {
+        if (GetBinIndex(GetCentroid(primitives + left, bestAxis), centroidMin, binScale) < bestSplit) {
+            ++left;
+        } else {
+            --right;
+            BVHPrimitive temp = primitives[left];
+            primitives[left] = primitives[right];
+            primitives[right] = temp;
+        }
+    }
+
+    uint32_t firstChildIndex = bvh->nodeCount;
+    bvh->nodeCount += 2;
+    node->firstChildIndex = firstChildIndex;
+    node->leafIndex = BVH_INTERIOR_NODE;
+
+    BuildNode(bvh, firstChildIndex, firstPrimitive, left, depth + 1);
+    BuildNode(bvh, firstChildIndex + 1, firstPrimitive + left, primitiveCount - left, depth + 1);
+}
+
+// Collapses binary subtree into a wide node. We keep opening the interior child with the largest surface area
+// until the node is full, so the children with the highest hit probability are tested in the same slab test.
+static uint32_t CollapseNode(BVH* bvh, uint32_t binaryNodeIndex) {
+    uint32_t wideNodeIndex = bvh->wideNodeCount++;
+
+    uint32_t children[LANE_WIDTH];
+    uint32_t childCount = 0;
+    BVHNode* binaryNode = bvh->nodes + binaryNodeIndex;
+    if (binaryNode->leafIndex != BVH_INTERIOR_NODE) {
+        children[childCount++] = binaryNodeIndex;
+    } else {
+        children[childCount++] = binaryNode->firstChildIndex;
+        children[childCount++] = binaryNode->firstChildIndex + 1;
+    }
+
+    while (childCount < LANE_WIDTH) {
+        int32_t childToOpen = -1;
+        float largestArea = -1.0f;
+        for (uint32_t i = 0; i < childCount; ++i) {
+            BVHNode* child = bvh->nodes + children[i];
+            float area = SurfaceArea(child->bounds);
+            if (child->leafIndex == BVH_INTERIOR_NODE && area > largestArea) {
+                largestArea = area;
+                childToOpen = i;
+            }
+        }
+
+        if (childToOpen < 0) {
+            break;
+        }
+
+        uint32_t firstGrandChild = bvh->nodes[children[childToOpen]].firstChildIndex;
+        children[childToOpen] = firstGrandChild;
+        children[childCount++] = firstGrandChild + 1;
+    }
+
+    ALIGN_LANE float boundsArray[2][3][LANE_WIDTH];
+    uint32_t wideChildren[LANE_WIDTH];
+    for (uint32_t i = 0; i < LANE_WIDTH; ++i) {
+        if (i < childCount) {
+            BVHNode* child = bvh->nodes + children[i];
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                boundsArray[0][axis][i] = child->bounds.min[axis];
+                boundsArray[1][axis][i] = child->bounds.max[axis];
+            }
+
+            if (child->leafIndex != BVH_INTERIOR_NODE) {
+                wideChildren[i] = child->leafIndex | WIDE_BVH_LEAF_FLAG;
+            } else {
+                wideChildren[i] = CollapseNode(bvh, children[i]);
+            }
+        } else {
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                boundsArray[0][axis][i] = F32Max;
+                boundsArray[1][axis][i] = -F32Max;
+            }
+            wideChildren[i] = WIDE_BVH_EMPTY_CHILD;
+        }
+    }
+
+    WideBVHNode* wideNode = bvh->wideNodes + wideNodeIndex;
+    wideNode->bounds[0] = LaneVector3(boundsArray[0]);
+    wideNode->bounds[1] = LaneVector3(boundsArray[1]);
+    for (uint32_t i = 0; i < LANE_WIDTH; ++i) {
+        wideNode->children[i] = wideChildren[i];
+    }
+
+    return wideNodeIndex;
+}
+
+BVH* BuildBVH(World* world) {
+    BVH* bvh = new BVH;
+    *bvh = {};
+
+    uint32_t triangleCount = 0;
+    for (uint32_t meshIndex = 0; meshIndex < world->meshCount; ++meshIndex) {
+        triangleCount += world->meshes[meshIndex].triangleCount;
+    }
+
+    bvh->primitiveCount = world->sphereCount + world->rectangleCount + triangleCount;
+    bvh->primitives = new BVHPrimitive[bvh->primitiveCount];
+
+    uint32_t primitiveIndex = 0;
+    for (uint32_t sphereIndex = 0; sphereIndex < world->sphereCount; ++sphereIndex) {
+        BVHPrimitive* primitive = bvh->primitives + primitiveIndex++;
+        primitive->bounds = GetSphereBounds(world->spheres + sphereIndex);
+        primitive->type = PrimitiveType_Sphere;
+        primitive->index = sphereIndex;
+    }
+
+    for (uint32_t rectangleIndex = 0; rectangleIndex < world->rectangleCount; ++rectangleIndex) {
+        BVHPrimitive* primitive = bvh->primitives + primitiveIndex++;
+        primitive->bounds = GetRectangleBounds(world->rectangles + rectangleIndex);
+        primitive->type = PrimitiveType_Rectangle;
+        primitive->index = rectangleIndex;
+    }
+
+    for (uint32_t meshIndex = 0; meshIndex < world->meshCount; ++meshIndex) {
+        Mesh* mesh = world->meshes + meshIndex;
+        for (uint32_t triangleIndex = 0; triangleIndex < mesh->triangleCount; ++triangleIndex) {
+            BVHPrimitive* primitive = bvh->primitives + primitiveIndex++;
+            primitive->bounds = GetTriangleBounds(mesh, triangleIndex);
+            primitive->type = PrimitiveType_Triangle;
+            primitive->index = triangleIndex;
+            primitive->meshIndex = meshIndex;
+        }
+    }
+
+    // Binary tree with N leaves has at most 2N - 1 nodes.
+    uint32_t maxNodeCount = bvh->primitiveCount > 0 ? 2 * bvh->primitiveCount - 1 : 0;
+    bvh->nodes = new BVHNode[maxNodeCount];
+    bvh->leaves = new BVHLeaf[bvh->primitiveCount];
+    if (bvh->primitiveCount > 0) {
+        bvh->nodeCount = 1;
+        BuildNode(bvh, 0, 0, bvh->primitiveCount, 0);
+    }
+
+    // Pack primitives of every leaf into contiguous lane arrays.
+    uint32_t maxLeafPrimitiveCount = 0;
+    for (uint32_t leafIndex = 0; leafIndex < bvh->leafCount; ++leafIndex) {
+        BVHLeaf* leaf = bvh->leaves + leafIndex;
+        if (leaf->primitiveCount > maxLeafPrimitiveCount) {
+            maxLeafPrimitiveCount = leaf->primitiveCount;
+        }
+
+        uint32_t primitiveCounts[3] = {};
+        for (uint32_t i = 0; i < leaf->primitiveCount; ++i) {
+            ++primitiveCounts[bvh->primitives[leaf->primitiveOffset + i].type];
+        }
+        bvh->sphereLaneCount += LanePackCount(primitiveCounts[PrimitiveType_Sphere]);
+        bvh->rectangleLaneCount += LanePackCount(primitiveCounts[PrimitiveType_Rectangle]);
+        bvh->triangleLaneCount += LanePackCount(primitiveCounts[PrimitiveType_Triangle]);
+    }
+
+    bvh->sphereLanes = AllocateLaneArray(SphereSoALane, bvh->sphereLaneCount);
+    bvh->rectangleLanes = AllocateLaneArray(RectangleLane, bvh->rectangleLaneCount);
+    bvh->triangleLanes = AllocateLaneArray(TriangleLane, bvh->triangleLaneCount);
+
+    uint32_t* sphereIndices = new uint32_t[maxLeafPrimitiveCount];
+    uint32_t* rectangleIndices = new uint32_t[maxLeafPrimitiveCount];
+    uint32_t* triangleIndices = new uint32_t[maxLeafPrimitiveCount];
+    uint32_t* meshIndices = new uint32_t[maxLeafPrimitiveCount];
+    uint32_t sphereLaneOffset = 0;
+    uint32_t rectangleLaneOffset = 0;
+    uint32_t triangleLaneOffset = 0;
+    for (uint32_t leafIndex = 0; leafIndex < bvh->leafCount; ++leafIndex) {
+        BVHLeaf* leaf = bvh->leaves + leafIndex;
+        uint32_t sphereCount = 0;
+        uint32_t rectangleCount = 0;
+        uint32_t triangleCount = 0;
+        for (uint32_t i = 0; i < leaf->primitiveCount; ++i) {
+            BVHPrimitive* primitive = bvh->primitives + leaf->primitiveOffset + i;
+            if (primitive->type == PrimitiveType_Sphere) {
+                sphereIndices[sphereCount++] = primitive->index;
+            } else if (primitive->type == PrimitiveType_Rectangle) {
+                rectangleIndices[rectangleCount++] = primitive->index;
+            } else {
+                meshIndices[triangleCount] = primitive->meshIndex;
+                triangleIndices[triangleCount++] = primitive->index;
+            }
+        }
+
+        leaf->sphereLaneOffset = sphereLaneOffset;
+        leaf->sphereLaneCount = PackSphereLanes(bvh->sphereLanes + sphereLaneOffset, world->spheres, sphereIndices, sphereCount);
+        sphereLaneOffset += leaf->sphereLaneCount;
+
+        leaf->rectangleLaneOffset = rectangleLaneOffset;
+        leaf->rectangleLaneCount = PackRectangleLanes(bvh->rectangleLanes + rectangleLaneOffset, world->rectangles, rectangleIndices, rectangleCount);
+        rectangleLaneOffset += leaf->rectangleLaneCount;
+
+        leaf->triangleLaneOffset = triangleLaneOffset;
+        leaf->triangleLaneCount = PackTriangleLanes(bvh->triangleLanes + triangleLaneOffset, world->meshes, meshIndices, triangleIndices, triangleCount);
+        triangleLaneOffset += leaf->triangleLaneCount;
+    }
+
+    delete[] sphereIndices;
+    delete[] rectangleIndices;
+    delete[] triangleIndices;
+    delete[] meshIndices;
+
+    // Every wide node has at least two binary children, so binary node count is enough.
+    bvh->wideNodes = AllocateLaneArray(WideBVHNode, bvh->nodeCount);
+    if (bvh->nodeCount > 0) {
+        CollapseNode(bvh, 0);
+    }
+
+    delete[] bvh->nodes;
+    bvh->nodes = 0;
+
+    return bvh;
+}
@@ -0,0 +1,158 @@
+// Wide BVH node and leaf layouts depend on the lane width,
+// so simd_backends.cpp includes this and bvh.cpp once per backend. No include guard on purpose.
+
+// Number of buckets per axis used when evaluating SAH split candidates.
+#define BVH_BIN_COUNT 16
+// Leaves are intersected in lane packs, so we allow a leaf to hold a few packs when SAH says splitting is not worth it.
+#define BVH_MAX_LEAF_SIZE (4 * LANE_WIDTH)
+// Traversal uses a fixed size stack. Build stops splitting when it reaches this depth.
+#define BVH_MAX_DEPTH 64
+#define BVH_INTERIOR_NODE U32Max
+
+// Binary BVH is collapsed into a wide BVH that has one child per SIMD lane (BVH8 with AVX2, BVH4 with SSE).
+#define WIDE_BVH_LEAF_FLAG 0x80000000
+#define WIDE_BVH_EMPTY_CHILD U32Max
+// Every visited node can push all of its children except the one we continue with.
+#define WIDE_BVH_STACK_SIZE (BVH_MAX_DEPTH * LANE_WIDTH)
+
+struct AABB {
+    Vector3 min;
+    Vector3 max;
+};
+
+inline AABB EmptyAABB() {
+    AABB result;
+    result.min = Vector3(F32Max, F32Max, F32Max);
+    result.max = Vector3(-F32Max, -F32Max, -F32Max);
+    return result;
+}
+
+inline AABB Union(AABB left, AABB right) {
+    AABB result;
+    result.min = Min(left.min, right.min);
+    result.max = Max(left.max, right.max);
+    return result;
+}
+
+inline AABB Union(AABB box, Vector3 point) {
+    AABB result;
+    result.min = Min(box.min, point);
+    result.max = Max(box.max, point);
+    return result;
+}
+
+inline float SurfaceArea(AABB box) {
+    Vector3 extent = box.max - box.min;
+    if (extent.x < 0.0f || extent.y < 0.0f || extent.z < 0.0f) {
+        return 0.0f;
+    }
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+// Slab test. Returns the entry distance of the ray, clamped to zero when the origin is inside the box.
+inline bool IntersectAABB(AABB box, Vector3 rayOrigin, Vector3 inverseRayDirection, float maxDistance, float* entryDistance) {
+    Vector3 t0 = (box.min - rayOrigin) * inverseRayDirection;
+    Vector3 t1 = (box.max - rayOrigin) * inverseRayDirection;
+    Vector3 tNear = Min(t0, t1);
+    Vector3 tFar = Max(t0, t1);
+
+    float entry = Max(Max(tNear.x, tNear.y), Max(tNear.z, 0.0f));
+    float exit = Min(Min(tFar.x, tFar.y), Min(tFar.z, maxDistance));
+    *entryDistance = entry;
+
+    return entry <= exit;
+}
+
+enum PrimitiveType {
+    PrimitiveType_Sphere,
+    PrimitiveType_Rectangle,
+    PrimitiveType_Triangle,
+};
+
+// We don't store centroids. Meshes can have millions of triangles, so primitive references are kept small.
+struct BVHPrimitive {
+    AABB bounds;
+    uint32_t type;
+    uint32_t index; // Triangle index in the mesh for triangles
+    uint32_t meshIndex;
+};
+
+inline float GetCentroid(BVHPrimitive* primitive, uint32_t axis) {
+    return (primitive->bounds.min[axis] + primitive->bounds.max[axis]) * 0.5f;
+}
+
+// Children of a node are always stored next to each other. So we only keep the first one's index.
+struct BVHNode {
+    AABB bounds;
+    uint32_t firstChildIndex;
+    uint32_t leafIndex; // BVH_INTERIOR_NODE for interior nodes
+};
+
+// Bounds of all children are stored in SoA form, so a ray is tested against all of them with one lane slab test.
+// Child is either a wide node index or a leaf index tagged with WIDE_BVH_LEAF_FLAG.
+// Empty children have inverted bounds, so they never pass the slab test.
+struct WideBVHNode {
+    LaneVector3 bounds[2]; // Min and max corners
+    uint32_t children[LANE_WIDTH];
+};
+
+struct WideBVHStackEntry {
+    uint32_t child;
+    float distance;
+};
+
+// Primitives of a leaf are packed into lanes when the tree is built,
+// so traversal runs the same SIMD intersection code we use for brute force.
+struct BVHLeaf {
+    uint32_t primitiveOffset;
+    uint32_t primitiveCount;
+    uint32_t sphereLaneOffset;
+    uint32_t sphereLaneCount;
+    uint32_t rectangleLaneOffset;
+    uint32_t rectangleLaneCount;
+    uint32_t triangleLaneOffset;
+    uint32_t triangleLaneCount;
+};
+
+struct BVH {
+    // Binary nodes are only used while building. They are freed after they are collapsed into wide nodes.
+    uint32_t nodeCount;
+    BVHNode* nodes;
+    uint32_t wideNodeCount;
+    WideBVHNode* wideNodes;
+    uint32_t leafCount;
+    BVHLeaf* leaves;
+    uint32_t maxDepth;
+
+    // Primitive references sorted by leaf.
+    uint32_t primitiveCount;
+    BVHPrimitive* primitives;
+
+    uint32_t sphereLaneCount;
+    SphereSoALane* sphereLanes;
+    uint32_t rectangleLaneCount;
+    RectangleLane* rectangleLanes;
+    uint32_t triangleLaneCount;
+    TriangleLane* triangleLanes;
+};
+
+// Slab test against all children of a wide node at once.
+// nearCorner selects min or max corner for each axis by the ray direction sign, so we don't need min/max swaps.
+// That's also why empty children with inverted bounds always miss.
+inline uint32_t IntersectWideNode(WideBVHNode* node, LaneVector3 scaledRayOrigin, LaneVector3 inverseRayDirection,
+                                  uint32_t* nearCorner, LaneF32 maxDistance, LaneF32* entryDistance) {
+    LaneF32 tNearX = FMulSub(node->bounds[nearCorner[0]].x, inverseRayDirection.x, scaledRayOrigin.x);
+    LaneF32 tNearY = FMulSub(node->bounds[nearCorner[1]].y, inverseRayDirection.y, scaledRayOrigin.y);
+    LaneF32 tNearZ = FMulSub(node->bounds[nearCorner[2]].z, inverseRayDirection.z, scaledRayOrigin.z);
+    LaneF32 tFarX = FMulSub(node->bounds[1 - nearCorner[0]].x, inverseRayDirection.x, scaledRayOrigin.x);
+    LaneF32 tFarY = FMulSub(node->bounds[1 - nearCorner[1]].y, inverseRayDirection.y, scaledRayOrigin.y);
+    LaneF32 tFarZ = FMulSub(node->bounds[1 - nearCorner[2]].z, inverseRayDirection.z, scaledRayOrigin.z);
+
+    LaneF32 entry = Max(Max(tNearX, tNearY), Max(tNearZ, LaneF32(0.0f)));
+    LaneF32 exit = Min(Min(tFarX, tFarY), Min(tFarZ, maxDistance));
+    *entryDistance = entry;
+
+    return GetMaskBits(entry <= exit);
+}
+
+BVH* BuildBVH(World* world);
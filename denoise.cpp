@@ -0,0 +1,100 @@
+// One a-trous iteration of the Denoiser, a lane of pixels of a row at a time. See denoise.h.
+// Compiled once per backend like render_kernels.cpp.
+
+// (1 - x / 256)^256 is within a percent of exp(-x), which is plenty for weights, and it's only multiplies.
+// Goes to zero for x >= 256 instead of getting tiny.
+inline LaneF32 ApproximateNegativeExp(LaneF32 x) {
+    LaneF32 result = Max(FMulAdd(x, LaneF32(-1.0f / 256.0f), LaneF32(1.0f)), LaneF32(0.0f));
+    for (uint32_t i = 0; i < 8; ++i) {
+        result = result * result;
+    }
+    return result;
+}
+
+inline LaneF32 LuminanceLane(LaneVector3 color) {
+    return color.x * LaneF32(0.2126f) + color.y * LaneF32(0.7152f) + color.z * LaneF32(0.0722f);
+}
+
+static void DenoiseLane(Denoiser* denoiser, uint32_t pixelIndex) {
+    static const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+    uint32_t sourceIndex = denoiser->sourceIndex;
+    float** sourceColor = denoiser->color[sourceIndex];
+    float* sourceVariance = denoiser->variance[sourceIndex];
+    float** albedo = denoiser->albedo;
+    float** normal = denoiser->normal;
+
+    LaneVector3 centerColor(LaneF32(sourceColor[0] + pixelIndex), LaneF32(sourceColor[1] + pixelIndex),
+                            LaneF32(sourceColor[2] + pixelIndex));
+    LaneF32 centerVariance(sourceVariance + pixelIndex);
+    LaneVector3 centerAlbedo(LaneF32(albedo[0] + pixelIndex), LaneF32(albedo[1] + pixelIndex),
+                             LaneF32(albedo[2] + pixelIndex));
+    LaneVector3 centerNormal(LaneF32(normal[0] + pixelIndex), LaneF32(normal[1] + pixelIndex),
+                             LaneF32(normal[2] + pixelIndex));
+    LaneF32 centerLuminance = LuminanceLane(centerColor);
+    LaneF32 luminanceScale = LaneF32(1.0f) / FMulAdd(LaneF32(DENOISE_LUMINANCE_SIGMA),
+                                                     SquareRoot(Max(centerVariance, LaneF32(0.0f))),
+                                                     LaneF32(1e-4f));
+
+    // Center always gets its kernel weight, so pixels without features (sky, border) keep their own color.
+    LaneF32 weightSum(kernel[2] * kernel[2]);
+    LaneVector3 colorSum = centerColor * weightSum;
+    LaneF32 varianceSum = centerVariance * weightSum * weightSum;
+
+    int32_t step = (int32_t) denoiser->stepSize;
+    int32_t stride = (int32_t) denoiser->stride;
+    for (int32_t j = -2; j <= 2; ++j) {
+        for (int32_t i = -2; i <= 2; ++i) {
+            if (i == 0 && j == 0) {
+                continue;
+            }
+
+            uint32_t tapIndex = (uint32_t) ((int32_t) pixelIndex + (j * stride + i) * step);
+            LaneVector3 tapNormal(LoadUnaligned(normal[0] + tapIndex), LoadUnaligned(normal[1] + tapIndex),
+                                  LoadUnaligned(normal[2] + tapIndex));
+            LaneF32 normalWeight = Max(DotProduct(centerNormal, tapNormal), LaneF32(0.0f));
+            for (uint32_t power = 1; power < DENOISE_NORMAL_POWER; power *= 2) {
+                normalWeight = normalWeight * normalWeight;
+            }
+
+            LaneVector3 tapAlbedo(LoadUnaligned(albedo[0] + tapIndex), LoadUnaligned(albedo[1] + tapIndex),
+                                  LoadUnaligned(albedo[2] + tapIndex));
+            LaneVector3 albedoDifference = centerAlbedo - tapAlbedo;
+            LaneF32 albedoWeight = ApproximateNegativeExp(DotProduct(albedoDifference, albedoDifference) *
+                                                          LaneF32(1.0f / DENOISE_ALBEDO_SIGMA_SQUARED));
+
+            LaneVector3 tapColor(LoadUnaligned(sourceColor[0] + tapIndex), LoadUnaligned(sourceColor[1] + tapIndex),
+                                 LoadUnaligned(sourceColor[2] + tapIndex));
+            LaneF32 luminanceDifference = LuminanceLane(tapColor) - centerLuminance;
+            luminanceDifference = Max(luminanceDifference, -luminanceDifference);
+            LaneF32 luminanceWeight = ApproximateNegativeExp(luminanceDifference * luminanceScale);
+
+            LaneF32 weight = LaneF32(kernel[j + 2] * kernel[i + 2]) * normalWeight * albedoWeight * luminanceWeight;
+            weightSum = weightSum + weight;
+            colorSum = colorSum + tapColor * weight;
+            varianceSum = varianceSum + LoadUnaligned(sourceVariance + tapIndex) * weight * weight;
+        }
+    }
+
+    uint32_t destinationIndex = 1 - sourceIndex;
+    LaneF32 inverseWeightSum = LaneF32(1.0f) / weightSum;
+    LaneVector3 filteredColor = colorSum * inverseWeightSum;
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        StoreLane(denoiser->color[destinationIndex][axis] + pixelIndex, filteredColor[axis]);
+    }
+    StoreLane(denoiser->variance[destinationIndex] + pixelIndex, varianceSum * inverseWeightSum * inverseWeightSum);
+}
+
+// Filters rows until the iteration is done. Called on every thread.
+void DenoiseRows(Denoiser* denoiser) {
+    for (;;) {
+        uint32_t y = InterlockedAddAndReturnPrevious(&denoiser->nextRowIndex, 1);
+        if (y >= denoiser->height) {
+            break;
+        }
+
+        // Last lane of the row runs into the padding. Those pixels have no features, so they stay as they were.
+        for (uint32_t x = 0; x < denoiser->width; x += LANE_WIDTH) {
+            DenoiseLane(denoiser, GetDenoiserPixelIndex(denoiser, x, y));
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef _DENOISE_H_
+#define _DENOISE_H_
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al. 2010) with the luminance weights of SVGF (Schied et al. 2017).
+// Every iteration is a 5x5 B3 spline kernel whose taps are twice as far apart as in the previous one.
+// Neighbours count less the more their first hit normal and albedo differ, and the further their luminance is
+// out of the noise of the pixel. Variance is filtered along with color, so later iterations trust smoothed pixels more.
+#define DENOISE_ITERATION_COUNT 5
+// Taps of the last iteration are this far away, so buffers have a border this wide and never need bounds checks.
+// Border pixels have zero normals like sky pixels, which gives them no weight.
+#define DENOISE_BORDER (2 << (DENOISE_ITERATION_COUNT - 1))
+// Rows are padded to the widest lane, so lanes of every backend start aligned.
+#define DENOISE_ROW_ALIGNMENT 16
+// Normal weight is max(cos, 0)^DENOISE_NORMAL_POWER. Power of two, it's computed by squaring.
+#define DENOISE_NORMAL_POWER 128
+// Luminance weight is exp(-difference / (DENOISE_LUMINANCE_SIGMA * standard deviation)).
+#define DENOISE_LUMINANCE_SIGMA 4.0f
+// Albedo weight is exp(-squared distance / DENOISE_ALBEDO_SIGMA_SQUARED).
+#define DENOISE_ALBEDO_SIGMA_SQUARED 0.01f
+
+struct SIMDBackend;
+
+// Image as padded planar float buffers. Color and variance have two sets, iterations read one and write the other.
+struct Denoiser {
+    SIMDBackend* backend;
+    uint32_t width;
+    uint32_t height;
+    // Floats per padded row.
+    uint32_t stride;
+    float* color[2][3];
+    float* variance[2];
+    float* albedo[3];
+    float* normal[3];
+
+    // Current iteration reads the buffers of sourceIndex. Rows are handed out to threads one by one.
+    uint32_t sourceIndex;
+    uint32_t stepSize;
+    volatile uint32_t nextRowIndex;
+};
+
+inline uint32_t GetDenoiserPixelIndex(Denoiser* denoiser, uint32_t x, uint32_t y) {
+    return (y + DENOISE_BORDER) * denoiser->stride + DENOISE_BORDER + x;
+}
+
+#endif
@@ -43,3 +43,217 @@ void FreeImage(Image* image) {
     free(image->pixelData);
 }
 
+// Everything is written little endian, which is what x86 stores anyway.
+static bool WriteHDRBytes(HDRImageWriter* writer, const void* data, uint64_t size) {
+    if (!writer->hasFailed && fwrite(data, 1, size, writer->file) != size) {
+        writer->hasFailed = true;
+    }
+    writer->fileOffset += size;
+    return !writer->hasFailed;
+}
+
+// EXR attribute: name, type name, size and the value.
+static uint32_t AppendEXRAttribute(uint8_t* header, uint32_t offset, const char* name, const char* typeName,
+                                   const void* value, uint32_t valueSize) {
+    uint32_t nameSize = (uint32_t) strlen(name) + 1;
+    uint32_t typeNameSize = (uint32_t) strlen(typeName) + 1;
+    memcpy(header + offset, name, nameSize);
+    offset += nameSize;
+    memcpy(header + offset, typeName, typeNameSize);
+    offset += typeNameSize;
+    memcpy(header + offset, &valueSize, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+    memcpy(header + offset, value, valueSize);
+    return offset + valueSize;
+}
+
+bool BeginHDRImage(HDRImageWriter* writer, const char* filename, HDRFormat format, uint32_t width, uint32_t height) {
+    *writer = {};
+    writer->format = format;
+    writer->width = width;
+    writer->height = height;
+    writer->isBottomUp = format == HDRFormat_PFM;
+    writer->file = fopen(filename, "wb");
+    if (!writer->file) {
+        writer->hasFailed = true;
+        return false;
+    }
+
+    if (format == HDRFormat_PFM) {
+        // Negative scale means little endian.
+        char header[64];
+        int headerSize = snprintf(header, sizeof(header), "PF\n%u %u\n-1.0\n", width, height);
+        return WriteHDRBytes(writer, header, headerSize);
+    }
+
+    // Channels are sorted by name in EXR, so it's B, G, R. All 32 bit float, not linear perceptually, no subsampling.
+    uint8_t channels[3 * 18 + 1] = {};
+    const char* channelNames = "BGR";
+    for (uint32_t channelIndex = 0; channelIndex < 3; ++channelIndex) {
+        uint8_t* channel = channels + channelIndex * 18;
+        int32_t channelInfo[4] = { 2, 0, 1, 1 }; // FLOAT, pLinear and reserved bytes, x and y sampling
+        channel[0] = channelNames[channelIndex];
+        memcpy(channel + 2, channelInfo, sizeof(channelInfo));
+    }
+    int32_t window[4] = { 0, 0, (int32_t) width - 1, (int32_t) height - 1 };
+    uint8_t compression = format == HDRFormat_EXRRLE ? 1 : 0;
+    uint8_t lineOrder = 0; // Increasing y
+    float pixelAspectRatio = 1.0f;
+    float screenWindowCenter[2] = { 0.0f, 0.0f };
+    float screenWindowWidth = 1.0f;
+
+    uint8_t header[512];
+    uint32_t magicAndVersion[2] = { 20000630, 2 }; // Single part scanline file
+    memcpy(header, magicAndVersion, sizeof(magicAndVersion));
+    uint32_t headerSize = sizeof(magicAndVersion);
+    headerSize = AppendEXRAttribute(header, headerSize, "channels", "chlist", channels, sizeof(channels));
+    headerSize = AppendEXRAttribute(header, headerSize, "compression", "compression", &compression, 1);
+    headerSize = AppendEXRAttribute(header, headerSize, "dataWindow", "box2i", window, sizeof(window));
+    headerSize = AppendEXRAttribute(header, headerSize, "displayWindow", "box2i", window, sizeof(window));
+    headerSize = AppendEXRAttribute(header, headerSize, "lineOrder", "lineOrder", &lineOrder, 1);
+    headerSize = AppendEXRAttribute(header, headerSize, "pixelAspectRatio", "float", &pixelAspectRatio, 4);
+    headerSize = AppendEXRAttribute(header, headerSize, "screenWindowCenter", "v2f", screenWindowCenter, 8);
+    headerSize = AppendEXRAttribute(header, headerSize, "screenWindowWidth", "float", &screenWindowWidth, 4);
+    header[headerSize++] = 0;
+
+    // Scanlines are chunks of their own. Offset table is zeros until EndHDRImage, it only takes 8 bytes per row.
+    writer->offsetTableOffset = headerSize;
+    writer->scanlineOffsets = (uint64_t*) calloc(height, sizeof(uint64_t));
+    uint64_t scanlineSize = (uint64_t) width * 3 * sizeof(float);
+    writer->scanlineBuffer = (uint8_t*) malloc(scanlineSize);
+    if (format == HDRFormat_EXRRLE) {
+        // Incompressible data grows by a byte every 127 bytes.
+        writer->reorderBuffer = (uint8_t*) malloc(scanlineSize);
+        writer->compressionBuffer = (uint8_t*) malloc(scanlineSize + scanlineSize / 127 + 2);
+    }
+    if (!writer->scanlineOffsets || !writer->scanlineBuffer ||
+        (format == HDRFormat_EXRRLE && (!writer->reorderBuffer || !writer->compressionBuffer))) {
+        fprintf(stderr, "Not enough memory for writing %s\n", filename);
+        writer->hasFailed = true;
+        return false;
+    }
+    WriteHDRBytes(writer, header, headerSize);
+    return WriteHDRBytes(writer, writer->scanlineOffsets, height * sizeof(uint64_t));
+}
+
+// OpenEXR's RLE. Runs of 3 to 128 equal bytes are a count - 1 and the byte, anything else is a negative count
+// and up to 127 literal bytes.
+static uint32_t CompressEXRRunLength(uint8_t* source, uint32_t size, uint8_t* destination) {
+    uint8_t* sourceEnd = source + size;
+    uint8_t* runStart = source;
+    uint8_t* runEnd = source + 1;
+    uint8_t* output = destination;
+    while (runStart < sourceEnd) {
+        while (runEnd < sourceEnd && *runStart == *runEnd && runEnd - runStart - 1 < 127) {
+            ++runEnd;
+        }
+
+        if (runEnd - runStart >= 3) {
+            *output++ = (uint8_t) (runEnd - runStart - 1);
+            *output++ = *runStart;
+            runStart = runEnd;
+        } else {
+            while (runEnd < sourceEnd &&
+                   (runEnd + 1 >= sourceEnd || runEnd[0] != runEnd[1] || runEnd + 2 >= sourceEnd || runEnd[1] != runEnd[2]) &&
+                   runEnd - runStart < 127) {
+                ++runEnd;
+            }
+            *output++ = (uint8_t) (runStart - runEnd);
+            while (runStart < runEnd) {
+                *output++ = *runStart++;
+            }
+        }
+        ++runEnd;
+    }
+    return (uint32_t) (output - destination);
+}
+
+// Before run length coding, EXR puts the even bytes before the odd ones and stores differences of neighbours.
+// So the similar high bytes of floats end up next to each other.
+static uint32_t CompressEXRScanline(HDRImageWriter* writer, uint32_t size) {
+    uint8_t* source = writer->scanlineBuffer;
+    uint8_t* reordered = writer->reorderBuffer;
+    uint32_t halfSize = (size + 1) / 2;
+    for (uint32_t byteIndex = 0; byteIndex < size; ++byteIndex) {
+        reordered[(byteIndex & 1) ? halfSize + byteIndex / 2 : byteIndex / 2] = source[byteIndex];
+    }
+
+    uint8_t previous = reordered[0];
+    for (uint32_t byteIndex = 1; byteIndex < size; ++byteIndex) {
+        uint8_t current = reordered[byteIndex];
+        reordered[byteIndex] = (uint8_t) (current - previous + 128);
+        previous = current;
+    }
+
+    return CompressEXRRunLength(reordered, size, writer->compressionBuffer);
+}
+
+bool WriteHDRRows(HDRImageWriter* writer, float* rows, uint32_t rowCount) {
+    uint32_t width = writer->width;
+    if (writer->format == HDRFormat_PFM) {
+        for (uint32_t rowIndex = rowCount; rowIndex > 0; --rowIndex) {
+            WriteHDRBytes(writer, rows + (uint64_t) (rowIndex - 1) * width * 3, (uint64_t) width * 3 * sizeof(float));
+        }
+        writer->writtenRowCount += rowCount;
+        return !writer->hasFailed;
+    }
+
+    uint32_t scanlineSize = width * 3 * sizeof(float);
+    for (uint32_t rowIndex = 0; rowIndex < rowCount; ++rowIndex) {
+        // Scanline data is planar, channel by channel.
+        float* row = rows + (uint64_t) rowIndex * width * 3;
+        float* planes = (float*) writer->scanlineBuffer;
+        for (uint32_t x = 0; x < width; ++x) {
+            planes[x] = row[x * 3 + 2];
+            planes[width + x] = row[x * 3 + 1];
+            planes[2 * width + x] = row[x * 3];
+        }
+
+        // Scanlines that don't get smaller are stored as is, readers tell them apart by their size.
+        uint8_t* data = writer->scanlineBuffer;
+        uint32_t dataSize = scanlineSize;
+        if (writer->format == HDRFormat_EXRRLE) {
+            uint32_t compressedSize = CompressEXRScanline(writer, scanlineSize);
+            if (compressedSize < scanlineSize) {
+                data = writer->compressionBuffer;
+                dataSize = compressedSize;
+            }
+        }
+
+        uint32_t y = writer->writtenRowCount++;
+        writer->scanlineOffsets[y] = writer->fileOffset;
+        uint32_t chunkHeader[2] = { y, dataSize };
+        WriteHDRBytes(writer, chunkHeader, sizeof(chunkHeader));
+        WriteHDRBytes(writer, data, dataSize);
+    }
+    return !writer->hasFailed;
+}
+
+bool EndHDRImage(HDRImageWriter* writer) {
+    if (!writer->file) {
+        return false;
+    }
+
+    if (writer->writtenRowCount != writer->height) {
+        writer->hasFailed = true;
+    }
+    if (writer->format != HDRFormat_PFM) {
+        // Table is right after the header, so the offset always fits in fseek.
+        if (fseek(writer->file, writer->offsetTableOffset, SEEK_SET) != 0) {
+            writer->hasFailed = true;
+        }
+        if (writer->scanlineOffsets) {
+            WriteHDRBytes(writer, writer->scanlineOffsets, writer->height * sizeof(uint64_t));
+        }
+        free(writer->scanlineOffsets);
+        free(writer->scanlineBuffer);
+        free(writer->reorderBuffer);
+        free(writer->compressionBuffer);
+    }
+
+    if (fclose(writer->file) != 0) {
+        writer->hasFailed = true;
+    }
+    writer->file = 0;
+    return !writer->hasFailed;
+}
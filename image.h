@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #pragma pack(push, 1)
 
@@ -42,4 +43,38 @@ Image CreateImage(int32_t width, int32_t height);
 void WriteImageFile(Image* image, const char* filename);
 void FreeImage(Image* image);
 
+enum HDRFormat {
+    HDRFormat_PFM,
+    HDRFormat_EXR,    // Scanline OpenEXR, uncompressed 32 bit float RGB
+    HDRFormat_EXRRLE, // Same with RLE compressed scanlines
+};
+
+// Writes linear float RGB images a band of rows at a time, so the image never has to be in memory all at once.
+// PFM stores rows bottom up, so when isBottomUp is set bands have to come from the bottom of the image to the top.
+// Rows in a band are top to bottom either way.
+struct HDRImageWriter {
+    FILE* file;
+    HDRFormat format;
+    uint32_t width;
+    uint32_t height;
+    bool isBottomUp;
+    uint32_t writtenRowCount;
+    bool hasFailed;
+
+    // EXR has a table of scanline offsets before the scanlines. We fill it in when we are done.
+    uint64_t fileOffset;
+    uint32_t offsetTableOffset;
+    uint64_t* scanlineOffsets;
+    // One planar scanline, and room for compressing it.
+    uint8_t* scanlineBuffer;
+    uint8_t* reorderBuffer;
+    uint8_t* compressionBuffer;
+};
+
+bool BeginHDRImage(HDRImageWriter* writer, const char* filename, HDRFormat format, uint32_t width, uint32_t height);
+// Rows are interleaved RGB, width * 3 floats each.
+bool WriteHDRRows(HDRImageWriter* writer, float* rows, uint32_t rowCount);
+// Closes the file. Returns false if anything went wrong since BeginHDRImage.
+bool EndHDRImage(HDRImageWriter* writer);
+
 #endif
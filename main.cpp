@@ -3,162 +3,19 @@
 #include <stdlib.h>
 #include <time.h>
 #include <assert.h>
+#include <string.h>
 
 #include "platform.h"
 #include "math_util.h"
 #include "simd.h"
 
 #include "scene.h"
+#include "mesh_loader.cpp"
+#include "work_deque.h"
 
 #include "image.cpp"
-
-struct Ray {
-    Vector3 origin;
-    Vector3 direction;
-};
-
-struct WorldIntersectionResult {
-    float t = F32Max;
-    uint32_t hitMaterialIndex;
-    Vector3 hitNormal;
-};
-
-inline
-bool IntersectWorldWide(World* world, Ray* ray, WorldIntersectionResult* intersectionResult) {
-    float hitTolerance = 0.001;
-    float minHitDistance = 0.001;
-
-    float closestHitDistance = F32Max;
-    uint32_t hitMaterialIndex = 0;
-    Vector3 hitNormal;
-    bool anyHit = false;
-
-    // We have only 1 plane in our scene. So we are calculate plane intersection in scalar.
-    for (int planeIndex = 0; planeIndex < world->planeCount; ++planeIndex) {
-        Plane plane = world->planes[planeIndex];
-        
-        float denom = DotProduct(plane.normal, ray->direction);
-        if ((denom < -hitTolerance) || (denom > hitTolerance)) {
-            float hitDistance = (-plane.d - DotProduct(plane.normal, ray->origin)) / denom;
-            if (hitDistance > minHitDistance && hitDistance < closestHitDistance) {
-                closestHitDistance = hitDistance;
-                hitMaterialIndex = plane.materialIndex;
-                hitNormal = plane.normal;
-                anyHit = true;
-            }
-        }
-    }
-
-    // Broadcast scalar values into lanes.
-    LaneVector3 rayOriginLane(ray->origin);
-    LaneVector3 rayDirectionLane(ray->direction);
-
-    LaneF32 closestHitDistanceLane = LaneF32(closestHitDistance);
-    LaneF32 hitMaterialIndexLane = LaneF32(hitMaterialIndex);
-    LaneVector3 hitNormalLane = LaneVector3(hitNormal);
-
-    for (int sphereLaneIndex = 0; sphereLaneIndex < world->sphereSoAArrayCount; ++sphereLaneIndex) {	
-        SphereSoALane sphereSoA = world->sphereSoAArray[sphereLaneIndex];
-    
-        LaneVector3 centerToOrigin = rayOriginLane - sphereSoA.position;
-        LaneF32 a = DotProduct(rayDirectionLane, rayDirectionLane);
-        LaneF32 b = 2.0f * DotProduct(rayDirectionLane, centerToOrigin);
-        LaneF32 c = DotProduct(centerToOrigin, centerToOrigin) - (sphereSoA.radiusSquared);
-        LaneF32 discriminant = FMulSub(b, b, 4.0f * a * c); //b * b - 4.0f * a * c;
-        LaneF32 denom = 2.0f * a;
-    
-        LaneF32 squareRootMask = discriminant > 0.0f;
-        if (!MaskIsZeroed(squareRootMask)) {
-            LaneF32 tp = (-b + SquareRoot(discriminant)) / denom;
-            LaneF32 tn = (-b - SquareRoot(discriminant)) / denom;
-            
-            LaneF32 hitDistance = tp;
-            LaneF32 pickMask = (tn > minHitDistance & tn < tp);
-            Select(&hitDistance, pickMask, tn);   
-            
-            LaneF32 tMask = (hitDistance > minHitDistance & hitDistance < closestHitDistanceLane);
-            LaneF32 hitMask = (squareRootMask & tMask);
-
-            if (!MaskIsZeroed(hitMask)) {	
-                Select(&closestHitDistanceLane, hitMask, hitDistance);
-                Select(&hitMaterialIndexLane, hitMask, sphereSoA.materialIndex);
-            
-                LaneVector3 hitPosition = FMulAdd(rayDirectionLane, hitDistance, rayOriginLane);
-                Select(&hitNormalLane, hitMask, Normalize(hitPosition - sphereSoA.position));
-                anyHit = true;
-            }
-        }
-    }
-
-    // Pz = Oz + Dz * t
-    // Pz is fixed z component of one of the vectors in rectangle struct
-    // t = (Pz - Oz) / Dz
-    for (uint32_t rectangleLaneIndex = 0; rectangleLaneIndex < world->rectangleLaneArrayCount; ++rectangleLaneIndex) {
-        RectangleLane* rectangleLane = world->rectangleLaneArray + rectangleLaneIndex;
-
-        // rectangle's transform matrix is inverted on scene initialization
-        // We don't invert it here
-        LaneMatrix4 rayMatrix = rectangleLane->transformMatrix;
-        LaneVector3 localRayOrigin = (rayMatrix * LaneVector4(rayOriginLane, 1.0f)).xyz();
-        LaneVector3 localRayDirection = (rayMatrix * LaneVector4(rayDirectionLane, 0.0f)).xyz();
-
-        LaneF32 t = (-localRayOrigin.z) / localRayDirection.z;
-        LaneVector3 hitPoint = localRayOrigin + localRayDirection * t;
-
-        LaneF32 hit = hitPoint.x <= rectDefaultMaxPoint.x & 
-                      hitPoint.x >= rectDefaultMinPoint.x &
-                      hitPoint.y <= rectDefaultMaxPoint.y & 
-                      hitPoint.y >= rectDefaultMinPoint.y;
-
-        LaneF32 hitMask = hit & (t < closestHitDistanceLane) & (t > minHitDistance);
-        if (!MaskIsZeroed(hitMask)) {
-            Select(&closestHitDistanceLane, hitMask, t);
-            Select(&hitMaterialIndexLane, hitMask, rectangleLane->materialIndex);
-            
-            LaneVector3 rectNormal = rectangleLane->normal;
-            // Check for incident ray direction vector direction
-            // If it's coming to back side of rectangle
-            // Flip the normal vector
-            LaneF32 dot = DotProduct(rectNormal, rayDirectionLane);
-            LaneVector3 flippedRectNormal = -rectNormal;
-            LaneF32 flipMask = dot > 0.0f;
-            Select(&rectNormal, flipMask, flippedRectNormal);
-            Select(&hitNormalLane, hitMask, rectNormal);
-            anyHit = true;
-        }
-    }
-
-    if (anyHit) {
-        // After calculating n primitive and ray intersection, we have to find which one is closer.
-        // This is probably the most naive way to do it. We store lane values into an array and iterating through to find any close hit. 
-        ALIGN_LANE float closestHitDistanceLaneUnpacked[LANE_WIDTH];
-        ALIGN_LANE float hitMaterialIndexLaneUnpacked[LANE_WIDTH];
-        ALIGN_LANE float hitNormalLaneXUnpacked[LANE_WIDTH];
-        ALIGN_LANE float hitNormalLaneYUnpacked[LANE_WIDTH];
-        ALIGN_LANE float hitNormalLaneZUnpacked[LANE_WIDTH];
-        StoreLane(closestHitDistanceLaneUnpacked, closestHitDistanceLane);
-        StoreLane(hitMaterialIndexLaneUnpacked, hitMaterialIndexLane);
-        StoreLane(hitNormalLaneXUnpacked, hitNormalLane.x);
-        StoreLane(hitNormalLaneYUnpacked, hitNormalLane.y);
-        StoreLane(hitNormalLaneZUnpacked, hitNormalLane.z);
-        for (int i = 0; i < LANE_WIDTH; ++i) {
-            float t = closestHitDistanceLaneUnpacked[i];
-            if (t < closestHitDistance) {
-                closestHitDistance = t;
-                hitMaterialIndex = hitMaterialIndexLaneUnpacked[i];
-                hitNormal = Vector3(hitNormalLaneXUnpacked[i],
-                                    hitNormalLaneYUnpacked[i],
-                                    hitNormalLaneZUnpacked[i]);
-            }
-        }
-    }
-
-    intersectionResult->t = closestHitDistance;
-    intersectionResult->hitMaterialIndex = hitMaterialIndex;
-    intersectionResult->hitNormal = hitNormal;
-
-    return anyHit;
-}
+#include "render.h"
+#include "simd_backends.cpp"
 
 bool
 IntersectWorld(World* world, Ray* ray, WorldIntersectionResult* intersectionResult) {
@@ -237,239 +94,969 @@ IntersectWorld(World* world, Ray* ray, WorldIntersectionResult* intersectionResu
             }
         }
     }
+
+    for (uint32_t meshIndex = 0; meshIndex < world->meshCount; ++meshIndex) {
+        Mesh* mesh = world->meshes + meshIndex;
+        for (uint32_t triangleIndex = 0; triangleIndex < mesh->triangleCount; ++triangleIndex) {
+            uint32_t* indices = mesh->indices + 3 * triangleIndex;
+            Vector3 vertex0 = mesh->vertices[indices[0]];
+            Vector3 edge1 = mesh->vertices[indices[1]] - vertex0;
+            Vector3 edge2 = mesh->vertices[indices[2]] - vertex0;
+
+            Vector3 pVector = CrossProduct(ray->direction, edge2);
+            float determinant = DotProduct(edge1, pVector);
+            if (determinant == 0.0f) {
+                continue;
+            }
+
+            float inverseDeterminant = 1.0f / determinant;
+            Vector3 tVector = ray->origin - vertex0;
+            float u = DotProduct(tVector, pVector) * inverseDeterminant;
+            Vector3 qVector = CrossProduct(tVector, edge1);
+            float v = DotProduct(ray->direction, qVector) * inverseDeterminant;
+            float t = DotProduct(edge2, qVector) * inverseDeterminant;
+
+            if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > minHitDistance && t < intersectionResult->t) {
+                intersectionResult->t = t;
+                intersectionResult->hitMaterialIndex = mesh->materialIndex;
+                Vector3 triangleNormal = Normalize(CrossProduct(edge1, edge2));
+                if (DotProduct(triangleNormal, ray->direction) > 0) {
+                    intersectionResult->hitNormal = -triangleNormal;
+                } else {
+                    intersectionResult->hitNormal = triangleNormal;
+                }
+            }
+        }
+    }
     
     return intersectionResult->t < F32Max;
 }
 
-struct WorkOrder {
-    Image* image;
-    World* world;
-    uint32_t startRowIndex;
-    uint32_t endRowIndex;
-    uint32_t sampleSize;
-};
+// Morton code interleaves x and y bits. We only need decoding, so this takes every other bit.
+inline uint32_t CompactEveryOtherBit(uint32_t x) {
+    x &= 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0F0F0F0F;
+    x = (x | (x >> 4)) & 0x00FF00FF;
+    x = (x | (x >> 8)) & 0x0000FFFF;
+    return x;
+}
 
-struct WorkQueue {
-    uint32_t workOrderCount;
-    WorkOrder* workOrders;
+// Tiles are created in Z-order (Morton order), so consecutive tiles are close to each other on the screen.
+// Every thread gets a contiguous run of them. Threads render their own tiles in order and thieves take
+// tiles from the far end of the run, so threads mostly touch the same parts of the BVH for a while.
+static void InitializeWorkQueue(WorkQueue* workQueue, SIMDBackend* backend, Image* image, World* world,
+                                uint32_t tileSize, uint32_t threadCount) {
+    uint32_t imageWidth = image->width;
+    uint32_t imageHeight = image->height;
+    uint32_t tileCountX = (imageWidth + tileSize - 1) / tileSize;
+    uint32_t tileCountY = (imageHeight + tileSize - 1) / tileSize;
+    uint32_t tileCount = tileCountX * tileCountY;
+    WorkOrder* workOrders = new WorkOrder[tileCount];
+
+    // Walk Morton codes of the smallest power of two square that covers all tiles and skip the ones outside.
+    uint32_t gridSize = 1;
+    while (gridSize < tileCountX || gridSize < tileCountY) {
+        gridSize *= 2;
+    }
 
-    volatile uint64_t nextOrderToDo;
-    volatile uint64_t finishedOrderCount;
-    volatile uint64_t totalBouncesComputed;
-};
+    uint32_t workOrderCount = 0;
+    for (uint32_t mortonCode = 0; mortonCode < gridSize * gridSize; ++mortonCode) {
+        uint32_t tileX = CompactEveryOtherBit(mortonCode);
+        uint32_t tileY = CompactEveryOtherBit(mortonCode >> 1);
+        if (tileX >= tileCountX || tileY >= tileCountY) {
+            continue;
+        }
 
-// Main ray trace function.
-// I use a loop-based tracing instead of recursion-based trace function.
-// You can write clean code by using recursion but I find recursion hard to understand.
-// This way is more straightforward and understandable for me.
-Vector3 RaytraceWorld(World* world, Ray* ray, uint32_t* randomState, WorkQueue* workQueue, uint64_t* bounceCount) {
-    Vector3 result(0.0f, 0.0f, 0.0f);
-
-    Ray bounceRay = {};
-    bounceRay.origin = ray->origin;
-    bounceRay.direction = ray->direction;
-
-    uint64_t bouncesComputed = 0;
-
-    Vector3 attenuation(1.0f, 1.0f, 1.0f);
-    for (uint32_t bounceIndex = 0; bounceIndex < 8; ++bounceIndex) {    
-        WorldIntersectionResult intersectionResult = {};
-        bool isIntersect = IntersectWorldWide(world, &bounceRay, &intersectionResult);
-        ++bouncesComputed;
-
-        Material mat = world->materials[intersectionResult.hitMaterialIndex];
-        if (isIntersect) {
-
-            //result = attenuation;
-            //attenuation *= mat.color;
-            result += attenuation * mat.emitColor;
-            attenuation *= mat.color;
-            bounceRay.origin = bounceRay.origin + bounceRay.direction * intersectionResult.t;
-        
-            Vector3 mirrorBounce = bounceRay.direction - intersectionResult.hitNormal *
-            DotProduct(intersectionResult.hitNormal, bounceRay.direction) * 2.0f;
-            Vector3 randomBounce = intersectionResult.hitNormal +
-            Vector3(RandomBilateral(randomState),
-                RandomBilateral(randomState),
-                RandomBilateral(randomState));
-            Vector3 reflectedRay = Normalize(Lerp(randomBounce, mat.reflection, mirrorBounce));
-
-             // Fresnel coefficient is between 0 and 1. We start with 1 which is full reflection, no refraction.
-            float fresnelCoefficient = 1.0;
-            Vector3 refractedRay = reflectedRay;
-
-            if (mat.refractiveIndex != 0.0f) {
-                bool isRefract = Refract(bounceRay.direction, intersectionResult.hitNormal,
-                                 mat.refractiveIndex, &refractedRay);
-                if (isRefract) {
-                    // Refractive material
-                    refractedRay = Normalize(refractedRay);
-
-                    // We use the Schlick Approximation for getting fresnel coefficient. It's okay for our purposes.
-                    // NOTE: We can use actual Fresnel Equations for making the image little bit more realistic.
-                    fresnelCoefficient = Schlick(bounceRay.direction, intersectionResult.hitNormal,
-                                 mat.refractiveIndex);
-                }
+        WorkOrder* workOrder = workOrders + workOrderCount++;
+        uint32_t endRowIndex = (tileY + 1) * tileSize;
+        uint32_t endColumnIndex = (tileX + 1) * tileSize;
+        workOrder->startRowIndex = tileY * tileSize;
+        workOrder->endRowIndex = endRowIndex < imageHeight ? endRowIndex : imageHeight;
+        workOrder->startColumnIndex = tileX * tileSize;
+        workOrder->endColumnIndex = endColumnIndex < imageWidth ? endColumnIndex : imageWidth;
+    }
+
+    *workQueue = {};
+    workQueue->image = image;
+    workQueue->world = world;
+    workQueue->backend = backend;
+    workQueue->workOrderCount = workOrderCount;
+    workQueue->workOrders = workOrders;
+    workQueue->totalPixelCount = (uint64_t) imageWidth * imageHeight;
+    workQueue->dequeCount = threadCount;
+    workQueue->deques = (WorkDeque*) _mm_malloc(threadCount * sizeof(WorkDeque), CACHE_LINE_SIZE);
+    for (uint32_t threadIndex = 0; threadIndex < threadCount; ++threadIndex) {
+        // Extra space is for split tiles.
+        uint32_t orderCount = workOrderCount / threadCount + 1;
+        InitializeWorkDeque(workQueue->deques + threadIndex, orderCount + 64);
+    }
+
+    // Seeding per pixel makes the image independent of the tile size and the order tiles are rendered.
+    workQueue->accumulators = (PixelAccumulator*) _mm_malloc(workQueue->totalPixelCount * sizeof(PixelAccumulator), CACHE_LINE_SIZE);
+    for (uint32_t pixelIndex = 0; pixelIndex < workQueue->totalPixelCount; ++pixelIndex) {
+        PixelAccumulator* pixel = workQueue->accumulators + pixelIndex;
+        *pixel = {};
+        pixel->randomState = Hash32(pixelIndex + 1);
+    }
+}
+
+// Buffers of the AOVs that are on, in flag order, and the size of their elements. Returns how many there are.
+static uint32_t GetAOVStorage(AOVBuffers* aovs, void** buffers, uint32_t* elementSizes) {
+    uint32_t count = 0;
+    if (aovs->depths) {
+        buffers[count] = aovs->depths;
+        elementSizes[count++] = sizeof(float);
+    }
+    if (aovs->normalSums) {
+        buffers[count] = aovs->normalSums;
+        elementSizes[count++] = sizeof(Vector3);
+    }
+    if (aovs->albedoSums) {
+        buffers[count] = aovs->albedoSums;
+        elementSizes[count++] = sizeof(Vector3);
+    }
+    if (aovs->materialIndices) {
+        buffers[count] = aovs->materialIndices;
+        elementSizes[count++] = sizeof(uint32_t);
+    }
+    return count;
+}
+
+// Only AOVs in flags get a buffer.
+static void AllocateAOVBuffers(AOVBuffers* aovs, uint32_t flags, uint64_t pixelCount) {
+    *aovs = {};
+    aovs->flags = flags;
+    if (flags & AOV_Depth) {
+        aovs->depths = (float*) _mm_malloc(pixelCount * sizeof(float), CACHE_LINE_SIZE);
+        for (uint64_t pixelIndex = 0; pixelIndex < pixelCount; ++pixelIndex) {
+            aovs->depths[pixelIndex] = F32Max;
+        }
+    }
+    if (flags & AOV_Normal) {
+        aovs->normalSums = (Vector3*) _mm_malloc(pixelCount * sizeof(Vector3), CACHE_LINE_SIZE);
+        for (uint64_t pixelIndex = 0; pixelIndex < pixelCount; ++pixelIndex) {
+            aovs->normalSums[pixelIndex] = {};
+        }
+    }
+    if (flags & AOV_Albedo) {
+        aovs->albedoSums = (Vector3*) _mm_malloc(pixelCount * sizeof(Vector3), CACHE_LINE_SIZE);
+        for (uint64_t pixelIndex = 0; pixelIndex < pixelCount; ++pixelIndex) {
+            aovs->albedoSums[pixelIndex] = {};
+        }
+    }
+    if (flags & AOV_MaterialID) {
+        aovs->materialIndices = (uint32_t*) _mm_malloc(pixelCount * sizeof(uint32_t), CACHE_LINE_SIZE);
+        memset(aovs->materialIndices, 0xFF, pixelCount * sizeof(uint32_t));
+    }
+}
+
+static void FreeAOVBuffers(AOVBuffers* aovs) {
+    void* buffers[4];
+    uint32_t elementSizes[4];
+    uint32_t bufferCount = GetAOVStorage(aovs, buffers, elementSizes);
+    for (uint32_t bufferIndex = 0; bufferIndex < bufferCount; ++bufferIndex) {
+        _mm_free(buffers[bufferIndex]);
+    }
+    *aovs = {};
+}
+
+// Hands out all tiles again. Converged pixels are skipped by RenderTile, so tiles that are done cost almost nothing.
+// Only call this while no thread is working on the queue.
+static void StartWorkQueuePass(WorkQueue* workQueue, uint32_t passSampleCount) {
+    workQueue->passSampleCount = passSampleCount;
+    workQueue->registeredThreadCount = 0;
+    workQueue->idleThreadCount = 0;
+    workQueue->finishedPixelCount = 0;
+    workQueue->activePixelCount = 0;
+    workQueue->isOutOfTime = false;
+
+    uint32_t threadCount = workQueue->dequeCount;
+    uint32_t workOrderCount = workQueue->workOrderCount;
+    for (uint32_t threadIndex = 0; threadIndex < threadCount; ++threadIndex) {
+        uint32_t firstOrderIndex = (uint64_t) workOrderCount * threadIndex / threadCount;
+        uint32_t endOrderIndex = (uint64_t) workOrderCount * (threadIndex + 1) / threadCount;
+
+        // Deques are LIFO for their owner, so we push them backwards.
+        WorkDeque* deque = workQueue->deques + threadIndex;
+        ClearWorkDeque(deque);
+        for (uint32_t orderIndex = endOrderIndex; orderIndex > firstOrderIndex; --orderIndex) {
+            PushWork(deque, PackWorkOrder(workQueue->workOrders[orderIndex - 1]));
+        }
+    }
+}
+
+void RaytraceWorkProc(void* arguments) {
+    WorkQueue* workQueue = (WorkQueue*) arguments;
+    workQueue->backend->raytraceWork(workQueue, false);
+}
+
+static void DenoiseWorkProc(void* arguments) {
+    Denoiser* denoiser = (Denoiser*) arguments;
+    denoiser->backend->denoiseRows(denoiser);
+}
+
+// Runs the denoiser on the accumulated radiance. Needs the normal and albedo AOVs.
+// Result is in the color buffers of denoiser->sourceIndex, FreeDenoiser when done with it.
+static void DenoiseImage(WorkQueue* workQueue, ThreadPool* threadPool, Denoiser* denoiser) {
+    Image* image = workQueue->image;
+    *denoiser = {};
+    denoiser->backend = workQueue->backend;
+    denoiser->width = image->width;
+    denoiser->height = image->height;
+    uint32_t paddedWidth = (image->width + DENOISE_ROW_ALIGNMENT - 1) / DENOISE_ROW_ALIGNMENT * DENOISE_ROW_ALIGNMENT;
+    denoiser->stride = paddedWidth + 2 * DENOISE_BORDER;
+    uint64_t bufferSize = (uint64_t) denoiser->stride * (image->height + 2 * DENOISE_BORDER) * sizeof(float);
+
+    // Zeroed, so the border has no features.
+    float* buffers[14];
+    for (uint32_t bufferIndex = 0; bufferIndex < 14; ++bufferIndex) {
+        buffers[bufferIndex] = (float*) _mm_malloc(bufferSize, CACHE_LINE_SIZE);
+        memset(buffers[bufferIndex], 0, bufferSize);
+    }
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        denoiser->color[0][axis] = buffers[axis];
+        denoiser->color[1][axis] = buffers[3 + axis];
+        denoiser->albedo[axis] = buffers[6 + axis];
+        denoiser->normal[axis] = buffers[9 + axis];
+    }
+    denoiser->variance[0] = buffers[12];
+    denoiser->variance[1] = buffers[13];
+
+    // Variance is the one of the pixel's mean luminance. Pixels with a single sample have no estimate,
+    // so we say they are all noise.
+    for (uint32_t y = 0; y < denoiser->height; ++y) {
+        for (uint32_t x = 0; x < denoiser->width; ++x) {
+            uint64_t pixelIndex = (uint64_t) y * image->width + x;
+            PixelAccumulator* pixel = workQueue->accumulators + pixelIndex;
+            if (pixel->sampleCount == 0) {
+                continue;
             }
 
-            // We use the Russian Roulette method for determining which way to go. It fits our architecture.
-            // We might do calculate reflected and refracted ray separately and apply linear interpolation
-            // between them by coefficient given from the Fresnel Equations.
-            if (RandomUnilateral(randomState) <= fresnelCoefficient) {
-                bounceRay.direction = reflectedRay;
-            } else {
-                bounceRay.direction = refractedRay;
+            float sampleCount = (float) pixel->sampleCount;
+            Vector3 color = pixel->colorSum / sampleCount;
+            Vector3 albedo = workQueue->aovs.albedoSums[pixelIndex] / sampleCount;
+            Vector3 normal = workQueue->aovs.normalSums[pixelIndex];
+            float normalLength = Lenght(normal);
+            normal = normalLength > 0.0f ? normal / normalLength : normal;
+            float variance = Luminance(color) * Luminance(color);
+            if (pixel->sampleCount > 1) {
+                variance = pixel->luminanceM2 / ((sampleCount - 1.0f) * sampleCount);
             }
-        } else {
-            // Hit nothing (sky)
-            // We just return attenuation for now. No sky color or sky emmiter.
-            result += attenuation * mat.emitColor;
-            //result = attenuation;
-            break;
+
+            uint32_t index = GetDenoiserPixelIndex(denoiser, x, y);
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                denoiser->color[0][axis][index] = color[axis];
+                denoiser->albedo[axis][index] = albedo[axis];
+                denoiser->normal[axis][index] = normal[axis];
+            }
+            denoiser->variance[0][index] = variance;
         }
     }
 
-    *bounceCount += bouncesComputed;
-    return result;
+    for (uint32_t iteration = 0; iteration < DENOISE_ITERATION_COUNT; ++iteration) {
+        denoiser->sourceIndex = iteration % 2;
+        denoiser->stepSize = 1 << iteration;
+        denoiser->nextRowIndex = 0;
+        StartThreadPoolJob(threadPool, DenoiseWorkProc, denoiser);
+        DenoiseWorkProc(denoiser);
+        WaitThreadPoolJob(threadPool);
+    }
+    denoiser->sourceIndex = DENOISE_ITERATION_COUNT % 2;
 }
 
-bool RaytraceWork(WorkQueue* workQueue) {
+static void FreeDenoiser(Denoiser* denoiser) {
+    for (uint32_t setIndex = 0; setIndex < 2; ++setIndex) {
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            _mm_free(denoiser->color[setIndex][axis]);
+        }
+        _mm_free(denoiser->variance[setIndex]);
+    }
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        _mm_free(denoiser->albedo[axis]);
+        _mm_free(denoiser->normal[axis]);
+    }
+}
 
-    uint32_t nextOrderToDo = InterlockedAddAndReturnPrevious(&workQueue->nextOrderToDo, 1);
-    if (nextOrderToDo >= workQueue->workOrderCount) {
+// Linear radiance of a pixel. From the denoised image unless denoiser is null. Pixels without samples are black.
+inline Vector3 GetResolvedPixel(WorkQueue* workQueue, Denoiser* denoiser, uint32_t x, uint32_t y) {
+    if (denoiser) {
+        uint32_t index = GetDenoiserPixelIndex(denoiser, x, y);
+        float** color = denoiser->color[denoiser->sourceIndex];
+        return Vector3(color[0][index], color[1][index], color[2][index]);
+    }
+
+    PixelAccumulator* pixel = workQueue->accumulators + ((uint64_t) y * workQueue->image->width + x);
+    Vector3 color(0.0f, 0.0f, 0.0f);
+    if (pixel->sampleCount > 0) {
+        color = pixel->colorSum / (float) pixel->sampleCount;
+    }
+    return color;
+}
+
+// Converts radiance to the packed sRGB image.
+static void ResolveImage(WorkQueue* workQueue, Denoiser* denoiser) {
+    Image* image = workQueue->image;
+    uint32_t width = image->width;
+    uint32_t height = image->height;
+    for (uint32_t y = 0; y < height; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            image->pixelData[(uint64_t) y * width + x] = RGBPackToUInt32WithsRGB(GetResolvedPixel(workQueue, denoiser, x, y));
+        }
+    }
+}
+
+// Writes radiance unclamped as PFM or EXR. Pixels are resolved a band of bandRowCount rows at a time
+// and streamed out, so there is never a second float copy of the whole image.
+static bool WriteHDRImage(WorkQueue* workQueue, Denoiser* denoiser, const char* filename, HDRFormat format,
+                          uint32_t bandRowCount) {
+    uint32_t width = workQueue->image->width;
+    uint32_t height = workQueue->image->height;
+    HDRImageWriter writer;
+    if (!BeginHDRImage(&writer, filename, format, width, height)) {
+        EndHDRImage(&writer);
+        return false;
+    }
+
+    bandRowCount = bandRowCount < height ? bandRowCount : height;
+    uint64_t bandSize = (uint64_t) width * bandRowCount * 3 * sizeof(float);
+    float* band = (float*) malloc(bandSize);
+    if (!band) {
+        fprintf(stderr, "Couldn't allocate %llu bytes for a band of %s\n", (unsigned long long) bandSize, filename);
+        EndHDRImage(&writer);
         return false;
     }
+    uint32_t bandCount = (height + bandRowCount - 1) / bandRowCount;
+    for (uint32_t bandIndex = 0; bandIndex < bandCount && !writer.hasFailed; ++bandIndex) {
+        uint32_t startRowIndex = (writer.isBottomUp ? bandCount - 1 - bandIndex : bandIndex) * bandRowCount;
+        uint32_t rowCount = height - startRowIndex < bandRowCount ? height - startRowIndex : bandRowCount;
+        for (uint32_t rowIndex = 0; rowIndex < rowCount; ++rowIndex) {
+            float* row = band + (uint64_t) rowIndex * width * 3;
+            for (uint32_t x = 0; x < width; ++x) {
+                Vector3 color = GetResolvedPixel(workQueue, denoiser, x, startRowIndex + rowIndex);
+                row[x * 3] = color.x;
+                row[x * 3 + 1] = color.y;
+                row[x * 3 + 2] = color.z;
+            }
+        }
+        WriteHDRRows(&writer, band, rowCount);
+    }
 
-    WorkOrder workOrder = workQueue->workOrders[nextOrderToDo];
-    Image* image = workOrder.image;
-    World* world = workOrder.world;
-    uint32_t startRowIndex = workOrder.startRowIndex;
-    uint32_t endRowIndex = workOrder.endRowIndex;
-    uint32_t sampleSize = workOrder.sampleSize;
+    free(band);
+    return EndHDRImage(&writer);
+}
 
-    float imageAspectRatio = (float) image->width / (float) image->height;
+// Indexed by SamplerType.
+static const char* samplerNames[] = { "random", "sobol", "bluenoise" };
+static const uint32_t samplerTypeCount = sizeof(samplerNames) / sizeof(samplerNames[0]);
+
+static const char* traceModeNames[] = { "depth first", "packet", "wavefront" };
+static const uint32_t traceModeCount = sizeof(traceModeNames) / sizeof(traceModeNames[0]);
+
+#define CHECKPOINT_FILENAME "render.checkpoint"
+#define CHECKPOINT_MAGIC 0x4B435452 // "RTCK"
+#define CHECKPOINT_VERSION 7
+
+// Checkpoints are only taken between passes. Header has the render settings, so we don't resume a different
+// render, and the pass schedule, so the resumed render runs exactly the same passes as the interrupted one would.
+// Pixel accumulators follow the header as they are in memory, then the buffers of the AOVs in flag order.
+struct CheckpointHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t accumulatorSize;
+    uint32_t width;
+    uint32_t height;
+    uint32_t sampleSize;
+    float adaptiveThreshold;
+    // Backends with different lane widths don't round the same way, so resuming with another one isn't bit-identical.
+    uint32_t laneWidth;
+    uint32_t samplerType;
+    uint32_t minBounceCount;
+    uint32_t maxBounceCount;
+    uint32_t aovFlags;
+    // Wavefront and packets aren't bit-identical to depth first tracing either. Indexed like traceModeNames.
+    uint32_t traceMode;
+    // Model file size and a hash of the loaded mesh, both zero without a model.
+    uint32_t modelHash;
+    uint64_t modelFileSize;
+
+    uint32_t passCount;
+    uint32_t uniformSampleCount;
+    uint32_t nextPassSampleCount;
+    // Header is written as is, so padding is spelled out. Zero.
+    uint32_t reserved;
+    uint64_t totalSamplesComputed;
+    uint64_t totalBouncesComputed;
+    uint64_t totalPathRaysComputed;
+};
+static_assert(sizeof(CheckpointHeader) == 104, "CheckpointHeader has padding");
+
+// Checkpoints of one model must not be resumed with another. Hashing the loaded mesh catches edits that keep the size.
+static uint32_t HashMesh(Mesh* mesh) {
+    uint32_t hash = HashCombine(mesh->vertexCount, mesh->triangleCount);
+    uint32_t* vertexWords = (uint32_t*) mesh->vertices;
+    for (uint64_t wordIndex = 0; wordIndex < (uint64_t) mesh->vertexCount * 3; ++wordIndex) {
+        hash = HashCombine(hash, vertexWords[wordIndex]);
+    }
+    for (uint64_t index = 0; index < (uint64_t) mesh->triangleCount * 3; ++index) {
+        hash = HashCombine(hash, mesh->indices[index]);
+    }
+    return hash;
+}
 
-    Camera* camera = world->camera;
-    Vector3 cameraPosition = camera->position;
-    Vector3 cameraZ = camera->zVec;
-    Vector3 cameraX = camera->xVec;
-    Vector3 cameraY = camera->yVec;
+// Accumulators are copied here between passes, and a background thread writes the copy
+// while the next pass is rendering.
+struct CheckpointWriter {
+    CheckpointHeader header;
+    uint64_t pixelCount;
+    PixelAccumulator* pixels;
+    AOVBuffers aovs;
+};
 
-    float filmDistance = 1.0;
-    Vector3 filmCenter = cameraPosition - cameraZ * filmDistance;
+static void WriteCheckpointProc(void* data) {
+    CheckpointWriter* writer = (CheckpointWriter*) data;
 
-    float filmWidth = 1.0f * imageAspectRatio;
-    float filmHeight = 1.0f;
-    
-    float halfFilmWidth = filmWidth * 0.5f;
-    float halfFilmHeight = filmHeight * 0.5f;
+    // We write a temporary file and rename it over the last checkpoint. So getting killed while writing
+    // never leaves us without a good checkpoint.
+    const char* temporaryFilename = CHECKPOINT_FILENAME ".tmp";
+    FILE* file = fopen(temporaryFilename, "wb");
+    if (!file) {
+        fprintf(stderr, "Couldn't open %s for writing\n", temporaryFilename);
+        return;
+    }
 
-    float pixelWidth = 0.5f / image->width;
-    float pixelHeight = 0.5f / image->height;
+    bool succeeded = fwrite(&writer->header, sizeof(CheckpointHeader), 1, file) == 1 &&
+        fwrite(writer->pixels, sizeof(PixelAccumulator), writer->pixelCount, file) == writer->pixelCount;
+    void* aovBuffers[4];
+    uint32_t aovElementSizes[4];
+    uint32_t aovBufferCount = GetAOVStorage(&writer->aovs, aovBuffers, aovElementSizes);
+    for (uint32_t bufferIndex = 0; bufferIndex < aovBufferCount && succeeded; ++bufferIndex) {
+        succeeded = fwrite(aovBuffers[bufferIndex], aovElementSizes[bufferIndex], writer->pixelCount, file) == writer->pixelCount;
+    }
+    succeeded = (fclose(file) == 0) && succeeded;
+    if (!succeeded || !RenameFileReplacingExisting(temporaryFilename, CHECKPOINT_FILENAME)) {
+        fprintf(stderr, "Couldn't write checkpoint %s\n", CHECKPOINT_FILENAME);
+    }
+}
 
-    uint32_t randomState = 262346 * (startRowIndex + endRowIndex * 36);
-    uint64_t totalBounces = 0;
-    
-    uint32_t* frameBuffer = image->pixelData + (startRowIndex * image->width);
-    for (int32_t y = startRowIndex; y < endRowIndex; ++y) {
-        float filmY = ((float) y / (float) image->height) * -2.0f + 1.0f;
-        for (int32_t x = 0; x < image->width; ++x) {
-            float filmX = (((float) x / (float) image->width) * 2.0f - 1.0f);
-        
-            Vector3 color(0.0f, 0.0f, 0.0f);
-            for (uint32_t sampleIndex = 0; sampleIndex < sampleSize; ++sampleIndex) {
-                float offsetX = filmX + RandomBilateral(&randomState) * pixelWidth;
-                float offsetY = filmY + RandomBilateral(&randomState) * pixelHeight;
-        
-                Vector3 filmPosition = filmCenter + cameraX * offsetX * halfFilmWidth + cameraY * halfFilmHeight * offsetY;
-        
-                Ray ray = {};
-                ray.origin = cameraPosition;
-                ray.direction = Normalize(filmPosition - cameraPosition);
+// Loads accumulators into the work queue and the pass schedule into header.
+// Returns false and prints the reason if the file is missing or was written by a different render.
+static bool ReadCheckpoint(const char* filename, WorkQueue* workQueue, CheckpointHeader* expected, CheckpointHeader* header) {
+    MappedFile file;
+    if (!MapFileReadOnly(filename, &file)) {
+        fprintf(stderr, "Couldn't open checkpoint %s\n", filename);
+        return false;
+    }
 
-                color += RaytraceWorld(world, &ray, &randomState, workQueue, &totalBounces);
+    bool isValid = false;
+    if (file.size < sizeof(CheckpointHeader)) {
+        fprintf(stderr, "Checkpoint %s is truncated\n", filename);
+    } else {
+        memcpy(header, file.data, sizeof(CheckpointHeader));
+        uint64_t pixelDataSize = workQueue->totalPixelCount * sizeof(PixelAccumulator);
+        void* aovBuffers[4];
+        uint32_t aovElementSizes[4];
+        uint32_t aovBufferCount = GetAOVStorage(&workQueue->aovs, aovBuffers, aovElementSizes);
+        uint64_t aovDataSize = 0;
+        for (uint32_t bufferIndex = 0; bufferIndex < aovBufferCount; ++bufferIndex) {
+            aovDataSize += workQueue->totalPixelCount * aovElementSizes[bufferIndex];
+        }
+        if (header->magic != CHECKPOINT_MAGIC || header->version != CHECKPOINT_VERSION ||
+            header->accumulatorSize != sizeof(PixelAccumulator)) {
+            fprintf(stderr, "%s is not a checkpoint of this raytracer version\n", filename);
+        } else if (header->width != expected->width || header->height != expected->height ||
+                   header->sampleSize != expected->sampleSize || header->adaptiveThreshold != expected->adaptiveThreshold ||
+                   header->laneWidth != expected->laneWidth || header->samplerType != expected->samplerType ||
+                   header->minBounceCount != expected->minBounceCount || header->maxBounceCount != expected->maxBounceCount ||
+                   header->aovFlags != expected->aovFlags || header->traceMode != expected->traceMode ||
+                   header->modelHash != expected->modelHash || header->modelFileSize != expected->modelFileSize) {
+            fprintf(stderr, "Checkpoint %s was rendered with different settings (%ux%u, %u spp, adaptive %g, %u-wide SIMD, "
+                    "%s sampler, depth %u to %u, AOV flags 0x%x, %s tracing, model of %llu bytes with hash %08x)\n",
+                    filename, header->width, header->height, header->sampleSize, header->adaptiveThreshold, header->laneWidth,
+                    header->samplerType < samplerTypeCount ? samplerNames[header->samplerType] : "unknown",
+                    header->minBounceCount, header->maxBounceCount, header->aovFlags,
+                    header->traceMode < traceModeCount ? traceModeNames[header->traceMode] : "unknown",
+                    (unsigned long long) header->modelFileSize, header->modelHash);
+        } else if (file.size != sizeof(CheckpointHeader) + pixelDataSize + aovDataSize) {
+            fprintf(stderr, "Checkpoint %s is truncated\n", filename);
+        } else {
+            uint8_t* pixelData = (uint8_t*) file.data + sizeof(CheckpointHeader);
+            memcpy((void*) workQueue->accumulators, pixelData, pixelDataSize);
+            pixelData += pixelDataSize;
+            for (uint32_t bufferIndex = 0; bufferIndex < aovBufferCount; ++bufferIndex) {
+                uint64_t bufferSize = workQueue->totalPixelCount * aovElementSizes[bufferIndex];
+                memcpy(aovBuffers[bufferIndex], pixelData, bufferSize);
+                pixelData += bufferSize;
             }
-            
-            *frameBuffer++ = RGBPackToUInt32WithsRGB(color / sampleSize);
+            isValid = true;
         }
     }
 
-    InterlockedAddAndReturnPrevious(&workQueue->totalBouncesComputed, totalBounces);
-    InterlockedAddAndReturnPrevious(&workQueue->finishedOrderCount, 1);
+    UnmapFile(&file);
+    return isValid;
+}
+
+// Writes where the samples went. Black is no samples, then blue, red, yellow and white at the most sampled pixel.
+static void WriteSampleCountImage(WorkQueue* workQueue, const char* filename) {
+    Image* image = workQueue->image;
+    uint32_t maxSampleCount = 1;
+    for (uint64_t pixelIndex = 0; pixelIndex < workQueue->totalPixelCount; ++pixelIndex) {
+        uint32_t sampleCount = workQueue->accumulators[pixelIndex].sampleCount;
+        maxSampleCount = sampleCount > maxSampleCount ? sampleCount : maxSampleCount;
+    }
+
+    const Vector3 heatColors[] = {
+        Vector3(0.0f, 0.0f, 0.0f),
+        Vector3(0.0f, 0.0f, 1.0f),
+        Vector3(1.0f, 0.0f, 0.0f),
+        Vector3(1.0f, 1.0f, 0.0f),
+        Vector3(1.0f, 1.0f, 1.0f),
+    };
+    const uint32_t heatSegmentCount = sizeof(heatColors) / sizeof(heatColors[0]) - 1;
+
+    Image heatmap = CreateImage(image->width, image->height);
+    for (uint64_t pixelIndex = 0; pixelIndex < workQueue->totalPixelCount; ++pixelIndex) {
+        float heat = (float) workQueue->accumulators[pixelIndex].sampleCount / (float) maxSampleCount * heatSegmentCount;
+        uint32_t segment = (uint32_t) heat;
+        if (segment >= heatSegmentCount) {
+            segment = heatSegmentCount - 1;
+        }
+        Vector3 color = Lerp(heatColors[segment], heat - segment, heatColors[segment + 1]);
+        heatmap.pixelData[pixelIndex] = RGBPackToUInt32(color);
+    }
+
+    WriteImageFile(&heatmap, filename);
+    FreeImage(&heatmap);
+}
+
+// Indexed by the bit of the AOV flag.
+static const char* aovNames[] = { "depth", "normal", "albedo", "material", "samples" };
+static const uint32_t aovTypeCount = sizeof(aovNames) / sizeof(aovNames[0]);
+
+// Comma separated AOV names, like "depth,normal". Returns false on an unknown name.
+static bool ParseAOVList(const char* list, uint32_t* flags) {
+    while (*list) {
+        const char* end = strchr(list, ',');
+        size_t length = end ? (size_t) (end - list) : strlen(list);
+        bool isKnown = false;
+        for (uint32_t typeIndex = 0; typeIndex < aovTypeCount; ++typeIndex) {
+            if (strlen(aovNames[typeIndex]) == length && strncmp(list, aovNames[typeIndex], length) == 0) {
+                *flags |= 1 << typeIndex;
+                isKnown = true;
+            }
+        }
+        if (!isKnown) {
+            return false;
+        }
+        list += end ? length + 1 : length;
+    }
     return true;
 }
 
-THREAD_PROC_RET ThreadProc(void* arguments) {
-    WorkQueue* workQueue = (WorkQueue*) arguments;
-    while (RaytraceWork(workQueue));
-    
-    return 0;
+// Writes aov_<name>.bmp for every AOV in flags. Pixels without hits are black, except depth where they are white.
+// Depth is scaled by the farthest hit, normals map -1..1 to 0..1, and every material gets a random looking color.
+static void WriteAOVImages(WorkQueue* workQueue, uint32_t flags) {
+    AOVBuffers* aovs = &workQueue->aovs;
+    Image* image = workQueue->image;
+    float maxDepth = 0.0f;
+    if (flags & AOV_Depth) {
+        for (uint64_t pixelIndex = 0; pixelIndex < workQueue->totalPixelCount; ++pixelIndex) {
+            float depth = aovs->depths[pixelIndex];
+            maxDepth = depth < F32Max && depth > maxDepth ? depth : maxDepth;
+        }
+    }
+
+    Image aovImage = CreateImage(image->width, image->height);
+    for (uint32_t typeIndex = 0; typeIndex < aovTypeCount; ++typeIndex) {
+        uint32_t flag = 1 << typeIndex;
+        if (!(flags & flag)) {
+            continue;
+        }
+
+        char filename[64];
+        snprintf(filename, sizeof(filename), "aov_%s.bmp", aovNames[typeIndex]);
+        if (flag == AOV_SampleCount) {
+            WriteSampleCountImage(workQueue, filename);
+            continue;
+        }
+
+        for (uint64_t pixelIndex = 0; pixelIndex < workQueue->totalPixelCount; ++pixelIndex) {
+            uint32_t sampleCount = workQueue->accumulators[pixelIndex].sampleCount;
+            Vector3 color(0.0f, 0.0f, 0.0f);
+            if (flag == AOV_Depth) {
+                float depth = aovs->depths[pixelIndex];
+                float value = depth < F32Max && maxDepth > 0.0f ? depth / maxDepth : 1.0f;
+                color = Vector3(value, value, value);
+            } else if (flag == AOV_Normal) {
+                Vector3 normal = aovs->normalSums[pixelIndex];
+                float normalLength = Lenght(normal);
+                if (normalLength > 0.0f) {
+                    color = normal / normalLength * 0.5f + Vector3(0.5f, 0.5f, 0.5f);
+                }
+            } else if (flag == AOV_Albedo) {
+                if (sampleCount > 0) {
+                    color = aovs->albedoSums[pixelIndex] / (float) sampleCount;
+                }
+            } else if (flag == AOV_MaterialID) {
+                uint32_t materialIndex = aovs->materialIndices[pixelIndex];
+                if (materialIndex != AOV_NO_MATERIAL) {
+                    uint32_t hash = Hash32(materialIndex + 1);
+                    color = Vector3((float) (hash & 0xFF), (float) ((hash >> 8) & 0xFF), (float) ((hash >> 16) & 0xFF)) / 255.0f;
+                }
+            }
+            // Albedo is a color, the others are data and are written as is.
+            aovImage.pixelData[pixelIndex] = flag == AOV_Albedo ? RGBPackToUInt32WithsRGB(color) : RGBPackToUInt32(color);
+        }
+        WriteImageFile(&aovImage, filename);
+    }
+    FreeImage(&aovImage);
 }
 
 int main(int argc, char** argv) {
-    Image image = CreateImage(1280, 720);
+    const char* modelFilename = 0;
+    uint32_t tileSize = 32;
+    uint32_t sampleSize = 512;
+    float adaptiveThreshold = 0.0f;
+    uint64_t budgetMs = 0;
+    uint64_t checkpointIntervalMs = 0;
+    bool resume = false;
+    const char* simdBackendName = 0;
+    bool tracePrimaryPackets = false;
+    bool traceWavefront = false;
+    SamplerType samplerType = SamplerType_Random;
+    uint32_t minBounceCount = 3;
+    uint32_t maxBounceCount = 32;
+    bool denoise = false;
+    uint32_t aovFlags = 0;
+    const char* hdrFilename = 0;
+    const char* exrCompressionName = 0;
+    bool isValidArgument = true;
+    for (int argIndex = 1; argIndex < argc && isValidArgument; ++argIndex) {
+        if (strcmp(argv[argIndex], "--model") == 0 && argIndex + 1 < argc) {
+            modelFilename = argv[++argIndex];
+        } else if (strcmp(argv[argIndex], "--tile") == 0 && argIndex + 1 < argc && atoi(argv[argIndex + 1]) > 0) {
+            tileSize = atoi(argv[++argIndex]);
+        } else if (strcmp(argv[argIndex], "--spp") == 0 && argIndex + 1 < argc && atoi(argv[argIndex + 1]) > 0) {
+            sampleSize = atoi(argv[++argIndex]);
+        } else if (strcmp(argv[argIndex], "--adaptive") == 0 && argIndex + 1 < argc && atof(argv[argIndex + 1]) > 0.0) {
+            adaptiveThreshold = (float) atof(argv[++argIndex]);
+        } else if (strcmp(argv[argIndex], "--budget-ms") == 0 && argIndex + 1 < argc && atoi(argv[argIndex + 1]) > 0) {
+            budgetMs = atoi(argv[++argIndex]);
+        } else if (strcmp(argv[argIndex], "--checkpoint-ms") == 0 && argIndex + 1 < argc && atoi(argv[argIndex + 1]) > 0) {
+            checkpointIntervalMs = atoi(argv[++argIndex]);
+        } else if (strcmp(argv[argIndex], "--resume") == 0) {
+            resume = true;
+        } else if (strcmp(argv[argIndex], "--simd") == 0 && argIndex + 1 < argc) {
+            simdBackendName = argv[++argIndex];
+        } else if (strcmp(argv[argIndex], "--packets") == 0) {
+            tracePrimaryPackets = true;
+        } else if (strcmp(argv[argIndex], "--wavefront") == 0) {
+            traceWavefront = true;
+        } else if (strcmp(argv[argIndex], "--min-depth") == 0 && argIndex + 1 < argc && atoi(argv[argIndex + 1]) >= 0) {
+            minBounceCount = atoi(argv[++argIndex]);
+        } else if (strcmp(argv[argIndex], "--max-depth") == 0 && argIndex + 1 < argc && atoi(argv[argIndex + 1]) > 0) {
+            maxBounceCount = atoi(argv[++argIndex]);
+        } else if (strcmp(argv[argIndex], "--denoise") == 0) {
+            denoise = true;
+        } else if (strcmp(argv[argIndex], "--hdr") == 0 && argIndex + 1 < argc) {
+            hdrFilename = argv[++argIndex];
+        } else if (strcmp(argv[argIndex], "--exr-compression") == 0 && argIndex + 1 < argc) {
+            exrCompressionName = argv[++argIndex];
+            isValidArgument = strcmp(exrCompressionName, "none") == 0 || strcmp(exrCompressionName, "rle") == 0;
+        } else if (strcmp(argv[argIndex], "--aov") == 0 && argIndex + 1 < argc) {
+            isValidArgument = ParseAOVList(argv[++argIndex], &aovFlags);
+        } else if (strcmp(argv[argIndex], "--sampler") == 0 && argIndex + 1 < argc) {
+            const char* samplerName = argv[++argIndex];
+            isValidArgument = false;
+            for (uint32_t typeIndex = 0; typeIndex < samplerTypeCount; ++typeIndex) {
+                if (strcmp(samplerName, samplerNames[typeIndex]) == 0) {
+                    samplerType = (SamplerType) typeIndex;
+                    isValidArgument = true;
+                }
+            }
+        } else {
+            isValidArgument = false;
+        }
+    }
 
-    World* world = CreateCornellBoxScene();
+    // Paths always end at the max depth, so a higher min depth would be silently ignored.
+    if (isValidArgument && minBounceCount > maxBounceCount) {
+        fprintf(stderr, "--min-depth %u is deeper than --max-depth %u\n", minBounceCount, maxBounceCount);
+        isValidArgument = false;
+    }
 
-    uint64_t startClock = GetTimeMilliseconds();
-    const uint32_t sampleSize = 512;
+    // HDR format comes from the extension. Compression is only a thing for EXR.
+    HDRFormat hdrFormat = HDRFormat_EXRRLE;
+    if (isValidArgument && hdrFilename) {
+        size_t length = strlen(hdrFilename);
+        if (length > 4 && strcmp(hdrFilename + length - 4, ".pfm") == 0) {
+            hdrFormat = HDRFormat_PFM;
+            if (exrCompressionName) {
+                fprintf(stderr, "--exr-compression doesn't apply to PFM output %s\n", hdrFilename);
+                isValidArgument = false;
+            }
+        } else if (length > 4 && strcmp(hdrFilename + length - 4, ".exr") == 0) {
+            if (exrCompressionName && strcmp(exrCompressionName, "none") == 0) {
+                hdrFormat = HDRFormat_EXR;
+            }
+        } else {
+            fprintf(stderr, "HDR output %s has to be .exr or .pfm\n", hdrFilename);
+            isValidArgument = false;
+        }
+    } else if (isValidArgument && exrCompressionName) {
+        fprintf(stderr, "--exr-compression needs --hdr file.exr\n");
+        isValidArgument = false;
+    }
+
+    if (!isValidArgument) {
+        fprintf(stderr, "Usage: %s [--model file.obj|file.ply] [--tile size] [--spp samples] [--adaptive error] "
+                "[--budget-ms milliseconds] [--checkpoint-ms milliseconds] [--resume] [--simd sse4|avx2|avx512] [--packets] [--wavefront] "
+                "[--sampler random|sobol|bluenoise] [--min-depth bounces] [--max-depth bounces] [--denoise] "
+                "[--aov depth,normal,albedo,material,samples] [--hdr file.exr|file.pfm] [--exr-compression none|rle]\n", argv[0]);
+        return 1;
+    }
 
+    SIMDBackend* backend = SelectSIMDBackend(simdBackendName);
+    if (!backend) {
+        return 1;
+    }
+    printf("SIMD backend: %s (%u-wide)\n", backend->name, backend->laneWidth);
+
+    // Calling thread works on jobs too, so we create one worker less than processor count.
 #if SINGLE_THREAD
-    uint32_t totalWorkOrderCount = 1;
-    WorkQueue workQueue = {};
-    workQueue.workOrders = (WorkOrder*) malloc(totalWorkOrderCount * sizeof(WorkOrder));
-    workQueue.workOrderCount = totalWorkOrderCount;
-
-    WorkOrder* workOrder = workQueue.workOrders;
-    workOrder->image = &image;
-    workOrder->world = world;
-    workOrder->startRowIndex = 0;
-    workOrder->endRowIndex = image.height;
-    workOrder->sampleSize = sampleSize;
-
-    RaytraceWork(&workQueue);
-    
+    uint32_t workerThreadCount = 0;
 #else
-    uint32_t stride = 1;
-    uint32_t totalWorkOrderCount = image.height / stride;
-    WorkQueue workQueue = {};
-    workQueue.workOrders = (WorkOrder*) malloc(totalWorkOrderCount * sizeof(WorkOrder));
-    workQueue.workOrderCount = totalWorkOrderCount;
-
-    uint32_t counter = 0;
-    for (uint32_t rowIndex = 0; rowIndex < totalWorkOrderCount; ++rowIndex) {
-        WorkOrder* workOrder = workQueue.workOrders + rowIndex;
-        workOrder->image = &image;
-        workOrder->world = world;
-        workOrder->startRowIndex = counter;
-        counter += stride;
-        workOrder->endRowIndex = counter;
-        workOrder->sampleSize = sampleSize;
-    }
-
-    uint32_t threadCount = GetNumberOfProcessors();
-    for (uint32_t threadIndex = 1; threadIndex < threadCount; ++threadIndex) {
-        Thread thread = CreateWorkThread(ThreadProc, &workQueue);
-        CloseThreadHandle(thread);
-    }
-
-    while (workQueue.finishedOrderCount < totalWorkOrderCount) {
-        if (RaytraceWork(&workQueue)) {
-            fprintf(stdout, "Raytracing %.0f%%...\r", 100 * ((float) workQueue.finishedOrderCount / totalWorkOrderCount));
-            fflush(stdout);
+    uint32_t workerThreadCount = GetNumberOfProcessors() - 1;
+#endif
+    ThreadPool* threadPool = CreateThreadPool(workerThreadCount);
+
+    Image image = CreateImage(1280, 720);
+
+    Mesh* model = 0;
+    uint64_t modelFileSize = 0;
+    if (modelFilename) {
+        model = new Mesh;
+        MeshLoadStats loadStats;
+        if (!LoadMesh(threadPool, modelFilename, model, &loadStats)) {
+            fprintf(stderr, "Couldn't load model %s\n", modelFilename);
+            return 1;
         }
+
+        modelFileSize = loadStats.fileSize;
+        double loadTimeSeconds = (loadStats.loadTimeMs > 0 ? loadStats.loadTimeMs : 1) / 1000.0;
+        printf("Model load time: %llums, %u vertices, %u triangles, %.1fMB/s, %.2fMtriangles/s\n", (unsigned long long) loadStats.loadTimeMs,
+           model->vertexCount, model->triangleCount, loadStats.fileSize / (1024.0 * 1024.0) / loadTimeSeconds,
+           model->triangleCount / 1000000.0 / loadTimeSeconds);
+    }
+
+    World* world = CreateCornellBoxScene(model);
+
+    uint64_t bvhStartClock = GetTimeMilliseconds();
+    BVHStats bvhStats;
+    backend->buildBVH(world, &bvhStats);
+    uint64_t bvhBuildTimeMs = GetTimeMilliseconds() - bvhStartClock;
+
+    float* blueNoiseMask = 0;
+    if (samplerType != SamplerType_Random) {
+        InitializeSobolTables();
+    }
+    if (samplerType == SamplerType_BlueNoise) {
+        uint64_t maskStartClock = GetTimeMilliseconds();
+        blueNoiseMask = CreateBlueNoiseMask();
+        printf("Blue noise mask: %llums\n", (unsigned long long) (GetTimeMilliseconds() - maskStartClock));
+    }
+
+    uint64_t startClock = GetTimeMilliseconds();
+
+    WorkQueue workQueue;
+    InitializeWorkQueue(&workQueue, backend, &image, world, tileSize, workerThreadCount + 1);
+    workQueue.tracePrimaryPackets = tracePrimaryPackets;
+    workQueue.traceWavefront = traceWavefront;
+    workQueue.samplerType = samplerType;
+    workQueue.minBounceCount = minBounceCount;
+    workQueue.maxBounceCount = maxBounceCount;
+    workQueue.blueNoiseMask = blueNoiseMask;
+    // Denoiser is guided by the normal and albedo AOVs, so it turns them on even if we don't write them.
+    AllocateAOVBuffers(&workQueue.aovs, aovFlags | (denoise ? AOV_Normal | AOV_Albedo : 0), workQueue.totalPixelCount);
+
+    // Without adaptive sampling every pixel gets sampleSize samples in one pass.
+    // With a time budget, we do short progressive passes instead and stop at the deadline or at sampleSize,
+    // whichever comes first. So the image we write is the best one we could get in time.
+    // Checkpoints are taken between passes, so they need short passes too.
+    // With adaptive sampling, first pass gives every pixel enough samples for a variance estimate and later passes
+    // only go to pixels that are still noisy. Samples that converged pixels didn't use go to the noisy ones,
+    // up to the total that uniform sampling would spend.
+    uint64_t sampleBudget = workQueue.totalPixelCount * sampleSize;
+    uint32_t passSampleCount = sampleSize;
+    if (budgetMs > 0) {
+        workQueue.deadlineMs = startClock + budgetMs;
+    }
+    if (budgetMs > 0 || checkpointIntervalMs > 0) {
+        passSampleCount = sampleSize < PROGRESSIVE_PASS_SAMPLE_COUNT ? sampleSize : PROGRESSIVE_PASS_SAMPLE_COUNT;
+    }
+    if (adaptiveThreshold > 0.0f) {
+        workQueue.adaptiveThreshold = adaptiveThreshold;
+        workQueue.minSampleCount = sampleSize / 8 > 2 ? sampleSize / 8 : 2;
+        workQueue.maxSampleCount = sampleSize * 2;
+        passSampleCount = workQueue.minSampleCount;
+    }
+
+    uint32_t passCount = 0;
+    uint32_t uniformSampleCount = 0; // Samples every pixel got so far when adaptive sampling is off
+
+    CheckpointHeader checkpointSettings = {};
+    checkpointSettings.magic = CHECKPOINT_MAGIC;
+    checkpointSettings.version = CHECKPOINT_VERSION;
+    checkpointSettings.accumulatorSize = sizeof(PixelAccumulator);
+    checkpointSettings.width = image.width;
+    checkpointSettings.height = image.height;
+    checkpointSettings.sampleSize = sampleSize;
+    checkpointSettings.adaptiveThreshold = adaptiveThreshold;
+    checkpointSettings.laneWidth = backend->laneWidth;
+    checkpointSettings.samplerType = samplerType;
+    checkpointSettings.minBounceCount = minBounceCount;
+    checkpointSettings.maxBounceCount = maxBounceCount;
+    checkpointSettings.aovFlags = workQueue.aovs.flags;
+    checkpointSettings.traceMode = traceWavefront ? 2 : (tracePrimaryPackets ? 1 : 0);
+    if (model && (resume || checkpointIntervalMs > 0)) {
+        checkpointSettings.modelHash = HashMesh(model);
+        checkpointSettings.modelFileSize = modelFileSize;
+    }
+
+    if (resume) {
+        CheckpointHeader checkpoint;
+        if (!ReadCheckpoint(CHECKPOINT_FILENAME, &workQueue, &checkpointSettings, &checkpoint)) {
+            return 1;
+        }
+
+        passCount = checkpoint.passCount;
+        uniformSampleCount = checkpoint.uniformSampleCount;
+        passSampleCount = checkpoint.nextPassSampleCount;
+        workQueue.totalSamplesComputed = checkpoint.totalSamplesComputed;
+        workQueue.totalBouncesComputed = checkpoint.totalBouncesComputed;
+        workQueue.totalPathRaysComputed = checkpoint.totalPathRaysComputed;
+        printf("Resuming from pass %u, %.1f samples per pixel\n", passCount,
+               (double) workQueue.totalSamplesComputed / workQueue.totalPixelCount);
+    }
+
+    // Checkpoint file is written by its own thread, so rendering only waits for the copy of the accumulators.
+    ThreadPool* checkpointThreadPool = 0;
+    CheckpointWriter checkpointWriter = {};
+    uint64_t lastCheckpointClock = startClock;
+    uint64_t checkpointStallMs = 0;
+    uint32_t checkpointCount = 0;
+    if (checkpointIntervalMs > 0) {
+        checkpointThreadPool = CreateThreadPool(1);
+        checkpointWriter.pixelCount = workQueue.totalPixelCount;
+        checkpointWriter.pixels = (PixelAccumulator*) _mm_malloc(workQueue.totalPixelCount * sizeof(PixelAccumulator), CACHE_LINE_SIZE);
+        AllocateAOVBuffers(&checkpointWriter.aovs, workQueue.aovs.flags, workQueue.totalPixelCount);
+    }
+
+    for (;;) {
+        StartWorkQueuePass(&workQueue, passSampleCount);
+        StartThreadPoolJob(threadPool, RaytraceWorkProc, &workQueue);
+        backend->raytraceWork(&workQueue, true);
+        WaitThreadPoolJob(threadPool);
+        ++passCount;
+        uniformSampleCount += passSampleCount;
+
+        if (workQueue.isOutOfTime) {
+            printf("Time budget ran out in pass %u\n", passCount);
+            break;
+        }
+
+        if (workQueue.activePixelCount == 0 || workQueue.totalSamplesComputed >= sampleBudget) {
+            break;
+        }
+
+        if (adaptiveThreshold > 0.0f) {
+            printf("Pass %u: %.1f%% of pixels still noisy\n", passCount, 100.0 * workQueue.activePixelCount / workQueue.totalPixelCount);
+            passSampleCount = sampleSize / 16 > 1 ? sampleSize / 16 : 1;
+        } else {
+            uint32_t remainingSampleCount = sampleSize - uniformSampleCount;
+            passSampleCount = remainingSampleCount < passSampleCount ? remainingSampleCount : passSampleCount;
+        }
+
+        uint64_t passEndClock = GetTimeMilliseconds();
+        if (checkpointThreadPool && passEndClock - lastCheckpointClock >= checkpointIntervalMs) {
+            // Previous write is long done unless the disk is slower than the checkpoint interval.
+            WaitThreadPoolJob(checkpointThreadPool);
+
+            CheckpointHeader* header = &checkpointWriter.header;
+            *header = checkpointSettings;
+            header->passCount = passCount;
+            header->uniformSampleCount = uniformSampleCount;
+            header->nextPassSampleCount = passSampleCount;
+            header->totalSamplesComputed = workQueue.totalSamplesComputed;
+            header->totalBouncesComputed = workQueue.totalBouncesComputed;
+            header->totalPathRaysComputed = workQueue.totalPathRaysComputed;
+            memcpy((void*) checkpointWriter.pixels, workQueue.accumulators, workQueue.totalPixelCount * sizeof(PixelAccumulator));
+            void* aovBuffers[4];
+            void* aovCopies[4];
+            uint32_t aovElementSizes[4];
+            uint32_t aovBufferCount = GetAOVStorage(&workQueue.aovs, aovBuffers, aovElementSizes);
+            GetAOVStorage(&checkpointWriter.aovs, aovCopies, aovElementSizes);
+            for (uint32_t bufferIndex = 0; bufferIndex < aovBufferCount; ++bufferIndex) {
+                memcpy(aovCopies[bufferIndex], aovBuffers[bufferIndex], workQueue.totalPixelCount * aovElementSizes[bufferIndex]);
+            }
+            StartThreadPoolJob(checkpointThreadPool, WriteCheckpointProc, &checkpointWriter);
+
+            lastCheckpointClock = GetTimeMilliseconds();
+            checkpointStallMs += lastCheckpointClock - passEndClock;
+            ++checkpointCount;
+        }
+    }
+
+    if (checkpointThreadPool) {
+        WaitThreadPoolJob(checkpointThreadPool);
+        DestroyThreadPool(checkpointThreadPool);
+        _mm_free(checkpointWriter.pixels);
+        FreeAOVBuffers(&checkpointWriter.aovs);
+        printf("Checkpoints: %u written to %s, rendering waited %llums for them\n", checkpointCount, CHECKPOINT_FILENAME,
+               (unsigned long long) checkpointStallMs);
     }
-#endif
 
     uint64_t endClock =  GetTimeMilliseconds();
     
     uint64_t timeElapsedMs = endClock - startClock;
     uint64_t bouncesComputed = workQueue.totalBouncesComputed;
-    printf("Raytracing time: %llums\n", timeElapsedMs);
-    printf("Total computed rays: %llu\n", bouncesComputed);
+    printf("Raytracing time: %llums\n", (unsigned long long) timeElapsedMs);
+    printf("Total computed rays: %llu\n", (unsigned long long) bouncesComputed);
     printf("Performance: %.1fMray/s, %fms/ray\n", (bouncesComputed / 1000.0) / timeElapsedMs,
        (double) timeElapsedMs / (double) bouncesComputed);
+    printf("Samples: %llu in %u passes, %.1f per pixel\n", (unsigned long long) workQueue.totalSamplesComputed, passCount,
+       (double) workQueue.totalSamplesComputed / workQueue.totalPixelCount);
+    printf("Average path length: %.2f rays (depth %u to %u)\n",
+       (double) workQueue.totalPathRaysComputed / (workQueue.totalSamplesComputed ? workQueue.totalSamplesComputed : 1),
+       minBounceCount, maxBounceCount);
+    printf("BVH build time: %llums, %u binary nodes, %u wide nodes (%u-wide), %u leaves, max depth %u\n", (unsigned long long) bvhBuildTimeMs,
+       bvhStats.nodeCount, bvhStats.wideNodeCount, backend->laneWidth, bvhStats.leafCount, bvhStats.maxDepth);
     
+    Denoiser denoiser;
+    if (denoise) {
+        uint64_t denoiseStartClock = GetTimeMilliseconds();
+        DenoiseImage(&workQueue, threadPool, &denoiser);
+        printf("Denoise time: %llums\n", (unsigned long long) (GetTimeMilliseconds() - denoiseStartClock));
+    }
+    ResolveImage(&workQueue, denoise ? &denoiser : 0);
     WriteImageFile(&image, "render.bmp");
+    if (hdrFilename) {
+        uint64_t hdrStartClock = GetTimeMilliseconds();
+        if (WriteHDRImage(&workQueue, denoise ? &denoiser : 0, hdrFilename, hdrFormat, tileSize)) {
+            printf("HDR image: %s in %llums\n", hdrFilename, (unsigned long long) (GetTimeMilliseconds() - hdrStartClock));
+        } else {
+            fprintf(stderr, "Couldn't write %s\n", hdrFilename);
+        }
+    }
+    if (denoise) {
+        FreeDenoiser(&denoiser);
+    }
+    if (adaptiveThreshold > 0.0f) {
+        WriteSampleCountImage(&workQueue, "samples.bmp");
+    }
+    WriteAOVImages(&workQueue, aovFlags);
+    FreeAOVBuffers(&workQueue.aovs);
+
+    DestroyThreadPool(threadPool);
     return 0;
 }
@@ -44,7 +44,7 @@ inline Vector4& Matrix4::operator[](int index) {
     return data[index];
 }
 
-inline Vector4 operator*(Matrix4& left, Vector4& right) {
+inline Vector4 operator*(Matrix4 left, Vector4 right) {
     Vector4 result;
     result.x = DotProduct(left[0], right);
     result.y = DotProduct(left[1], right);
@@ -54,7 +54,7 @@ inline Vector4 operator*(Matrix4& left, Vector4& right) {
     return result;
 }
 
-inline Matrix4 operator*(Matrix4& left, Matrix4& right) {
+inline Matrix4 operator*(Matrix4 left, Matrix4 right) {
     Matrix4 result;
     for (uint32_t row = 0; row < 4; ++row) {
         Vector4 rowVector = left[row];
@@ -79,7 +79,7 @@ inline Matrix4 Transpose(Matrix4& mat) {
     return result;
 }
 
-inline Matrix4 Inverse(Matrix4& mat) {
+inline Matrix4 Inverse(Matrix4 mat) {
     // Matrix inverse code copied from Doom3 source
     // Using adjugate formula to calculate inverse of matrix
     // TODO: We should check the matrix is invertible!!
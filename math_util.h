@@ -21,6 +21,14 @@ inline float Clamp(float low, float value, float high) {
     }
 }
 
+inline float Min(float left, float right) {
+    return left < right ? left : right;
+}
+
+inline float Max(float left, float right) {
+    return left > right ? left : right;
+}
+
 inline Vector3 Lerp(Vector3 left, float factor, Vector3 right) {
     return left * (1.0f - factor) + right * factor;
 }
@@ -41,8 +49,23 @@ inline uint32_t XOrShift32(uint32_t *state)
     return x;
 }
 
+// lowbias32 from https://nullprogram.com/blog/2018/07/31/
+// It's a bijection and only zero maps to zero, so any non-zero input gives a valid xorshift state.
+inline uint32_t Hash32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// Top 23 bits of the state go into the mantissa of a float in [1, 2), so we get [0, 1) without a division.
 inline float RandomUnilateral(uint32_t *state) {
-    return (float) XOrShift32(state) / (float) U32Max;
+    uint32_t bits = (XOrShift32(state) >> 9) | 0x3F800000;
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result - 1.0f;
 }
 
 inline float RandomBilateral(uint32_t *state) {
@@ -92,6 +115,37 @@ inline float Schlick(Vector3 incidentVector, Vector3 normal,
     return r0 + (1 - r0) * powf((1 - cosine), 5);
 } 
 
+// Branchless orthonormal basis around a unit vector.
+// Duff et al. 2017, "Building an Orthonormal Basis, Revisited"
+inline void OrthonormalBasis(Vector3 normal, Vector3* tangent, Vector3* bitangent) {
+    float sign = copysignf(1.0f, normal.z);
+    float a = -1.0f / (sign + normal.z);
+    float b = normal.x * normal.y * a;
+    *tangent = Vector3(1.0f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+    *bitangent = Vector3(b, sign + normal.y * normal.y * a, -normal.y);
+}
+
+// Cosine weighted direction around normal. PDF is cos(theta) / PI, so Lambert BRDF * cos / PDF is just the albedo.
+inline Vector3 SampleCosineHemisphere(Vector3 normal, float u1, float u2) {
+    float radius = sqrtf(u1);
+    float phi = 2.0f * PI * u2;
+
+    Vector3 tangent, bitangent;
+    OrthonormalBasis(normal, &tangent, &bitangent);
+    return tangent * (radius * cosf(phi)) + bitangent * (radius * sinf(phi)) + normal * sqrtf(Max(0.0f, 1.0f - u1));
+}
+
+// Power heuristic with beta = 2 for combining two sampling strategies. Returns weight of the first one.
+inline float PowerHeuristic(float pdf, float otherPdf) {
+    float pdfSquared = pdf * pdf;
+    float otherPdfSquared = otherPdf * otherPdf;
+    return pdfSquared / (pdfSquared + otherPdfSquared);
+}
+
+inline float Luminance(Vector3 color) {
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
 inline uint32_t RGBPackToUInt32(Vector3 color) {
     return (255 << 24 |
       (int32_t) (255 * color.x) << 16 |
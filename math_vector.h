@@ -170,6 +170,19 @@ inline Vector3 Normalize(const Vector3 v) {
     return Vector3(v.x * factor, v.y * factor, v.z * factor);
 }
 
+// NOTE: We don't use fminf/fmaxf here. Compiler can't inline them without fast-math, so they become library calls.
+inline Vector3 Min(const Vector3 v1, const Vector3 v2) {
+    return Vector3(v1.x < v2.x ? v1.x : v2.x,
+                   v1.y < v2.y ? v1.y : v2.y,
+                   v1.z < v2.z ? v1.z : v2.z);
+}
+
+inline Vector3 Max(const Vector3 v1, const Vector3 v2) {
+    return Vector3(v1.x > v2.x ? v1.x : v2.x,
+                   v1.y > v2.y ? v1.y : v2.y,
+                   v1.z > v2.z ? v1.z : v2.z);
+}
+
 // Vector4
 struct Vector4 {
     float x, y, z, w = 0.0f;
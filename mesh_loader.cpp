@@ -0,0 +1,776 @@
+#include "mesh_loader.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// Every parse step is split into independent jobs that run on the thread pool.
+// The calling thread works on the jobs too, so this also works when the pool has no workers.
+struct LoaderJobQueue {
+    uint32_t jobCount;
+    void (*jobProc)(void* data, uint32_t jobIndex);
+    void* data;
+    volatile uint32_t nextJobToDo;
+};
+
+static void LoaderWorkProc(void* arguments) {
+    LoaderJobQueue* queue = (LoaderJobQueue*) arguments;
+    for (;;) {
+        uint32_t jobIndex = InterlockedAddAndReturnPrevious(&queue->nextJobToDo, 1);
+        if (jobIndex >= queue->jobCount) {
+            break;
+        }
+        queue->jobProc(queue->data, jobIndex);
+    }
+}
+
+static void RunLoaderJobs(ThreadPool* pool, uint32_t jobCount, void (*jobProc)(void*, uint32_t), void* data) {
+    LoaderJobQueue queue = {};
+    queue.jobCount = jobCount;
+    queue.jobProc = jobProc;
+    queue.data = data;
+
+    StartThreadPoolJob(pool, LoaderWorkProc, &queue);
+    LoaderWorkProc(&queue);
+    WaitThreadPoolJob(pool);
+}
+
+// Splits itemCount items into jobs so every job reads about MESH_LOADER_MIN_CHUNK_SIZE bytes.
+inline uint32_t GetJobCount(uint64_t itemCount, uint64_t itemSize) {
+    uint64_t jobCount = (itemCount * itemSize) / MESH_LOADER_MIN_CHUNK_SIZE;
+    if (jobCount < 1) {
+        jobCount = 1;
+    }
+    if (jobCount > itemCount) {
+        jobCount = itemCount;
+    }
+    return (uint32_t) jobCount;
+}
+
+inline uint64_t GetJobFirstItem(uint64_t itemCount, uint32_t jobCount, uint32_t jobIndex) {
+    return (itemCount * jobIndex) / jobCount;
+}
+
+static void AllocateMesh(Mesh* mesh, uint32_t vertexCount, uint32_t triangleCount) {
+    mesh->vertexCount = vertexCount;
+    mesh->vertices = new Vector3[vertexCount];
+    mesh->triangleCount = triangleCount;
+    mesh->indices = new uint32_t[triangleCount * 3];
+    mesh->materialIndex = 0;
+}
+
+static void FreeMesh(Mesh* mesh) {
+    delete[] mesh->vertices;
+    delete[] mesh->indices;
+    *mesh = {};
+}
+
+//
+// OBJ
+//
+
+inline bool IsBlank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+inline bool IsLineEnd(char c) {
+    return c == '\n' || c == '\r';
+}
+
+inline bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+inline const char* SkipBlanks(const char* cursor, const char* end) {
+    while (cursor < end && IsBlank(*cursor)) {
+        ++cursor;
+    }
+    return cursor;
+}
+
+inline const char* SkipLine(const char* cursor, const char* end) {
+    const char* lineEnd = (const char*) memchr(cursor, '\n', end - cursor);
+    return lineEnd ? lineEnd + 1 : end;
+}
+
+inline const char* SkipToken(const char* cursor, const char* end) {
+    while (cursor < end && !IsBlank(*cursor) && !IsLineEnd(*cursor)) {
+        ++cursor;
+    }
+    return cursor;
+}
+
+inline bool IsTokenStart(const char* cursor, const char* end) {
+    return cursor < end && !IsLineEnd(*cursor) && *cursor != '#';
+}
+
+// Checks for single character keywords like "v" or "f". "vn", "vt" etc. don't match.
+inline bool IsKeyword(const char* cursor, const char* end, char keyword) {
+    return cursor + 1 < end && cursor[0] == keyword && IsBlank(cursor[1]);
+}
+
+// strtof is locale dependent and way too slow for files with millions of numbers.
+// Returns 0 if there is no number at cursor.
+static const char* ParseFloat(const char* cursor, const char* end, float* result) {
+    static const double powersOf10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    bool negative = false;
+    if (cursor < end && (*cursor == '-' || *cursor == '+')) {
+        negative = *cursor == '-';
+        ++cursor;
+    }
+
+    double mantissa = 0.0;
+    int32_t exponent = 0;
+    bool hasDigits = false;
+    while (cursor < end && IsDigit(*cursor)) {
+        mantissa = mantissa * 10.0 + (*cursor - '0');
+        hasDigits = true;
+        ++cursor;
+    }
+    if (cursor < end && *cursor == '.') {
+        ++cursor;
+        while (cursor < end && IsDigit(*cursor)) {
+            mantissa = mantissa * 10.0 + (*cursor - '0');
+            --exponent;
+            hasDigits = true;
+            ++cursor;
+        }
+    }
+    if (!hasDigits) {
+        return 0;
+    }
+
+    if (cursor < end && (*cursor == 'e' || *cursor == 'E')) {
+        ++cursor;
+        bool negativeExponent = false;
+        if (cursor < end && (*cursor == '-' || *cursor == '+')) {
+            negativeExponent = *cursor == '-';
+            ++cursor;
+        }
+        if (cursor >= end || !IsDigit(*cursor)) {
+            return 0;
+        }
+        int32_t value = 0;
+        while (cursor < end && IsDigit(*cursor)) {
+            if (value < 10000) {
+                value = value * 10 + (*cursor - '0');
+            }
+            ++cursor;
+        }
+        exponent += negativeExponent ? -value : value;
+    }
+
+    double value = mantissa;
+    if (exponent < 0) {
+        value = exponent >= -22 ? value / powersOf10[-exponent] : value * pow(10.0, exponent);
+    } else if (exponent > 0) {
+        value = exponent <= 22 ? value * powersOf10[exponent] : value * pow(10.0, exponent);
+    }
+
+    *result = (float) (negative ? -value : value);
+    return cursor;
+}
+
+static const char* ParseInteger(const char* cursor, const char* end, int64_t* result) {
+    bool negative = false;
+    if (cursor < end && (*cursor == '-' || *cursor == '+')) {
+        negative = *cursor == '-';
+        ++cursor;
+    }
+    if (cursor >= end || !IsDigit(*cursor)) {
+        return 0;
+    }
+
+    int64_t value = 0;
+    while (cursor < end && IsDigit(*cursor)) {
+        if (value < U32Max) {
+            value = value * 10 + (*cursor - '0');
+        }
+        ++cursor;
+    }
+
+    *result = negative ? -value : value;
+    return cursor;
+}
+
+// Chunks always start at the beginning of a line and end after a new line character.
+struct OBJChunk {
+    const char* start;
+    const char* end;
+    uint32_t vertexCount;
+    uint32_t triangleCount;
+    uint32_t vertexOffset;
+    uint32_t triangleOffset;
+    bool failed;
+};
+
+struct OBJLoader {
+    uint32_t chunkCount;
+    OBJChunk* chunks;
+    Mesh* mesh;
+};
+
+// First pass. We only count lines here, so we can allocate mesh arrays once and every chunk knows where to write.
+static void CountOBJChunk(void* data, uint32_t jobIndex) {
+    OBJLoader* loader = (OBJLoader*) data;
+    OBJChunk* chunk = loader->chunks + jobIndex;
+    const char* cursor = chunk->start;
+    const char* end = chunk->end;
+
+    uint64_t vertexCount = 0;
+    uint64_t triangleCount = 0;
+    while (cursor < end) {
+        cursor = SkipBlanks(cursor, end);
+        if (IsKeyword(cursor, end, 'v')) {
+            ++vertexCount;
+        } else if (IsKeyword(cursor, end, 'f')) {
+            // Polygons are triangulated as fans
+            uint32_t cornerCount = 0;
+            cursor = SkipBlanks(cursor + 1, end);
+            while (IsTokenStart(cursor, end)) {
+                ++cornerCount;
+                cursor = SkipBlanks(SkipToken(cursor, end), end);
+            }
+            if (cornerCount >= 3) {
+                triangleCount += cornerCount - 2;
+            }
+        }
+        cursor = SkipLine(cursor, end);
+    }
+
+    chunk->vertexCount = (uint32_t) vertexCount;
+    chunk->triangleCount = (uint32_t) triangleCount;
+    chunk->failed = vertexCount >= U32Max || triangleCount >= U32Max;
+}
+
+// Second pass. Positions and fan triangulated faces are written straight into mesh arrays.
+// Everything else (normals, texture coordinates, groups, materials) is skipped.
+static void ParseOBJChunk(void* data, uint32_t jobIndex) {
+    OBJLoader* loader = (OBJLoader*) data;
+    OBJChunk* chunk = loader->chunks + jobIndex;
+    Mesh* mesh = loader->mesh;
+    const char* cursor = chunk->start;
+    const char* end = chunk->end;
+
+    Vector3* vertex = mesh->vertices + chunk->vertexOffset;
+    uint32_t* index = mesh->indices + chunk->triangleOffset * 3;
+    // Negative indices are relative to the vertices defined before the face.
+    int64_t definedVertexCount = chunk->vertexOffset;
+
+    while (cursor < end) {
+        cursor = SkipBlanks(cursor, end);
+        if (IsKeyword(cursor, end, 'v')) {
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                cursor = ParseFloat(SkipBlanks(cursor + 1, end), end, &(*vertex)[axis]);
+                if (!cursor) {
+                    chunk->failed = true;
+                    return;
+                }
+            }
+            ++vertex;
+            ++definedVertexCount;
+        } else if (IsKeyword(cursor, end, 'f')) {
+            uint32_t cornerCount = 0;
+            uint32_t firstIndex = 0;
+            uint32_t previousIndex = 0;
+            cursor = SkipBlanks(cursor + 1, end);
+            while (IsTokenStart(cursor, end)) {
+                // Corners can be "v", "v/vt", "v//vn" or "v/vt/vn". We only need the position index.
+                int64_t objIndex;
+                cursor = ParseInteger(cursor, end, &objIndex);
+                if (!cursor || objIndex == 0) {
+                    chunk->failed = true;
+                    return;
+                }
+                int64_t vertexIndex = objIndex > 0 ? objIndex - 1 : definedVertexCount + objIndex;
+                if (vertexIndex < 0 || vertexIndex >= mesh->vertexCount) {
+                    chunk->failed = true;
+                    return;
+                }
+
+                if (cornerCount == 0) {
+                    firstIndex = (uint32_t) vertexIndex;
+                } else if (cornerCount >= 2) {
+                    index[0] = firstIndex;
+                    index[1] = previousIndex;
+                    index[2] = (uint32_t) vertexIndex;
+                    index += 3;
+                }
+                previousIndex = (uint32_t) vertexIndex;
+                ++cornerCount;
+
+                cursor = SkipBlanks(SkipToken(cursor, end), end);
+            }
+        }
+        cursor = SkipLine(cursor, end);
+    }
+}
+
+static bool LoadOBJ(ThreadPool* pool, const char* data, uint64_t size, Mesh* mesh) {
+    const char* fileEnd = data + size;
+
+    uint64_t maxChunkCount = size / MESH_LOADER_MIN_CHUNK_SIZE + 1;
+    OBJLoader loader = {};
+    loader.chunks = new OBJChunk[maxChunkCount];
+    loader.mesh = mesh;
+
+    // Chunk boundaries are moved forward to the next line, so no line is split between two chunks.
+    const char* chunkStart = data;
+    while (chunkStart < fileEnd) {
+        OBJChunk* chunk = loader.chunks + loader.chunkCount++;
+        *chunk = {};
+        chunk->start = chunkStart;
+        chunk->end = fileEnd;
+        if ((uint64_t) (fileEnd - chunkStart) > MESH_LOADER_MIN_CHUNK_SIZE) {
+            chunk->end = SkipLine(chunkStart + MESH_LOADER_MIN_CHUNK_SIZE, fileEnd);
+        }
+        chunkStart = chunk->end;
+    }
+
+    RunLoaderJobs(pool, loader.chunkCount, CountOBJChunk, &loader);
+
+    uint64_t vertexCount = 0;
+    uint64_t triangleCount = 0;
+    bool failed = false;
+    for (uint32_t chunkIndex = 0; chunkIndex < loader.chunkCount; ++chunkIndex) {
+        OBJChunk* chunk = loader.chunks + chunkIndex;
+        chunk->vertexOffset = (uint32_t) vertexCount;
+        chunk->triangleOffset = (uint32_t) triangleCount;
+        vertexCount += chunk->vertexCount;
+        triangleCount += chunk->triangleCount;
+        failed |= chunk->failed;
+    }
+
+    if (failed || vertexCount >= U32Max || triangleCount * 3 >= U32Max) {
+        fprintf(stderr, "OBJ file is too big\n");
+        delete[] loader.chunks;
+        return false;
+    }
+    if (triangleCount == 0) {
+        fprintf(stderr, "OBJ file doesn't have any faces\n");
+        delete[] loader.chunks;
+        return false;
+    }
+
+    AllocateMesh(mesh, (uint32_t) vertexCount, (uint32_t) triangleCount);
+    RunLoaderJobs(pool, loader.chunkCount, ParseOBJChunk, &loader);
+
+    for (uint32_t chunkIndex = 0; chunkIndex < loader.chunkCount; ++chunkIndex) {
+        failed |= loader.chunks[chunkIndex].failed;
+    }
+    delete[] loader.chunks;
+
+    if (failed) {
+        fprintf(stderr, "OBJ file has malformed vertices or faces\n");
+        FreeMesh(mesh);
+        return false;
+    }
+
+    return true;
+}
+
+//
+// PLY
+//
+
+enum PLYType {
+    PLYType_Invalid,
+    PLYType_Int8,
+    PLYType_UInt8,
+    PLYType_Int16,
+    PLYType_UInt16,
+    PLYType_Int32,
+    PLYType_UInt32,
+    PLYType_Float32,
+    PLYType_Float64,
+};
+
+static uint32_t ParsePLYType(const char* name) {
+    if (strcmp(name, "char") == 0 || strcmp(name, "int8") == 0) return PLYType_Int8;
+    if (strcmp(name, "uchar") == 0 || strcmp(name, "uint8") == 0) return PLYType_UInt8;
+    if (strcmp(name, "short") == 0 || strcmp(name, "int16") == 0) return PLYType_Int16;
+    if (strcmp(name, "ushort") == 0 || strcmp(name, "uint16") == 0) return PLYType_UInt16;
+    if (strcmp(name, "int") == 0 || strcmp(name, "int32") == 0) return PLYType_Int32;
+    if (strcmp(name, "uint") == 0 || strcmp(name, "uint32") == 0) return PLYType_UInt32;
+    if (strcmp(name, "float") == 0 || strcmp(name, "float32") == 0) return PLYType_Float32;
+    if (strcmp(name, "double") == 0 || strcmp(name, "float64") == 0) return PLYType_Float64;
+    return PLYType_Invalid;
+}
+
+inline uint32_t GetPLYTypeSize(uint32_t type) {
+    switch (type) {
+        case PLYType_Int8: case PLYType_UInt8: return 1;
+        case PLYType_Int16: case PLYType_UInt16: return 2;
+        case PLYType_Int32: case PLYType_UInt32: case PLYType_Float32: return 4;
+        case PLYType_Float64: return 8;
+        default: return 0;
+    }
+}
+
+// Data is not aligned in PLY files, so we memcpy everything. Only little endian files are supported.
+inline int64_t ReadPLYInteger(const uint8_t* data, uint32_t type) {
+    switch (type) {
+        case PLYType_Int8: { int8_t value; memcpy(&value, data, 1); return value; }
+        case PLYType_UInt8: { uint8_t value; memcpy(&value, data, 1); return value; }
+        case PLYType_Int16: { int16_t value; memcpy(&value, data, 2); return value; }
+        case PLYType_UInt16: { uint16_t value; memcpy(&value, data, 2); return value; }
+        case PLYType_Int32: { int32_t value; memcpy(&value, data, 4); return value; }
+        case PLYType_UInt32: { uint32_t value; memcpy(&value, data, 4); return value; }
+        case PLYType_Float32: { float value; memcpy(&value, data, 4); return (int64_t) value; }
+        case PLYType_Float64: { double value; memcpy(&value, data, 8); return (int64_t) value; }
+        default: return 0;
+    }
+}
+
+inline float ReadPLYFloat(const uint8_t* data, uint32_t type) {
+    if (type == PLYType_Float32) {
+        float value;
+        memcpy(&value, data, 4);
+        return value;
+    } else if (type == PLYType_Float64) {
+        double value;
+        memcpy(&value, data, 8);
+        return (float) value;
+    }
+    return (float) ReadPLYInteger(data, type);
+}
+
+struct PLYLoader {
+    const uint8_t* vertexData;
+    uint32_t vertexCount;
+    uint32_t vertexStride;
+    uint32_t positionOffsets[3];
+    uint32_t positionTypes[3];
+
+    // Faces are "<prefix properties> <list count> <indices> <suffix properties>"
+    const uint8_t* faceData;
+    const uint8_t* fileEnd;
+    uint32_t faceCount;
+    uint32_t facePrefixSize;
+    uint32_t faceCountType;
+    uint32_t faceIndexType;
+    uint32_t faceSuffixSize;
+
+    uint32_t vertexJobCount;
+    uint32_t faceJobCount;
+    Mesh* mesh;
+
+    volatile bool hasNonTriangleFaces;
+    volatile bool hasInvalidIndices;
+};
+
+static void ParsePLYVertices(void* data, uint32_t jobIndex) {
+    PLYLoader* loader = (PLYLoader*) data;
+    uint32_t firstVertex = (uint32_t) GetJobFirstItem(loader->vertexCount, loader->vertexJobCount, jobIndex);
+    uint32_t endVertex = (uint32_t) GetJobFirstItem(loader->vertexCount, loader->vertexJobCount, jobIndex + 1);
+
+    const uint8_t* vertexData = loader->vertexData + (uint64_t) firstVertex * loader->vertexStride;
+    Vector3* vertices = loader->mesh->vertices;
+    for (uint32_t vertexIndex = firstVertex; vertexIndex < endVertex; ++vertexIndex) {
+        Vector3* vertex = vertices + vertexIndex;
+        vertex->x = ReadPLYFloat(vertexData + loader->positionOffsets[0], loader->positionTypes[0]);
+        vertex->y = ReadPLYFloat(vertexData + loader->positionOffsets[1], loader->positionTypes[1]);
+        vertex->z = ReadPLYFloat(vertexData + loader->positionOffsets[2], loader->positionTypes[2]);
+        vertexData += loader->vertexStride;
+    }
+}
+
+// Almost every PLY file out there is triangles only. Then faces have a fixed size and we can jump to any face.
+// If we find a face that isn't a triangle, we give up and fall back to ParsePLYPolygons.
+static void ParsePLYTriangles(void* data, uint32_t jobIndex) {
+    PLYLoader* loader = (PLYLoader*) data;
+    uint32_t countSize = GetPLYTypeSize(loader->faceCountType);
+    uint32_t indexSize = GetPLYTypeSize(loader->faceIndexType);
+    uint32_t faceStride = loader->facePrefixSize + countSize + 3 * indexSize + loader->faceSuffixSize;
+
+    uint32_t firstFace = (uint32_t) GetJobFirstItem(loader->faceCount, loader->faceJobCount, jobIndex);
+    uint32_t endFace = (uint32_t) GetJobFirstItem(loader->faceCount, loader->faceJobCount, jobIndex + 1);
+
+    const uint8_t* faceData = loader->faceData + (uint64_t) firstFace * faceStride;
+    uint32_t* indices = loader->mesh->indices + (uint64_t) firstFace * 3;
+    uint32_t vertexCount = loader->vertexCount;
+    for (uint32_t faceIndex = firstFace; faceIndex < endFace; ++faceIndex) {
+        const uint8_t* listData = faceData + loader->facePrefixSize;
+        if (ReadPLYInteger(listData, loader->faceCountType) != 3) {
+            loader->hasNonTriangleFaces = true;
+            return;
+        }
+        listData += countSize;
+        for (uint32_t corner = 0; corner < 3; ++corner) {
+            int64_t vertexIndex = ReadPLYInteger(listData + corner * indexSize, loader->faceIndexType);
+            if (vertexIndex < 0 || vertexIndex >= vertexCount) {
+                loader->hasInvalidIndices = true;
+                return;
+            }
+            indices[corner] = (uint32_t) vertexIndex;
+        }
+        indices += 3;
+        faceData += faceStride;
+    }
+}
+
+// Polygon faces have variable size, so we can't split them between threads without scanning them first.
+// Scanning is as expensive as parsing, so this path is single threaded.
+static bool ParsePLYPolygons(PLYLoader* loader) {
+    uint32_t countSize = GetPLYTypeSize(loader->faceCountType);
+    uint32_t indexSize = GetPLYTypeSize(loader->faceIndexType);
+
+    uint64_t triangleCount = 0;
+    const uint8_t* faceData = loader->faceData;
+    for (uint32_t faceIndex = 0; faceIndex < loader->faceCount; ++faceIndex) {
+        if (faceData + loader->facePrefixSize + countSize > loader->fileEnd) {
+            return false;
+        }
+        int64_t cornerCount = ReadPLYInteger(faceData + loader->facePrefixSize, loader->faceCountType);
+        if (cornerCount < 0) {
+            return false;
+        }
+        if (cornerCount >= 3) {
+            triangleCount += cornerCount - 2;
+        }
+        faceData += loader->facePrefixSize + countSize + cornerCount * indexSize + loader->faceSuffixSize;
+    }
+    if (faceData > loader->fileEnd || triangleCount * 3 >= U32Max) {
+        return false;
+    }
+
+    Mesh* mesh = loader->mesh;
+    delete[] mesh->indices;
+    mesh->triangleCount = (uint32_t) triangleCount;
+    mesh->indices = new uint32_t[triangleCount * 3];
+
+    uint32_t* indices = mesh->indices;
+    faceData = loader->faceData;
+    for (uint32_t faceIndex = 0; faceIndex < loader->faceCount; ++faceIndex) {
+        const uint8_t* listData = faceData + loader->facePrefixSize;
+        uint32_t cornerCount = (uint32_t) ReadPLYInteger(listData, loader->faceCountType);
+        listData += countSize;
+
+        uint32_t firstIndex = 0;
+        uint32_t previousIndex = 0;
+        for (uint32_t corner = 0; corner < cornerCount; ++corner) {
+            int64_t vertexIndex = ReadPLYInteger(listData + corner * indexSize, loader->faceIndexType);
+            if (vertexIndex < 0 || vertexIndex >= loader->vertexCount) {
+                return false;
+            }
+
+            if (corner == 0) {
+                firstIndex = (uint32_t) vertexIndex;
+            } else if (corner >= 2) {
+                indices[0] = firstIndex;
+                indices[1] = previousIndex;
+                indices[2] = (uint32_t) vertexIndex;
+                indices += 3;
+            }
+            previousIndex = (uint32_t) vertexIndex;
+        }
+        faceData = listData + cornerCount * indexSize + loader->faceSuffixSize;
+    }
+
+    return true;
+}
+
+enum PLYElementType {
+    PLYElementType_None,
+    PLYElementType_Vertex,
+    PLYElementType_Face,
+    PLYElementType_Other,
+};
+
+static bool LoadPLY(ThreadPool* pool, const char* data, uint64_t size, Mesh* mesh) {
+    const char* fileEnd = data + size;
+    PLYLoader loader = {};
+    loader.fileEnd = (const uint8_t*) fileEnd;
+    loader.mesh = mesh;
+
+    bool isBinaryLittleEndian = false;
+    bool hasPosition[3] = {};
+    bool hasFaceList = false;
+    // We only need to know where vertex and face data start. Elements before them must have a fixed size.
+    bool dataOffsetKnown = true;
+    uint64_t dataOffset = 0;
+    uint64_t elementCount = 0;
+    uint64_t elementStride = 0;
+    uint32_t elementType = PLYElementType_None;
+    bool headerEnded = false;
+
+    const char* cursor = data;
+    while (cursor < fileEnd && !headerEnded) {
+        const char* lineEnd = SkipLine(cursor, fileEnd);
+        char line[256];
+        uint64_t lineLength = lineEnd - cursor;
+        if (lineLength >= sizeof(line)) {
+            lineLength = sizeof(line) - 1;
+        }
+        memcpy(line, cursor, lineLength);
+        line[lineLength] = 0;
+        cursor = lineEnd;
+
+        char keyword[32] = {};
+        char first[32] = {};
+        char second[32] = {};
+        char third[32] = {};
+        char fourth[32] = {};
+        int tokenCount = sscanf(line, "%31s %31s %31s %31s %31s", keyword, first, second, third, fourth);
+        if (tokenCount <= 0) {
+            continue;
+        }
+
+        bool isElement = strcmp(keyword, "element") == 0;
+        headerEnded = strcmp(keyword, "end_header") == 0;
+        if (isElement || headerEnded) {
+            // Close the previous element
+            if (dataOffsetKnown && elementType != PLYElementType_Face) {
+                dataOffset += elementCount * elementStride;
+            } else {
+                dataOffsetKnown = false;
+            }
+        }
+
+        if (strcmp(keyword, "format") == 0) {
+            isBinaryLittleEndian = strcmp(first, "binary_little_endian") == 0;
+        } else if (isElement && tokenCount == 3) {
+            elementCount = strtoull(second, 0, 10);
+            elementStride = 0;
+            elementType = PLYElementType_Other;
+            if (strcmp(first, "vertex") == 0) {
+                elementType = PLYElementType_Vertex;
+            } else if (strcmp(first, "face") == 0) {
+                elementType = PLYElementType_Face;
+            }
+
+            if (elementType != PLYElementType_Other) {
+                if (!dataOffsetKnown || dataOffset > size || elementCount >= U32Max) {
+                    fprintf(stderr, "Unsupported PLY element layout\n");
+                    return false;
+                }
+                if (elementType == PLYElementType_Vertex) {
+                    loader.vertexCount = (uint32_t) elementCount;
+                    loader.vertexData = (const uint8_t*) data + dataOffset;
+                } else {
+                    loader.faceCount = (uint32_t) elementCount;
+                    loader.faceData = (const uint8_t*) data + dataOffset;
+                }
+            }
+        } else if (strcmp(keyword, "property") == 0 && strcmp(first, "list") == 0 && tokenCount == 5) {
+            uint32_t countType = ParsePLYType(second);
+            uint32_t indexType = ParsePLYType(third);
+            bool isVertexIndices = strcmp(fourth, "vertex_indices") == 0 || strcmp(fourth, "vertex_index") == 0;
+            if (elementType == PLYElementType_Face && isVertexIndices && !hasFaceList &&
+                countType != PLYType_Invalid && indexType != PLYType_Invalid) {
+                loader.faceCountType = countType;
+                loader.faceIndexType = indexType;
+                hasFaceList = true;
+            } else if (elementType == PLYElementType_Other) {
+                // Size of this element is not fixed anymore
+                dataOffsetKnown = false;
+            } else {
+                fprintf(stderr, "Unsupported PLY list property: %s\n", fourth);
+                return false;
+            }
+        } else if (strcmp(keyword, "property") == 0 && tokenCount == 3) {
+            uint32_t type = ParsePLYType(first);
+            uint32_t typeSize = GetPLYTypeSize(type);
+            if (type == PLYType_Invalid) {
+                fprintf(stderr, "Unknown PLY property type: %s\n", first);
+                return false;
+            }
+
+            if (elementType == PLYElementType_Vertex) {
+                const char* positionNames[] = { "x", "y", "z" };
+                for (uint32_t axis = 0; axis < 3; ++axis) {
+                    if (strcmp(second, positionNames[axis]) == 0) {
+                        loader.positionOffsets[axis] = (uint32_t) elementStride;
+                        loader.positionTypes[axis] = type;
+                        hasPosition[axis] = true;
+                    }
+                }
+            } else if (elementType == PLYElementType_Face) {
+                if (hasFaceList) {
+                    loader.faceSuffixSize += typeSize;
+                } else {
+                    loader.facePrefixSize += typeSize;
+                }
+            }
+            elementStride += typeSize;
+            if (elementType == PLYElementType_Vertex) {
+                loader.vertexStride = (uint32_t) elementStride;
+            }
+        }
+    }
+
+    if (!headerEnded) {
+        fprintf(stderr, "PLY header is broken\n");
+        return false;
+    }
+    if (!isBinaryLittleEndian) {
+        fprintf(stderr, "Only binary little endian PLY files are supported\n");
+        return false;
+    }
+    if (!hasPosition[0] || !hasPosition[1] || !hasPosition[2] || !hasFaceList || loader.faceCount == 0) {
+        fprintf(stderr, "PLY file doesn't have vertex positions or faces\n");
+        return false;
+    }
+    // Header lines are counted in dataOffset, so element data starts right after end_header.
+    uint64_t headerSize = cursor - data;
+    loader.vertexData += headerSize;
+    loader.faceData += headerSize;
+    if (loader.vertexData + (uint64_t) loader.vertexCount * loader.vertexStride > loader.fileEnd ||
+        loader.faceData > loader.fileEnd) {
+        fprintf(stderr, "PLY file is truncated\n");
+        return false;
+    }
+
+    AllocateMesh(mesh, loader.vertexCount, loader.faceCount);
+
+    loader.vertexJobCount = GetJobCount(loader.vertexCount, loader.vertexStride);
+    RunLoaderJobs(pool, loader.vertexJobCount, ParsePLYVertices, &loader);
+
+    uint32_t triangleStride = loader.facePrefixSize + GetPLYTypeSize(loader.faceCountType) +
+                              3 * GetPLYTypeSize(loader.faceIndexType) + loader.faceSuffixSize;
+    bool fitsAsTriangles = loader.faceData + (uint64_t) loader.faceCount * triangleStride <= loader.fileEnd;
+    if (fitsAsTriangles) {
+        loader.faceJobCount = GetJobCount(loader.faceCount, triangleStride);
+        RunLoaderJobs(pool, loader.faceJobCount, ParsePLYTriangles, &loader);
+    }
+
+    // Jobs after a polygon start reading faces at the wrong offset, so their invalid indices may be garbage.
+    // ParsePLYPolygons checks every index again anyway.
+    bool failed = loader.hasInvalidIndices && !loader.hasNonTriangleFaces;
+    if (!failed && (!fitsAsTriangles || loader.hasNonTriangleFaces)) {
+        failed = !ParsePLYPolygons(&loader);
+    }
+
+    if (failed) {
+        fprintf(stderr, "PLY file has malformed faces\n");
+        FreeMesh(mesh);
+        return false;
+    }
+
+    return true;
+}
+
+bool LoadMesh(ThreadPool* pool, const char* filename, Mesh* mesh, MeshLoadStats* stats) {
+    uint64_t startClock = GetTimeMilliseconds();
+
+    MappedFile file;
+    if (!MapFileReadOnly(filename, &file)) {
+        fprintf(stderr, "Couldn't open %s\n", filename);
+        return false;
+    }
+
+    // OBJ files don't have any magic, so anything that isn't PLY is treated as OBJ.
+    const char* data = (const char*) file.data;
+    bool isPLY = file.size > 4 && memcmp(data, "ply", 3) == 0 && IsLineEnd(data[3]);
+    bool result = isPLY ? LoadPLY(pool, data, file.size, mesh) : LoadOBJ(pool, data, file.size, mesh);
+
+    stats->fileSize = file.size;
+    UnmapFile(&file);
+
+    stats->loadTimeMs = GetTimeMilliseconds() - startClock;
+    return result;
+}
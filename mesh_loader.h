@@ -0,0 +1,19 @@
+#ifndef _MESH_LOADER_H_
+#define _MESH_LOADER_H_
+
+#include "platform.h"
+#include "scene.h"
+
+// Files are split into chunks of at least this size. Every chunk is counted and then parsed by a pool thread.
+#define MESH_LOADER_MIN_CHUNK_SIZE (1024 * 1024)
+
+struct MeshLoadStats {
+    uint64_t fileSize;
+    uint64_t loadTimeMs;
+};
+
+// Loads Wavefront OBJ (positions and faces only) and binary little endian PLY files.
+// Vertices and indices are written directly into mesh arrays. Returns false and prints the reason on failure.
+bool LoadMesh(ThreadPool* pool, const char* filename, Mesh* mesh, MeshLoadStats* stats);
+
+#endif
@@ -5,9 +5,6 @@
 
 #ifdef PLATFORM_WIN32
 #include <windows.h>
-#define THREAD_PROC_RET DWORD
-#else
-#define THREAD_PROC_RET void*
 #endif
 
 // Performance counters
@@ -16,14 +13,38 @@ inline uint64_t GetTimeMilliseconds();
 // Threading
 inline uint32_t GetNumberOfProcessors();
 
-struct Thread;
+// Gives the rest of the time slice to other threads.
+inline void YieldThread();
+
+// Worker threads are created once and sleep between jobs.
+// A job runs jobProc(data) once on every worker. jobProc usually pulls work from a queue until it's empty,
+// so the calling thread can run the same jobProc and then wait for workers to finish theirs.
+struct ThreadPool;
+
+inline ThreadPool* CreateThreadPool(uint32_t workerThreadCount);
+inline void StartThreadPoolJob(ThreadPool* pool, void (*jobProc)(void*), void* data);
+// Returns after every worker has returned from jobProc.
+inline void WaitThreadPoolJob(ThreadPool* pool);
+// Wakes up and joins all workers. Pool must not have a running job.
+inline void DestroyThreadPool(ThreadPool* pool);
+
+// Files
+struct MappedFile;
 
-inline Thread CreateWorkThread(THREAD_PROC_RET (*startFunc) (void*), void* arguments);
-inline void CloseThreadHandle(Thread thread);
+// Maps whole file into memory as read-only. Returns false if the file can't be opened or mapped.
+inline bool MapFileReadOnly(const char* filename, MappedFile* result);
+inline void UnmapFile(MappedFile* file);
+// Moves source over destination in one step, so readers see either the old file or the new one.
+inline bool RenameFileReplacingExisting(const char* sourceFilename, const char* destinationFilename);
 
 // Atomics
 inline uint64_t InterlockedAddAndReturnPrevious(volatile uint64_t* dest, uint64_t value);
 inline uint32_t InterlockedAddAndReturnPrevious(volatile uint32_t* dest, uint32_t value);
+// Stores exchange to dest only if dest is equal to comparand. Returns previous value of dest either way.
+inline uint64_t InterlockedCompareExchangeAndReturnPrevious(volatile uint64_t* dest, uint64_t exchange, uint64_t comparand);
+inline uint32_t InterlockedCompareExchangeAndReturnPrevious(volatile uint32_t* dest, uint32_t exchange, uint32_t comparand);
+// Full hardware and compiler fence. No load or store moves across it.
+inline void FullMemoryBarrier();
 
 #ifdef PLATFORM_WIN32
 #include "platform_win32.cpp"
@@ -1,25 +1,154 @@
 #include "platform.h"
 
 #include <pthread.h>
+#include <stdio.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-#define THREAD_PROC_RET void*
+inline void YieldThread() {
+    sched_yield();
+}
+
+struct ThreadPool {
+    uint32_t workerThreadCount;
+    pthread_t* workerThreads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t jobStartedCondition;
+    pthread_cond_t jobFinishedCondition;
 
-struct Thread {
-    pthread_t handle;
+    // Everything below is protected by mutex.
+    void (*jobProc)(void*);
+    void* jobData;
+    // Workers compare this with the last job they ran to see if there is a new job.
+    uint64_t jobGeneration;
+    uint32_t busyWorkerCount;
+    bool shuttingDown;
 };
 
-inline Thread CreateWorkThread(THREAD_PROC_RET (*startFunc) (void*), void* arguments) {
-    pthread_t thread;
-    pthread_create(&thread, NULL, startFunc, arguments);
-    
-    Thread result = {};
-    result.handle = thread;
+static void* ThreadPoolWorkerProc(void* arguments) {
+    ThreadPool* pool = (ThreadPool*) arguments;
+    uint64_t lastJobGeneration = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (!pool->shuttingDown && pool->jobGeneration == lastJobGeneration) {
+            pthread_cond_wait(&pool->jobStartedCondition, &pool->mutex);
+        }
+        if (pool->shuttingDown) {
+            break;
+        }
+
+        lastJobGeneration = pool->jobGeneration;
+        void (*jobProc)(void*) = pool->jobProc;
+        void* jobData = pool->jobData;
+
+        pthread_mutex_unlock(&pool->mutex);
+        jobProc(jobData);
+        pthread_mutex_lock(&pool->mutex);
+
+        if (--pool->busyWorkerCount == 0) {
+            pthread_cond_signal(&pool->jobFinishedCondition);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return 0;
+}
+
+inline ThreadPool* CreateThreadPool(uint32_t workerThreadCount) {
+    ThreadPool* pool = new ThreadPool();
+    pool->workerThreadCount = workerThreadCount;
+    pool->workerThreads = new pthread_t[workerThreadCount];
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->jobStartedCondition, NULL);
+    pthread_cond_init(&pool->jobFinishedCondition, NULL);
+
+    for (uint32_t threadIndex = 0; threadIndex < workerThreadCount; ++threadIndex) {
+        pthread_create(pool->workerThreads + threadIndex, NULL, ThreadPoolWorkerProc, pool);
+    }
 
-    return result;
+    return pool;
 }
 
-inline void CloseThreadHandle(Thread thread) {
-    pthread_cancel(thread.handle);
+inline void StartThreadPoolJob(ThreadPool* pool, void (*jobProc)(void*), void* data) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->jobProc = jobProc;
+    pool->jobData = data;
+    pool->busyWorkerCount = pool->workerThreadCount;
+    ++pool->jobGeneration;
+    pthread_cond_broadcast(&pool->jobStartedCondition);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+inline void WaitThreadPoolJob(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->busyWorkerCount > 0) {
+        pthread_cond_wait(&pool->jobFinishedCondition, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+inline void DestroyThreadPool(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shuttingDown = true;
+    pthread_cond_broadcast(&pool->jobStartedCondition);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint32_t threadIndex = 0; threadIndex < pool->workerThreadCount; ++threadIndex) {
+        pthread_join(pool->workerThreads[threadIndex], NULL);
+    }
+
+    pthread_cond_destroy(&pool->jobFinishedCondition);
+    pthread_cond_destroy(&pool->jobStartedCondition);
+    pthread_mutex_destroy(&pool->mutex);
+    delete[] pool->workerThreads;
+    delete pool;
+}
+
+struct MappedFile {
+    void* data;
+    uint64_t size;
+};
+
+inline bool MapFileReadOnly(const char* filename, MappedFile* result) {
+    int file = open(filename, O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+
+    struct stat fileStat;
+    if (fstat(file, &fileStat) != 0 || fileStat.st_size == 0) {
+        close(file);
+        return false;
+    }
+
+    void* data = mmap(0, fileStat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    // Mapping keeps its own reference to the file.
+    close(file);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    // We read files front to back. Let the kernel read ahead aggressively.
+    madvise(data, fileStat.st_size, MADV_SEQUENTIAL);
+
+    result->data = data;
+    result->size = fileStat.st_size;
+    return true;
+}
+
+inline void UnmapFile(MappedFile* file) {
+    munmap(file->data, file->size);
+    file->data = 0;
+    file->size = 0;
+}
+
+inline bool RenameFileReplacingExisting(const char* sourceFilename, const char* destinationFilename) {
+    return rename(sourceFilename, destinationFilename) == 0;
 }
 
 inline uint64_t InterlockedAddAndReturnPrevious(volatile uint64_t* dest, uint64_t value) {
@@ -29,3 +158,15 @@ inline uint64_t InterlockedAddAndReturnPrevious(volatile uint64_t* dest, uint64_
 inline uint32_t InterlockedAddAndReturnPrevious(volatile uint32_t* dest, uint32_t value) {
     return __sync_fetch_and_add(dest, value);
 }
+
+inline uint64_t InterlockedCompareExchangeAndReturnPrevious(volatile uint64_t* dest, uint64_t exchange, uint64_t comparand) {
+    return __sync_val_compare_and_swap(dest, comparand, exchange);
+}
+
+inline uint32_t InterlockedCompareExchangeAndReturnPrevious(volatile uint32_t* dest, uint32_t exchange, uint32_t comparand) {
+    return __sync_val_compare_and_swap(dest, comparand, exchange);
+}
+
+inline void FullMemoryBarrier() {
+    __sync_synchronize();
+}
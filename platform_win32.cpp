@@ -5,23 +5,156 @@
 
 #include <windows.h>
 
-//#define THREAD_PROC_RET DWORD
+inline void YieldThread() {
+    SwitchToThread();
+}
 
-struct Thread {
-    HANDLE handle;
+struct ThreadPool {
+    uint32_t workerThreadCount;
+    HANDLE* workerThreads;
+
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE jobStartedCondition;
+    CONDITION_VARIABLE jobFinishedCondition;
+
+    // Everything below is protected by lock.
+    void (*jobProc)(void*);
+    void* jobData;
+    // Workers compare this with the last job they ran to see if there is a new job.
+    uint64_t jobGeneration;
+    uint32_t busyWorkerCount;
+    bool shuttingDown;
 };
 
-inline Thread CreateWorkThread(THREAD_PROC_RET (*startFunc) (void*), void* arguments) {
-    HANDLE threadHandle = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) startFunc, arguments, 0, NULL);
+static DWORD WINAPI ThreadPoolWorkerProc(void* arguments) {
+    ThreadPool* pool = (ThreadPool*) arguments;
+    uint64_t lastJobGeneration = 0;
+
+    EnterCriticalSection(&pool->lock);
+    for (;;) {
+        while (!pool->shuttingDown && pool->jobGeneration == lastJobGeneration) {
+            SleepConditionVariableCS(&pool->jobStartedCondition, &pool->lock, INFINITE);
+        }
+        if (pool->shuttingDown) {
+            break;
+        }
+
+        lastJobGeneration = pool->jobGeneration;
+        void (*jobProc)(void*) = pool->jobProc;
+        void* jobData = pool->jobData;
+
+        LeaveCriticalSection(&pool->lock);
+        jobProc(jobData);
+        EnterCriticalSection(&pool->lock);
+
+        if (--pool->busyWorkerCount == 0) {
+            WakeConditionVariable(&pool->jobFinishedCondition);
+        }
+    }
+    LeaveCriticalSection(&pool->lock);
+
+    return 0;
+}
+
+inline ThreadPool* CreateThreadPool(uint32_t workerThreadCount) {
+    ThreadPool* pool = new ThreadPool();
+    pool->workerThreadCount = workerThreadCount;
+    pool->workerThreads = new HANDLE[workerThreadCount];
+    InitializeCriticalSection(&pool->lock);
+    InitializeConditionVariable(&pool->jobStartedCondition);
+    InitializeConditionVariable(&pool->jobFinishedCondition);
+
+    for (uint32_t threadIndex = 0; threadIndex < workerThreadCount; ++threadIndex) {
+        pool->workerThreads[threadIndex] = CreateThread(NULL, 0, ThreadPoolWorkerProc, pool, 0, NULL);
+    }
+
+    return pool;
+}
 
-    Thread result = {};
-    result.handle = threadHandle;
+inline void StartThreadPoolJob(ThreadPool* pool, void (*jobProc)(void*), void* data) {
+    EnterCriticalSection(&pool->lock);
+    pool->jobProc = jobProc;
+    pool->jobData = data;
+    pool->busyWorkerCount = pool->workerThreadCount;
+    ++pool->jobGeneration;
+    WakeAllConditionVariable(&pool->jobStartedCondition);
+    LeaveCriticalSection(&pool->lock);
+}
 
-    return result;
+inline void WaitThreadPoolJob(ThreadPool* pool) {
+    EnterCriticalSection(&pool->lock);
+    while (pool->busyWorkerCount > 0) {
+        SleepConditionVariableCS(&pool->jobFinishedCondition, &pool->lock, INFINITE);
+    }
+    LeaveCriticalSection(&pool->lock);
 }
 
-inline void CloseThreadHandle(Thread thread) {
-    CloseHandle(thread.handle);
+inline void DestroyThreadPool(ThreadPool* pool) {
+    EnterCriticalSection(&pool->lock);
+    pool->shuttingDown = true;
+    WakeAllConditionVariable(&pool->jobStartedCondition);
+    LeaveCriticalSection(&pool->lock);
+
+    for (uint32_t threadIndex = 0; threadIndex < pool->workerThreadCount; ++threadIndex) {
+        WaitForSingleObject(pool->workerThreads[threadIndex], INFINITE);
+        CloseHandle(pool->workerThreads[threadIndex]);
+    }
+
+    DeleteCriticalSection(&pool->lock);
+    delete[] pool->workerThreads;
+    delete pool;
+}
+
+struct MappedFile {
+    void* data;
+    uint64_t size;
+    HANDLE file;
+    HANDLE mapping;
+};
+
+inline bool MapFileReadOnly(const char* filename, MappedFile* result) {
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) {
+        CloseHandle(file);
+        return false;
+    }
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    result->data = data;
+    result->size = fileSize.QuadPart;
+    result->file = file;
+    result->mapping = mapping;
+    return true;
+}
+
+inline void UnmapFile(MappedFile* file) {
+    UnmapViewOfFile(file->data);
+    CloseHandle(file->mapping);
+    CloseHandle(file->file);
+    file->data = 0;
+    file->size = 0;
+}
+
+inline bool RenameFileReplacingExisting(const char* sourceFilename, const char* destinationFilename) {
+    return MoveFileExA(sourceFilename, destinationFilename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
 }
 
 inline uint64_t InterlockedAddAndReturnPrevious(volatile uint64_t* dest, uint64_t value) {
@@ -32,6 +165,18 @@ inline uint32_t InterlockedAddAndReturnPrevious(volatile uint32_t* dest, uint32_
     return InterlockedExchangeAdd(dest, value);
 }
 
+inline uint64_t InterlockedCompareExchangeAndReturnPrevious(volatile uint64_t* dest, uint64_t exchange, uint64_t comparand) {
+    return InterlockedCompareExchange64((volatile LONG64*) dest, exchange, comparand);
+}
+
+inline uint32_t InterlockedCompareExchangeAndReturnPrevious(volatile uint32_t* dest, uint32_t exchange, uint32_t comparand) {
+    return InterlockedCompareExchange((volatile LONG*) dest, exchange, comparand);
+}
+
+inline void FullMemoryBarrier() {
+    MemoryBarrier();
+}
+
 inline uint64_t GetTimeMilliseconds() {
     // TODO: This operation may not be success. Check return value.
     LARGE_INTEGER time, frequency;
@@ -0,0 +1,184 @@
+#ifndef _RENDER_H_
+#define _RENDER_H_
+
+#include "math_util.h"
+#include "scene.h"
+#include "image.h"
+#include "work_deque.h"
+#include "sampler.h"
+#include "bsdf.h"
+#include "denoise.h"
+
+struct Ray {
+    Vector3 origin;
+    Vector3 direction;
+};
+
+struct WorldIntersectionResult {
+    float t = F32Max;
+    uint32_t hitMaterialIndex;
+    Vector3 hitNormal;
+};
+
+struct SIMDBackend;
+
+// Every work order is a rectangular tile of the image.
+// It fits in a single 64-bit word, so it can be stored in a work deque directly.
+struct WorkOrder {
+    uint16_t startRowIndex;
+    uint16_t endRowIndex;
+    uint16_t startColumnIndex;
+    uint16_t endColumnIndex;
+};
+
+inline uint64_t PackWorkOrder(WorkOrder workOrder) {
+    uint64_t result;
+    memcpy(&result, &workOrder, sizeof(result));
+    return result;
+}
+
+inline WorkOrder UnpackWorkOrder(uint64_t item) {
+    WorkOrder result;
+    memcpy(&result, &item, sizeof(result));
+    return result;
+}
+
+// Image is rendered in passes and every pass adds samples to these. Radiance stays linear float here
+// and is only converted to sRGB by ResolveImage when we write the image.
+// Samples are added to the color sum one by one, so splitting the samples of a pixel into passes
+// doesn't change the result even by rounding.
+// Luminance mean and M2 (sum of squared differences from the mean) are updated per sample with Welford's method.
+// Random state is carried between passes, so new samples never repeat the old ones. Sobol samplers don't need it,
+// they continue the sequence from sampleCount.
+struct PixelAccumulator {
+    Vector3 colorSum;
+    float luminanceMean;
+    float luminanceM2;
+    uint32_t sampleCount;
+    uint32_t randomState;
+    uint32_t isConverged;
+};
+
+inline void AddPixelSample(PixelAccumulator* pixel, Vector3 sampleColor) {
+    pixel->colorSum += sampleColor;
+
+    float luminance = Luminance(sampleColor);
+    float delta = luminance - pixel->luminanceMean;
+    pixel->luminanceMean += delta / (float) ++pixel->sampleCount;
+    pixel->luminanceM2 += delta * (luminance - pixel->luminanceMean);
+}
+
+// Pixel is done when the standard error of its mean luminance is under threshold after converting to sRGB.
+// sRGB curve is steep near black and flat near white, so dark pixels need more samples than bright ones,
+// and pixels that are surely brighter than display white are done no matter how noisy they are.
+inline bool IsPixelConverged(PixelAccumulator* pixel, float threshold) {
+    float sampleCount = (float) pixel->sampleCount;
+    float variance = pixel->luminanceM2 / (sampleCount - 1.0f);
+    float standardError = sqrtf(variance / sampleCount);
+    float displayError = (LinearTosRGB(pixel->luminanceMean + standardError) -
+                          LinearTosRGB(Max(pixel->luminanceMean - standardError, 0.0f))) * 0.5f;
+    return displayError <= threshold;
+}
+
+// Arbitrary output variables. Extra images about the camera ray hits, written in the same pass as color.
+enum AOVFlags {
+    AOV_Depth = 0x1,
+    AOV_Normal = 0x2,
+    AOV_Albedo = 0x4,
+    AOV_MaterialID = 0x8,
+    AOV_SampleCount = 0x10,
+};
+
+#define AOV_NO_MATERIAL 0xFFFFFFFF
+
+// Per pixel buffers of the AOVs, laid out like the accumulators. Buffers of AOVs that are off stay null,
+// so they cost neither memory nor time. Sample count comes from the accumulators, it has no buffer.
+struct AOVBuffers {
+    uint32_t flags;
+    // Nearest camera ray hit distance of the pixel's samples. F32Max if all of them missed.
+    float* depths;
+    // Summed like colorSum, so they are averaged with the same sampleCount. Misses add zero.
+    // Normals face the camera.
+    Vector3* normalSums;
+    Vector3* albedoSums;
+    // Material hit by the first sample that hit something, AOV_NO_MATERIAL if none did.
+    uint32_t* materialIndices;
+};
+
+// Samples per pixel in every pass when rendering with a time budget. Deadline is checked once per row,
+// so passes are kept short to spread the samples evenly over the image when time runs out.
+#define PROGRESSIVE_PASS_SAMPLE_COUNT 4
+
+// Every thread has its own deque of tiles and steals from other threads when it runs out.
+// Shared counters are only touched once per row or when a thread runs out of work.
+struct WorkQueue {
+    Image* image;
+    World* world;
+    SIMDBackend* backend;
+    PixelAccumulator* accumulators;
+    AOVBuffers aovs;
+
+    // Samples every unconverged pixel gets in the current pass.
+    uint32_t passSampleCount;
+    // Zero when adaptive sampling is off. Otherwise pixels stop getting samples once they have minSampleCount
+    // and pass IsPixelConverged, or when they reach maxSampleCount.
+    float adaptiveThreshold;
+    uint32_t minSampleCount;
+    uint32_t maxSampleCount;
+    // Camera rays of neighbouring pixels are traced together as packets.
+    bool tracePrimaryPackets;
+    // Paths of a few tile rows are traced a bounce at a time. Takes precedence over primary packets.
+    bool traceWavefront;
+    SamplerType samplerType;
+    // Paths get at least minBounceCount bounces and at most maxBounceCount, Russian roulette decides in between.
+    uint32_t minBounceCount;
+    uint32_t maxBounceCount;
+    // Only used by the blue noise sampler.
+    float* blueNoiseMask;
+
+    // Tiles in Morton order. Every pass hands them out again.
+    uint32_t workOrderCount;
+    WorkOrder* workOrders;
+
+    uint32_t dequeCount;
+    WorkDeque* deques;
+    volatile uint32_t registeredThreadCount;
+    // Busy threads split their tiles while this is not zero.
+    volatile uint32_t idleThreadCount;
+
+    // Zero means no time limit. Threads stop at the next row once we pass it.
+    uint64_t deadlineMs;
+    volatile uint32_t isOutOfTime;
+
+    uint64_t totalPixelCount;
+    volatile uint64_t finishedPixelCount;
+    // Pixels that still need samples after the current pass.
+    volatile uint64_t activePixelCount;
+    volatile uint64_t totalSamplesComputed;
+    volatile uint64_t totalBouncesComputed;
+    // Rays along paths, without shadow rays.
+    volatile uint64_t totalPathRaysComputed;
+};
+
+struct BVHStats {
+    uint32_t nodeCount; // Binary nodes
+    uint32_t wideNodeCount;
+    uint32_t leafCount;
+    uint32_t maxDepth;
+};
+
+// Everything that depends on the lane width is compiled once per instruction set, see simd_backends.cpp.
+// Scene and work queue are shared, so switching backends only needs a new BVH.
+struct SIMDBackend {
+    const char* name;
+    uint32_t laneWidth;
+    uint32_t requiredCPUFeatures;
+    // Builds world->bvh for this backend's lane width.
+    void (*buildBVH)(World* world, BVHStats* stats);
+    // Pulls tiles from the work queue until the current pass is done. Called on every render thread.
+    void (*raytraceWork)(WorkQueue* workQueue, bool reportProgress);
+    // Runs the current iteration of the denoiser on rows that no other thread took. Called on every thread.
+    void (*denoiseRows)(Denoiser* denoiser);
+};
+
+#endif
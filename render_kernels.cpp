@@ -0,0 +1,1734 @@
+// Intersection kernels and the render loop. Everything here depends on the lane width,
+// so simd_backends.cpp includes this file once per backend inside the backend's namespace. No include guard on purpose.
+
+inline
+bool IntersectSphereLane(SphereSoALane* sphereSoA, LaneVector3 rayOriginLane, LaneVector3 rayDirectionLane, LaneF32 minHitDistance,
+                         LaneF32* closestHitDistanceLane, LaneF32* hitMaterialIndexLane, LaneVector3* hitNormalLane) {
+    LaneVector3 centerToOrigin = rayOriginLane - sphereSoA->position;
+    LaneF32 a = DotProduct(rayDirectionLane, rayDirectionLane);
+    LaneF32 b = 2.0f * DotProduct(rayDirectionLane, centerToOrigin);
+    LaneF32 c = DotProduct(centerToOrigin, centerToOrigin) - (sphereSoA->radiusSquared);
+    LaneF32 discriminant = FMulSub(b, b, 4.0f * a * c); //b * b - 4.0f * a * c;
+    LaneF32 denom = 2.0f * a;
+
+    LaneMask squareRootMask = discriminant > 0.0f;
+    if (MaskIsZeroed(squareRootMask)) {
+        return false;
+    }
+
+    LaneF32 tp = (-b + SquareRoot(discriminant)) / denom;
+    LaneF32 tn = (-b - SquareRoot(discriminant)) / denom;
+
+    LaneF32 hitDistance = tp;
+    LaneMask pickMask = ((tn > minHitDistance) & (tn < tp));
+    Select(&hitDistance, pickMask, tn);
+
+    LaneMask tMask = ((hitDistance > minHitDistance) & (hitDistance < *closestHitDistanceLane));
+    LaneMask hitMask = (squareRootMask & tMask);
+    if (MaskIsZeroed(hitMask)) {
+        return false;
+    }
+
+    Select(closestHitDistanceLane, hitMask, hitDistance);
+    Select(hitMaterialIndexLane, hitMask, sphereSoA->materialIndex);
+
+    LaneVector3 hitPosition = FMulAdd(rayDirectionLane, hitDistance, rayOriginLane);
+    Select(hitNormalLane, hitMask, Normalize(hitPosition - sphereSoA->position));
+    return true;
+}
+
+// Pz = Oz + Dz * t
+// Pz is fixed z component of one of the vectors in rectangle struct
+// t = (Pz - Oz) / Dz
+inline
+bool IntersectRectangleLane(RectangleLane* rectangleLane, LaneVector3 rayOriginLane, LaneVector3 rayDirectionLane, LaneF32 minHitDistance,
+                            LaneF32* closestHitDistanceLane, LaneF32* hitMaterialIndexLane, LaneVector3* hitNormalLane) {
+    // rectangle's transform matrix is inverted on scene initialization
+    // We don't invert it here
+    LaneMatrix4 rayMatrix = rectangleLane->transformMatrix;
+    LaneVector3 localRayOrigin = (rayMatrix * LaneVector4(rayOriginLane, 1.0f)).xyz();
+    LaneVector3 localRayDirection = (rayMatrix * LaneVector4(rayDirectionLane, 0.0f)).xyz();
+
+    LaneF32 t = (-localRayOrigin.z) / localRayDirection.z;
+    LaneVector3 hitPoint = localRayOrigin + localRayDirection * t;
+
+    LaneMask hit = (hitPoint.x <= rectDefaultMaxPoint.x) &
+                   (hitPoint.x >= rectDefaultMinPoint.x) &
+                   (hitPoint.y <= rectDefaultMaxPoint.y) &
+                   (hitPoint.y >= rectDefaultMinPoint.y);
+
+    LaneMask hitMask = hit & (t < *closestHitDistanceLane) & (t > minHitDistance);
+    if (MaskIsZeroed(hitMask)) {
+        return false;
+    }
+
+    Select(closestHitDistanceLane, hitMask, t);
+    Select(hitMaterialIndexLane, hitMask, rectangleLane->materialIndex);
+
+    LaneVector3 rectNormal = rectangleLane->normal;
+    // Check for incident ray direction vector direction
+    // If it's coming to back side of rectangle
+    // Flip the normal vector
+    LaneF32 dot = DotProduct(rectNormal, rayDirectionLane);
+    LaneVector3 flippedRectNormal = -rectNormal;
+    LaneMask flipMask = dot > 0.0f;
+    Select(&rectNormal, flipMask, flippedRectNormal);
+    Select(hitNormalLane, hitMask, rectNormal);
+    return true;
+}
+
+// Möller–Trumbore ray-triangle intersection.
+// Solves O + tD = V0 + u * E1 + v * E2 with Cramer's rule. Hit is inside the triangle if u, v >= 0 and u + v <= 1.
+inline
+bool IntersectTriangleLane(TriangleLane* triangleLane, LaneVector3 rayOriginLane, LaneVector3 rayDirectionLane, LaneF32 minHitDistance,
+                           LaneF32* closestHitDistanceLane, LaneF32* hitMaterialIndexLane, LaneVector3* hitNormalLane) {
+    LaneVector3 pVector = CrossProduct(rayDirectionLane, triangleLane->edge2);
+    LaneF32 determinant = DotProduct(triangleLane->edge1, pVector);
+    // Parallel rays and padding lanes give zero determinant. Inverse becomes infinity and the tests below fail on NaN.
+    LaneF32 inverseDeterminant = LaneF32(1.0f) / determinant;
+
+    LaneVector3 tVector = rayOriginLane - triangleLane->vertex0;
+    LaneF32 u = DotProduct(tVector, pVector) * inverseDeterminant;
+    LaneVector3 qVector = CrossProduct(tVector, triangleLane->edge1);
+    LaneF32 v = DotProduct(rayDirectionLane, qVector) * inverseDeterminant;
+    LaneF32 t = DotProduct(triangleLane->edge2, qVector) * inverseDeterminant;
+
+    LaneMask hitMask = (u >= 0.0f) & (v >= 0.0f) & ((u + v) <= 1.0f) &
+                       (t > minHitDistance) & (t < *closestHitDistanceLane);
+    if (MaskIsZeroed(hitMask)) {
+        return false;
+    }
+
+    Select(closestHitDistanceLane, hitMask, t);
+    Select(hitMaterialIndexLane, hitMask, triangleLane->materialIndex);
+
+    // Triangles are two sided like rectangles. Flip the normal if we hit the back side.
+    LaneVector3 triangleNormal = Normalize(CrossProduct(triangleLane->edge1, triangleLane->edge2));
+    LaneMask flipMask = DotProduct(triangleNormal, rayDirectionLane) > 0.0f;
+    Select(&triangleNormal, flipMask, -triangleNormal);
+    Select(hitNormalLane, hitMask, triangleNormal);
+    return true;
+}
+
+// Occlusion versions of the lane intersection functions. They only tell if any lane has a hit
+// between minHitDistance and maxDistance, so there is no closest hit, material or normal bookkeeping.
+
+inline
+bool OccludedSphereLane(SphereSoALane* sphereSoA, LaneVector3 rayOriginLane, LaneVector3 rayDirectionLane,
+                        LaneF32 minHitDistance, LaneF32 maxDistance) {
+    LaneVector3 centerToOrigin = rayOriginLane - sphereSoA->position;
+    LaneF32 a = DotProduct(rayDirectionLane, rayDirectionLane);
+    LaneF32 b = 2.0f * DotProduct(rayDirectionLane, centerToOrigin);
+    LaneF32 c = DotProduct(centerToOrigin, centerToOrigin) - (sphereSoA->radiusSquared);
+    LaneF32 discriminant = FMulSub(b, b, 4.0f * a * c);
+
+    LaneMask squareRootMask = discriminant > 0.0f;
+    if (MaskIsZeroed(squareRootMask)) {
+        return false;
+    }
+
+    LaneF32 squareRoot = SquareRoot(discriminant);
+    LaneF32 inverseDenom = LaneF32(1.0f) / (2.0f * a);
+    LaneF32 tp = (-b + squareRoot) * inverseDenom;
+    LaneF32 tn = (-b - squareRoot) * inverseDenom;
+
+    // Either root in range is enough, we don't care which one is closer.
+    LaneMask hitMask = squareRootMask & (((tn > minHitDistance) & (tn < maxDistance)) |
+                                         ((tp > minHitDistance) & (tp < maxDistance)));
+    return !MaskIsZeroed(hitMask);
+}
+
+inline
+bool OccludedRectangleLane(RectangleLane* rectangleLane, LaneVector3 rayOriginLane, LaneVector3 rayDirectionLane,
+                           LaneF32 minHitDistance, LaneF32 maxDistance) {
+    LaneMatrix4 rayMatrix = rectangleLane->transformMatrix;
+    LaneVector3 localRayOrigin = (rayMatrix * LaneVector4(rayOriginLane, 1.0f)).xyz();
+    LaneVector3 localRayDirection = (rayMatrix * LaneVector4(rayDirectionLane, 0.0f)).xyz();
+
+    LaneF32 t = (-localRayOrigin.z) / localRayDirection.z;
+    LaneMask tMask = (t < maxDistance) & (t > minHitDistance);
+    if (MaskIsZeroed(tMask)) {
+        return false;
+    }
+
+    LaneVector3 hitPoint = localRayOrigin + localRayDirection * t;
+    LaneMask hitMask = tMask &
+                       (hitPoint.x <= rectDefaultMaxPoint.x) &
+                       (hitPoint.x >= rectDefaultMinPoint.x) &
+                       (hitPoint.y <= rectDefaultMaxPoint.y) &
+                       (hitPoint.y >= rectDefaultMinPoint.y);
+    return !MaskIsZeroed(hitMask);
+}
+
+inline
+bool OccludedTriangleLane(TriangleLane* triangleLane, LaneVector3 rayOriginLane, LaneVector3 rayDirectionLane,
+                          LaneF32 minHitDistance, LaneF32 maxDistance) {
+    LaneVector3 pVector = CrossProduct(rayDirectionLane, triangleLane->edge2);
+    LaneF32 determinant = DotProduct(triangleLane->edge1, pVector);
+    LaneF32 inverseDeterminant = LaneF32(1.0f) / determinant;
+
+    LaneVector3 tVector = rayOriginLane - triangleLane->vertex0;
+    LaneF32 u = DotProduct(tVector, pVector) * inverseDeterminant;
+    // Most triangles in a leaf miss, and u alone rules out a lot of them.
+    LaneMask uMask = (u >= 0.0f) & (u <= 1.0f);
+    if (MaskIsZeroed(uMask)) {
+        return false;
+    }
+
+    LaneVector3 qVector = CrossProduct(tVector, triangleLane->edge1);
+    LaneF32 v = DotProduct(rayDirectionLane, qVector) * inverseDeterminant;
+    LaneF32 t = DotProduct(triangleLane->edge2, qVector) * inverseDeterminant;
+
+    LaneMask hitMask = uMask & (v >= 0.0f) & ((u + v) <= 1.0f) &
+                       (t > minHitDistance) & (t < maxDistance);
+    return !MaskIsZeroed(hitMask);
+}
+
+inline
+bool IntersectWorldWide(World* world, Ray* ray, WorldIntersectionResult* intersectionResult) {
+    float hitTolerance = 0.001;
+    float minHitDistance = 0.001;
+
+    float closestHitDistance = F32Max;
+    uint32_t hitMaterialIndex = 0;
+    Vector3 hitNormal(0.0f, 0.0f, 0.0f);
+    bool anyHit = false;
+
+    // Planes are infinite, so they can't be in the BVH. We calculate plane intersection in scalar.
+    for (uint32_t planeIndex = 0; planeIndex < world->planeCount; ++planeIndex) {
+        Plane plane = world->planes[planeIndex];
+        
+        float denom = DotProduct(plane.normal, ray->direction);
+        if ((denom < -hitTolerance) || (denom > hitTolerance)) {
+            float hitDistance = (-plane.d - DotProduct(plane.normal, ray->origin)) / denom;
+            if (hitDistance > minHitDistance && hitDistance < closestHitDistance) {
+                closestHitDistance = hitDistance;
+                hitMaterialIndex = plane.materialIndex;
+                hitNormal = plane.normal;
+                anyHit = true;
+            }
+        }
+    }
+
+    // Broadcast scalar values into lanes.
+    LaneVector3 rayOriginLane(ray->origin);
+    LaneVector3 rayDirectionLane(ray->direction);
+    LaneF32 minHitDistanceLane(minHitDistance);
+
+    LaneF32 closestHitDistanceLane = LaneF32(closestHitDistance);
+    LaneF32 hitMaterialIndexLane = LaneF32(hitMaterialIndex);
+    LaneVector3 hitNormalLane = LaneVector3(hitNormal);
+
+    // Walk the wide BVH front to back. Each node tests all of its children in one lane slab test,
+    // hit children are pushed sorted by entry distance so the closest one is visited first.
+    // Entries further than the closest hit so far are skipped when they're popped.
+    BVH* bvh = (BVH*) world->bvh;
+    Vector3 inverseRayDirection = Vector3(1.0f, 1.0f, 1.0f) / ray->direction;
+    LaneVector3 inverseRayDirectionLane(inverseRayDirection);
+    LaneVector3 scaledRayOriginLane(ray->origin * inverseRayDirection);
+    uint32_t nearCorner[3] = { inverseRayDirection.x < 0.0f, inverseRayDirection.y < 0.0f, inverseRayDirection.z < 0.0f };
+
+    WideBVHStackEntry nodeStack[WIDE_BVH_STACK_SIZE];
+    uint32_t nodeStackSize = 0;
+    if (bvh->wideNodeCount > 0) {
+        nodeStack[nodeStackSize].child = 0;
+        nodeStack[nodeStackSize].distance = 0.0f;
+        ++nodeStackSize;
+    }
+
+    while (nodeStackSize > 0) {
+        WideBVHStackEntry entry = nodeStack[--nodeStackSize];
+        if (entry.distance > closestHitDistance) {
+            continue;
+        }
+
+        if (!(entry.child & WIDE_BVH_LEAF_FLAG)) {
+            WideBVHNode* node = bvh->wideNodes + entry.child;
+            LaneF32 entryDistanceLane;
+            uint32_t hitBits = IntersectWideNode(node, scaledRayOriginLane, inverseRayDirectionLane, nearCorner,
+                                                 LaneF32(closestHitDistance), &entryDistanceLane);
+
+            ALIGN_LANE float entryDistances[LANE_WIDTH];
+            StoreLane(entryDistances, entryDistanceLane);
+
+            // Insertion sort while pushing. Farthest child ends up at the bottom, closest one on the top.
+            uint32_t firstPushed = nodeStackSize;
+            while (hitBits) {
+                uint32_t childIndex = CountTrailingZeros(hitBits);
+                hitBits &= hitBits - 1;
+
+                float distance = entryDistances[childIndex];
+                uint32_t insertIndex = nodeStackSize++;
+                while (insertIndex > firstPushed && nodeStack[insertIndex - 1].distance < distance) {
+                    nodeStack[insertIndex] = nodeStack[insertIndex - 1];
+                    --insertIndex;
+                }
+                nodeStack[insertIndex].child = node->children[childIndex];
+                nodeStack[insertIndex].distance = distance;
+            }
+            continue;
+        }
+
+        BVHLeaf* leaf = bvh->leaves + (entry.child & ~WIDE_BVH_LEAF_FLAG);
+        bool leafHit = false;
+
+        SphereSoALane* sphereLanes = bvh->sphereLanes + leaf->sphereLaneOffset;
+        for (uint32_t sphereLaneIndex = 0; sphereLaneIndex < leaf->sphereLaneCount; ++sphereLaneIndex) {
+            leafHit |= IntersectSphereLane(sphereLanes + sphereLaneIndex, rayOriginLane, rayDirectionLane, minHitDistanceLane,
+                                           &closestHitDistanceLane, &hitMaterialIndexLane, &hitNormalLane);
+        }
+
+        RectangleLane* rectangleLanes = bvh->rectangleLanes + leaf->rectangleLaneOffset;
+        for (uint32_t rectangleLaneIndex = 0; rectangleLaneIndex < leaf->rectangleLaneCount; ++rectangleLaneIndex) {
+            leafHit |= IntersectRectangleLane(rectangleLanes + rectangleLaneIndex, rayOriginLane, rayDirectionLane, minHitDistanceLane,
+                                              &closestHitDistanceLane, &hitMaterialIndexLane, &hitNormalLane);
+        }
+
+        TriangleLane* triangleLanes = bvh->triangleLanes + leaf->triangleLaneOffset;
+        for (uint32_t triangleLaneIndex = 0; triangleLaneIndex < leaf->triangleLaneCount; ++triangleLaneIndex) {
+            leafHit |= IntersectTriangleLane(triangleLanes + triangleLaneIndex, rayOriginLane, rayDirectionLane, minHitDistanceLane,
+                                             &closestHitDistanceLane, &hitMaterialIndexLane, &hitNormalLane);
+        }
+
+        if (leafHit) {
+            // Shrink the ray, so remaining nodes behind this hit get culled.
+            closestHitDistance = HorizontalMin(closestHitDistanceLane);
+            anyHit = true;
+        }
+    }
+
+    if (anyHit) {
+        // After calculating n primitive and ray intersection, we have to find which one is closer.
+        // This is probably the most naive way to do it. We store lane values into an array and iterating through to find any close hit. 
+        ALIGN_LANE float closestHitDistanceLaneUnpacked[LANE_WIDTH];
+        ALIGN_LANE float hitMaterialIndexLaneUnpacked[LANE_WIDTH];
+        ALIGN_LANE float hitNormalLaneXUnpacked[LANE_WIDTH];
+        ALIGN_LANE float hitNormalLaneYUnpacked[LANE_WIDTH];
+        ALIGN_LANE float hitNormalLaneZUnpacked[LANE_WIDTH];
+        StoreLane(closestHitDistanceLaneUnpacked, closestHitDistanceLane);
+        StoreLane(hitMaterialIndexLaneUnpacked, hitMaterialIndexLane);
+        StoreLane(hitNormalLaneXUnpacked, hitNormalLane.x);
+        StoreLane(hitNormalLaneYUnpacked, hitNormalLane.y);
+        StoreLane(hitNormalLaneZUnpacked, hitNormalLane.z);
+        for (int i = 0; i < LANE_WIDTH; ++i) {
+            float t = closestHitDistanceLaneUnpacked[i];
+            if (t <= closestHitDistance) {
+                closestHitDistance = t;
+                hitMaterialIndex = hitMaterialIndexLaneUnpacked[i];
+                hitNormal = Vector3(hitNormalLaneXUnpacked[i],
+                                    hitNormalLaneYUnpacked[i],
+                                    hitNormalLaneZUnpacked[i]);
+            }
+        }
+    }
+
+    intersectionResult->t = closestHitDistance;
+    intersectionResult->hitMaterialIndex = hitMaterialIndex;
+    intersectionResult->hitNormal = hitNormal;
+
+    return anyHit;
+}
+
+// Returns true as soon as anything is hit between the ray origin and maxDistance.
+// For shadow rays we don't need the closest hit, so children aren't sorted and we stop at the first hit.
+inline
+bool OccludedWorldWide(World* world, Ray* ray, float maxDistance) {
+    float hitTolerance = 0.001;
+    float minHitDistance = 0.001;
+
+    for (uint32_t planeIndex = 0; planeIndex < world->planeCount; ++planeIndex) {
+        Plane plane = world->planes[planeIndex];
+        
+        float denom = DotProduct(plane.normal, ray->direction);
+        if ((denom < -hitTolerance) || (denom > hitTolerance)) {
+            float hitDistance = (-plane.d - DotProduct(plane.normal, ray->origin)) / denom;
+            if (hitDistance > minHitDistance && hitDistance < maxDistance) {
+                return true;
+            }
+        }
+    }
+
+    LaneVector3 rayOriginLane(ray->origin);
+    LaneVector3 rayDirectionLane(ray->direction);
+    LaneF32 minHitDistanceLane(minHitDistance);
+    LaneF32 maxDistanceLane(maxDistance);
+
+    BVH* bvh = (BVH*) world->bvh;
+    Vector3 inverseRayDirection = Vector3(1.0f, 1.0f, 1.0f) / ray->direction;
+    LaneVector3 inverseRayDirectionLane(inverseRayDirection);
+    LaneVector3 scaledRayOriginLane(ray->origin * inverseRayDirection);
+    uint32_t nearCorner[3] = { inverseRayDirection.x < 0.0f, inverseRayDirection.y < 0.0f, inverseRayDirection.z < 0.0f };
+
+    uint32_t nodeStack[WIDE_BVH_STACK_SIZE];
+    uint32_t nodeStackSize = 0;
+    if (bvh->wideNodeCount > 0) {
+        nodeStack[nodeStackSize++] = 0;
+    }
+
+    while (nodeStackSize > 0) {
+        uint32_t child = nodeStack[--nodeStackSize];
+
+        if (!(child & WIDE_BVH_LEAF_FLAG)) {
+            WideBVHNode* node = bvh->wideNodes + child;
+            LaneF32 entryDistanceLane;
+            uint32_t hitBits = IntersectWideNode(node, scaledRayOriginLane, inverseRayDirectionLane, nearCorner,
+                                                 maxDistanceLane, &entryDistanceLane);
+            while (hitBits) {
+                uint32_t childIndex = CountTrailingZeros(hitBits);
+                hitBits &= hitBits - 1;
+                nodeStack[nodeStackSize++] = node->children[childIndex];
+            }
+            continue;
+        }
+
+        BVHLeaf* leaf = bvh->leaves + (child & ~WIDE_BVH_LEAF_FLAG);
+
+        SphereSoALane* sphereLanes = bvh->sphereLanes + leaf->sphereLaneOffset;
+        for (uint32_t sphereLaneIndex = 0; sphereLaneIndex < leaf->sphereLaneCount; ++sphereLaneIndex) {
+            if (OccludedSphereLane(sphereLanes + sphereLaneIndex, rayOriginLane, rayDirectionLane,
+                                   minHitDistanceLane, maxDistanceLane)) {
+                return true;
+            }
+        }
+
+        RectangleLane* rectangleLanes = bvh->rectangleLanes + leaf->rectangleLaneOffset;
+        for (uint32_t rectangleLaneIndex = 0; rectangleLaneIndex < leaf->rectangleLaneCount; ++rectangleLaneIndex) {
+            if (OccludedRectangleLane(rectangleLanes + rectangleLaneIndex, rayOriginLane, rayDirectionLane,
+                                      minHitDistanceLane, maxDistanceLane)) {
+                return true;
+            }
+        }
+
+        TriangleLane* triangleLanes = bvh->triangleLanes + leaf->triangleLaneOffset;
+        for (uint32_t triangleLaneIndex = 0; triangleLaneIndex < leaf->triangleLaneCount; ++triangleLaneIndex) {
+            if (OccludedTriangleLane(triangleLanes + triangleLaneIndex, rayOriginLane, rayDirectionLane,
+                                     minHitDistanceLane, maxDistanceLane)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// Camera rays of a small pixel block are traced together as a packet, one ray per lane.
+// Blocks are as square as the lane width allows: 2x2 with SSE, 4x2 with AVX2 and 4x4 with AVX-512.
+#define PACKET_COLUMN_COUNT (LANE_WIDTH >= 8 ? 4 : 2)
+#define PACKET_ROW_COUNT (LANE_WIDTH / PACKET_COLUMN_COUNT)
+
+// Closest hits of a packet of rays. Rays of inactive lanes are ignored, their results are misses.
+// Rays go through the wide BVH together: every child box is tested against all rays at once, and a child is visited
+// if any ray hits it. Leaf primitives are broadcast one by one and tested with the single ray intersection functions,
+// so every ray gets the same hit as IntersectWorldWide would give it, up to rounding of plane hits and exact ties.
+// This only pays off when rays are coherent and visit the same nodes, like camera rays of neighbouring pixels.
+inline
+void IntersectWorldPacket(World* world, LaneVector3 rayOriginLane, LaneVector3 rayDirectionLane, LaneMask activeMask,
+                          WorldIntersectionResult* intersectionResults) {
+    float hitTolerance = 0.001;
+    float minHitDistance = 0.001;
+    LaneF32 minHitDistanceLane(minHitDistance);
+
+    // Inactive lanes start with a negative max distance, so they fail every node and primitive test.
+    LaneF32 closestHitDistanceLane(-1.0f);
+    Select(&closestHitDistanceLane, activeMask, LaneF32(F32Max));
+    LaneF32 hitMaterialIndexLane(0.0f);
+    LaneVector3 hitNormalLane(Vector3(0.0f, 0.0f, 0.0f));
+
+    for (uint32_t planeIndex = 0; planeIndex < world->planeCount; ++planeIndex) {
+        Plane plane = world->planes[planeIndex];
+        LaneVector3 planeNormal(plane.normal);
+
+        LaneF32 denom = DotProduct(planeNormal, rayDirectionLane);
+        LaneF32 hitDistance = (LaneF32(-plane.d) - DotProduct(planeNormal, rayOriginLane)) / denom;
+        LaneMask hitMask = ((denom < -hitTolerance) | (denom > hitTolerance)) &
+                           (hitDistance > minHitDistanceLane) & (hitDistance < closestHitDistanceLane);
+        Select(&closestHitDistanceLane, hitMask, hitDistance);
+        Select(&hitMaterialIndexLane, hitMask, LaneF32((float) plane.materialIndex));
+        Select(&hitNormalLane, hitMask, planeNormal);
+    }
+
+    BVH* bvh = (BVH*) world->bvh;
+    LaneVector3 inverseRayDirectionLane(LaneF32(1.0f) / rayDirectionLane.x, LaneF32(1.0f) / rayDirectionLane.y,
+                                        LaneF32(1.0f) / rayDirectionLane.z);
+    LaneVector3 scaledRayOriginLane(rayOriginLane.x * inverseRayDirectionLane.x, rayOriginLane.y * inverseRayDirectionLane.y,
+                                    rayOriginLane.z * inverseRayDirectionLane.z);
+    // Nodes are culled against the farthest hit in the packet.
+    float farthestHitDistance = HorizontalMax(closestHitDistanceLane);
+
+    WideBVHStackEntry nodeStack[WIDE_BVH_STACK_SIZE];
+    uint32_t nodeStackSize = 0;
+    if (bvh->wideNodeCount > 0) {
+        nodeStack[nodeStackSize].child = 0;
+        nodeStack[nodeStackSize].distance = 0.0f;
+        ++nodeStackSize;
+    }
+
+    while (nodeStackSize > 0) {
+        WideBVHStackEntry entry = nodeStack[--nodeStackSize];
+        if (entry.distance > farthestHitDistance) {
+            continue;
+        }
+
+        if (!(entry.child & WIDE_BVH_LEAF_FLAG)) {
+            WideBVHNode* node = bvh->wideNodes + entry.child;
+
+            uint32_t firstPushed = nodeStackSize;
+            for (uint32_t childIndex = 0; childIndex < LANE_WIDTH; ++childIndex) {
+                // Rays of a packet don't share direction signs, so we need min/max here and empty children
+                // with inverted bounds would pass. We skip them instead.
+                if (node->children[childIndex] == WIDE_BVH_EMPTY_CHILD) {
+                    continue;
+                }
+
+                LaneVector3 boundsMin(Vector3(GetLane(node->bounds[0].x, childIndex), GetLane(node->bounds[0].y, childIndex),
+                                              GetLane(node->bounds[0].z, childIndex)));
+                LaneVector3 boundsMax(Vector3(GetLane(node->bounds[1].x, childIndex), GetLane(node->bounds[1].y, childIndex),
+                                              GetLane(node->bounds[1].z, childIndex)));
+                LaneF32 t0X = FMulSub(boundsMin.x, inverseRayDirectionLane.x, scaledRayOriginLane.x);
+                LaneF32 t0Y = FMulSub(boundsMin.y, inverseRayDirectionLane.y, scaledRayOriginLane.y);
+                LaneF32 t0Z = FMulSub(boundsMin.z, inverseRayDirectionLane.z, scaledRayOriginLane.z);
+                LaneF32 t1X = FMulSub(boundsMax.x, inverseRayDirectionLane.x, scaledRayOriginLane.x);
+                LaneF32 t1Y = FMulSub(boundsMax.y, inverseRayDirectionLane.y, scaledRayOriginLane.y);
+                LaneF32 t1Z = FMulSub(boundsMax.z, inverseRayDirectionLane.z, scaledRayOriginLane.z);
+
+                LaneF32 entryDistanceLane = Max(Max(Min(t0X, t1X), Min(t0Y, t1Y)), Max(Min(t0Z, t1Z), LaneF32(0.0f)));
+                LaneF32 exitDistanceLane = Min(Min(Max(t0X, t1X), Max(t0Y, t1Y)), Min(Max(t0Z, t1Z), closestHitDistanceLane));
+                LaneMask hitMask = entryDistanceLane <= exitDistanceLane;
+                if (MaskIsZeroed(hitMask)) {
+                    continue;
+                }
+
+                // Child is ordered by the closest entry of the rays that hit it.
+                LaneF32 hitEntryDistanceLane(F32Max);
+                Select(&hitEntryDistanceLane, hitMask, entryDistanceLane);
+                float distance = HorizontalMin(hitEntryDistanceLane);
+
+                uint32_t insertIndex = nodeStackSize++;
+                while (insertIndex > firstPushed && nodeStack[insertIndex - 1].distance < distance) {
+                    nodeStack[insertIndex] = nodeStack[insertIndex - 1];
+                    --insertIndex;
+                }
+                nodeStack[insertIndex].child = node->children[childIndex];
+                nodeStack[insertIndex].distance = distance;
+            }
+            continue;
+        }
+
+        BVHLeaf* leaf = bvh->leaves + (entry.child & ~WIDE_BVH_LEAF_FLAG);
+        bool leafHit = false;
+
+        SphereSoALane* sphereLanes = bvh->sphereLanes + leaf->sphereLaneOffset;
+        for (uint32_t sphereLaneIndex = 0; sphereLaneIndex < leaf->sphereLaneCount; ++sphereLaneIndex) {
+            for (uint32_t laneIndex = 0; laneIndex < LANE_WIDTH; ++laneIndex) {
+                SphereSoALane sphere;
+                BroadcastPrimitive(&sphere, sphereLanes + sphereLaneIndex, sizeof(sphere) / sizeof(LaneF32), laneIndex);
+                leafHit |= IntersectSphereLane(&sphere, rayOriginLane, rayDirectionLane, minHitDistanceLane,
+                                               &closestHitDistanceLane, &hitMaterialIndexLane, &hitNormalLane);
+            }
+        }
+
+        RectangleLane* rectangleLanes = bvh->rectangleLanes + leaf->rectangleLaneOffset;
+        for (uint32_t rectangleLaneIndex = 0; rectangleLaneIndex < leaf->rectangleLaneCount; ++rectangleLaneIndex) {
+            for (uint32_t laneIndex = 0; laneIndex < LANE_WIDTH; ++laneIndex) {
+                RectangleLane rectangle;
+                BroadcastPrimitive(&rectangle, rectangleLanes + rectangleLaneIndex, sizeof(rectangle) / sizeof(LaneF32), laneIndex);
+                leafHit |= IntersectRectangleLane(&rectangle, rayOriginLane, rayDirectionLane, minHitDistanceLane,
+                                                  &closestHitDistanceLane, &hitMaterialIndexLane, &hitNormalLane);
+            }
+        }
+
+        TriangleLane* triangleLanes = bvh->triangleLanes + leaf->triangleLaneOffset;
+        for (uint32_t triangleLaneIndex = 0; triangleLaneIndex < leaf->triangleLaneCount; ++triangleLaneIndex) {
+            for (uint32_t laneIndex = 0; laneIndex < LANE_WIDTH; ++laneIndex) {
+                TriangleLane triangle;
+                BroadcastPrimitive(&triangle, triangleLanes + triangleLaneIndex, sizeof(triangle) / sizeof(LaneF32), laneIndex);
+                leafHit |= IntersectTriangleLane(&triangle, rayOriginLane, rayDirectionLane, minHitDistanceLane,
+                                                 &closestHitDistanceLane, &hitMaterialIndexLane, &hitNormalLane);
+            }
+        }
+
+        if (leafHit) {
+            farthestHitDistance = HorizontalMax(closestHitDistanceLane);
+        }
+    }
+
+    // Misses keep F32Max, and inactive lanes are turned into misses here.
+    Select(&closestHitDistanceLane, closestHitDistanceLane < minHitDistanceLane, LaneF32(F32Max));
+    for (uint32_t laneIndex = 0; laneIndex < LANE_WIDTH; ++laneIndex) {
+        WorldIntersectionResult* result = intersectionResults + laneIndex;
+        result->t = GetLane(closestHitDistanceLane, laneIndex);
+        result->hitMaterialIndex = (uint32_t) GetLane(hitMaterialIndexLane, laneIndex);
+        result->hitNormal = Vector3(GetLane(hitNormalLane.x, laneIndex), GetLane(hitNormalLane.y, laneIndex),
+                                    GetLane(hitNormalLane.z, laneIndex));
+    }
+}
+
+// Next event estimation for a diffuse surface. Picks a light by power and a point on it uniformly,
+// and returns light coming from that point through the Lambert BRDF, MIS weighted against cosine sampling.
+// Takes the light sample set of the bounce: light selector and the point on the light.
+Vector3 SampleRectangleLights(World* world, Vector3 position, Vector3 normal, Vector3 albedo,
+                              float* lightSamples, uint64_t* bounceCount) {
+    Vector3 result(0.0f, 0.0f, 0.0f);
+
+    float lightSelector = lightSamples[0];
+    RectangleLight* light = world->lights;
+    while (light->cumulativeProbability < lightSelector) {
+        ++light;
+    }
+
+    float u = lightSamples[1];
+    float v = lightSamples[2];
+    Vector3 lightPoint = light->corner + light->edgeU * u + light->edgeV * v;
+    Vector3 toLight = lightPoint - position;
+    float distanceSquared = DotProduct(toLight, toLight);
+    float distance = sqrtf(distanceSquared);
+    Vector3 lightDirection = toLight / distance;
+
+    // Lights are two sided like rectangles themselves.
+    float cosSurface = DotProduct(normal, lightDirection);
+    float cosLight = fabsf(DotProduct(light->normal, lightDirection));
+    if (cosSurface <= 0.0f || cosLight <= 0.0f) {
+        return result;
+    }
+
+    // Shadow ray stops a little before the light, so it can't hit the light itself.
+    Ray shadowRay = {};
+    shadowRay.origin = position;
+    shadowRay.direction = lightDirection;
+    ++*bounceCount;
+    if (OccludedWorldWide(world, &shadowRay, distance * 0.999f)) {
+        return result;
+    }
+
+    float lightPdf = world->lightAreaDensities[light->materialIndex] * distanceSquared / cosLight;
+    float bsdfPdf = LambertPdf(normal, lightDirection);
+    float weight = PowerHeuristic(lightPdf, bsdfPdf);
+
+    Vector3 emitColor = world->materials[light->materialIndex].emitColor;
+    result = albedo * emitColor * (cosSurface * weight / (PI * lightPdf));
+    return result;
+}
+
+// Path state between bounces. Depth first tracing keeps one on the stack, wavefront tracing keeps the same fields
+// in lane arrays.
+struct PathState {
+    Ray ray;
+    Vector3 radiance;
+    Vector3 attenuation;
+    // Light hits after a diffuse bounce are also found by light sampling, so their emission is weighted with MIS.
+    // Camera rays and specular bounces can't be found by light sampling, so they get full weight.
+    bool previousBounceSampledLights;
+    float previousBouncePdf;
+    uint32_t bounceIndex;
+    Sampler* sampler;
+};
+
+inline void StartPath(PathState* path, Ray* ray, Sampler* sampler) {
+    path->ray = *ray;
+    path->radiance = Vector3(0.0f, 0.0f, 0.0f);
+    path->attenuation = Vector3(1.0f, 1.0f, 1.0f);
+    path->previousBounceSampledLights = false;
+    path->previousBouncePdf = 0.0f;
+    path->bounceIndex = 0;
+    path->sampler = sampler;
+}
+
+// Called after a bounce with the new bounce index. Paths stop at maxBounceCount. Past minBounceCount,
+// Russian roulette stops paths with a probability that grows as their attenuation gets dim, and survivors are
+// weighted up by the same amount, so the image stays unbiased. Returns false when the path is done.
+inline bool ContinuePath(Sampler* sampler, Vector3* attenuation, uint32_t bounceIndex, uint32_t minBounceCount,
+                         uint32_t maxBounceCount) {
+    // Black surfaces and microfacet bounces that went under the surface leave nothing to carry.
+    float maxAttenuation = Max(attenuation->x, Max(attenuation->y, attenuation->z));
+    if (bounceIndex >= maxBounceCount || maxAttenuation <= 0.0f) {
+        return false;
+    }
+    if (bounceIndex < minBounceCount) {
+        return true;
+    }
+
+    // Capped under 1, so paths that don't lose energy (like glass) still end at some point.
+    float survivalProbability = Min(maxAttenuation, 0.95f);
+    float rouletteSample;
+    GetSamples(sampler, GetRouletteSampleSet(bounceIndex), 1, &rouletteSample);
+    if (rouletteSample >= survivalProbability) {
+        return false;
+    }
+
+    *attenuation = *attenuation / survivalProbability;
+    return true;
+}
+
+// Adds the light coming from the hit of the path's ray, and turns the ray into the next bounce.
+// Returns false when the path is done. Every ray we trace is counted in bounceCount, including shadow rays.
+bool ShadePathHit(World* world, WorkQueue* workQueue, PathState* path, bool isIntersect,
+                  WorldIntersectionResult* intersectionResult, uint64_t* bounceCount) {
+    Ray* bounceRay = &path->ray;
+    Sampler* sampler = path->sampler;
+    ++*bounceCount;
+
+    Material mat = world->materials[intersectionResult->hitMaterialIndex];
+    if (!isIntersect) {
+        // Hit nothing (sky)
+        // We just return attenuation for now. No sky color or sky emmiter.
+        path->radiance += path->attenuation * mat.emitColor;
+        return false;
+    }
+
+    float emissionWeight = 1.0f;
+    float lightAreaDensity = world->lightAreaDensities[intersectionResult->hitMaterialIndex];
+    if (path->previousBounceSampledLights && lightAreaDensity > 0.0f) {
+        float cosLight = Max(-DotProduct(intersectionResult->hitNormal, bounceRay->direction), 0.0001f);
+        float lightPdf = lightAreaDensity * intersectionResult->t * intersectionResult->t / cosLight;
+        emissionWeight = PowerHeuristic(path->previousBouncePdf, lightPdf);
+    }
+
+    path->radiance += path->attenuation * mat.emitColor * emissionWeight;
+    bounceRay->origin = bounceRay->origin + bounceRay->direction * intersectionResult->t;
+
+    // Lights are only sampled from pure diffuse surfaces. Mirror lobes can't use it, and the Lambert lobe of
+    // glossy materials is dim enough that it isn't worth a shadow ray.
+    bool isDiffuse = IsDiffuseMaterial(&mat);
+    if (isDiffuse && world->lightCount > 0 && Luminance(mat.color) > 0.0f) {
+        Vector3 normal = FaceForward(intersectionResult->hitNormal, bounceRay->direction);
+        float lightSamples[3];
+        GetSamples(sampler, GetLightSampleSet(path->bounceIndex), 3, lightSamples);
+        path->radiance += path->attenuation * SampleRectangleLights(world, bounceRay->origin, normal, mat.color,
+                                                                    lightSamples, bounceCount);
+    }
+
+    float bsdfSamples[BSDF_SAMPLE_COUNT];
+    GetSamples(sampler, GetBSDFSampleSet(path->bounceIndex), isDiffuse ? 2 : BSDF_SAMPLE_COUNT, bsdfSamples);
+    BSDFSample bsdfSample = SampleBSDF(&mat, intersectionResult->hitNormal, bounceRay->direction, bsdfSamples);
+    bounceRay->direction = bsdfSample.direction;
+    path->attenuation *= bsdfSample.weight;
+    path->previousBouncePdf = bsdfSample.pdf;
+    path->previousBounceSampledLights = isDiffuse;
+    return ContinuePath(sampler, &path->attenuation, ++path->bounceIndex, workQueue->minBounceCount,
+                        workQueue->maxBounceCount);
+}
+
+// AOVs of a camera ray's hit. Misses leave the pixel's AOVs alone.
+inline void AddHitAOVs(World* world, AOVBuffers* aovs, uint64_t pixelIndex, Vector3 rayDirection,
+                       WorldIntersectionResult* hit) {
+    if (hit->t == F32Max) {
+        return;
+    }
+
+    if (aovs->depths) {
+        aovs->depths[pixelIndex] = Min(aovs->depths[pixelIndex], hit->t);
+    }
+    if (aovs->normalSums) {
+        aovs->normalSums[pixelIndex] += FaceForward(hit->hitNormal, rayDirection);
+    }
+    if (aovs->albedoSums) {
+        aovs->albedoSums[pixelIndex] += world->materials[hit->hitMaterialIndex].color;
+    }
+    if (aovs->materialIndices && aovs->materialIndices[pixelIndex] == AOV_NO_MATERIAL) {
+        aovs->materialIndices[pixelIndex] = hit->hitMaterialIndex;
+    }
+}
+
+// Main ray trace function.
+// I use a loop-based tracing instead of recursion-based trace function.
+// You can write clean code by using recursion but I find recursion hard to understand.
+// This way is more straightforward and understandable for me.
+// Camera rays that were traced in a packet pass their hit in firstHit, a miss has t = F32Max. Otherwise it's null.
+// Rays of the path itself, without shadow rays, are added to pathRayCount. The first hit goes into the AOVs of
+// pixelIndex unless aovs is null.
+Vector3 RaytraceWorld(World* world, Ray* ray, WorldIntersectionResult* firstHit, Sampler* sampler, WorkQueue* workQueue,
+                      AOVBuffers* aovs, uint64_t pixelIndex, uint64_t* bounceCount, uint64_t* pathRayCount) {
+    PathState path;
+    StartPath(&path, ray, sampler);
+
+    bool isAlive = true;
+    while (isAlive) {
+        WorldIntersectionResult intersectionResult = {};
+        bool isIntersect;
+        if (path.bounceIndex == 0 && firstHit) {
+            intersectionResult = *firstHit;
+            isIntersect = firstHit->t < F32Max;
+        } else {
+            isIntersect = IntersectWorldWide(world, &path.ray, &intersectionResult);
+        }
+        if (path.bounceIndex == 0 && aovs) {
+            AddHitAOVs(world, aovs, pixelIndex, path.ray.direction, &intersectionResult);
+        }
+
+        isAlive = ShadePathHit(world, workQueue, &path, isIntersect, &intersectionResult, bounceCount);
+        ++*pathRayCount;
+    }
+
+    return path.radiance;
+}
+
+// Film plane in front of the camera. Camera rays go from the camera position through jittered points on it.
+struct CameraFilm {
+    Vector3 position;
+    Vector3 center;
+    Vector3 xVec;
+    Vector3 yVec;
+    float halfWidth;
+    float halfHeight;
+    float pixelWidth;
+    float pixelHeight;
+};
+
+static CameraFilm MakeCameraFilm(Camera* camera, Image* image) {
+    float imageAspectRatio = (float) image->width / (float) image->height;
+
+    float filmDistance = 1.0;
+    float filmWidth = 1.0f * imageAspectRatio;
+    float filmHeight = 1.0f;
+
+    CameraFilm result;
+    result.position = camera->position;
+    result.center = camera->position - camera->zVec * filmDistance;
+    result.xVec = camera->xVec;
+    result.yVec = camera->yVec;
+    result.halfWidth = filmWidth * 0.5f;
+    result.halfHeight = filmHeight * 0.5f;
+    result.pixelWidth = 0.5f / image->width;
+    result.pixelHeight = 0.5f / image->height;
+    return result;
+}
+
+// Direction of a camera ray through a random point of the pixel at film coordinates filmX, filmY.
+inline Vector3 SampleCameraRayDirection(CameraFilm* film, float filmX, float filmY, Sampler* sampler) {
+    float cameraSamples[2];
+    GetSamples(sampler, SAMPLE_SET_CAMERA, 2, cameraSamples);
+    float offsetX = filmX + (2.0f * cameraSamples[0] - 1.0f) * film->pixelWidth;
+    float offsetY = filmY + (2.0f * cameraSamples[1] - 1.0f) * film->pixelHeight;
+
+    Vector3 filmPosition = film->center + film->xVec * offsetX * film->halfWidth + film->yVec * film->halfHeight * offsetY;
+    return Normalize(filmPosition - film->position);
+}
+
+// Sampler of the pixel at x, y. Random sampler draws from the stream of pixelState.
+// Caller sets sampleIndex at the start of every sample.
+static Sampler MakePixelSampler(WorkQueue* workQueue, uint32_t x, uint32_t y, PixelAccumulator* pixelState) {
+    Sampler result = {};
+    result.type = workQueue->samplerType;
+    result.pixelX = x;
+    result.pixelY = y;
+    result.blueNoiseMask = workQueue->blueNoiseMask;
+    result.randomState = &pixelState->randomState;
+    // Blue noise needs the same points in every pixel, the mask decorrelates them.
+    result.scrambleSeed = 0x8A5CD789;
+    if (result.type == SamplerType_Sobol) {
+        result.scrambleSeed = Hash32(y * workQueue->image->width + x + 1);
+    }
+    return result;
+}
+
+// Null if no AOV is on, so tracing skips them with one check.
+inline AOVBuffers* GetAOVBuffers(WorkQueue* workQueue) {
+    return workQueue->aovs.flags & ~AOV_SampleCount ? &workQueue->aovs : 0;
+}
+
+// Adaptive sampling stops giving samples to a pixel once it converged. Returns true if the pixel still needs samples.
+static bool UpdatePixelConvergence(WorkQueue* workQueue, PixelAccumulator* pixel) {
+    float adaptiveThreshold = workQueue->adaptiveThreshold;
+    if (adaptiveThreshold > 0.0f && pixel->sampleCount >= workQueue->minSampleCount &&
+        (pixel->sampleCount >= workQueue->maxSampleCount || IsPixelConverged(pixel, adaptiveThreshold))) {
+        pixel->isConverged = true;
+        return false;
+    }
+    return true;
+}
+
+// Wavefront tracing keeps the paths of a few tile rows in flight and traces one bounce of all of them at a time.
+// Before every bounce live rays are sorted by direction octant and origin. Camera rays are written into SoA buffers
+// in that order and go through IntersectWorldPacket a lane at a time. Finished paths are compacted away.
+// Every pixel has a single path in flight and takes its samples one after another, so it gets the same samples
+// as depth first tracing. Shading is done in lanes with polynomial sin/cos though,
+// so the image matches depth first tracing only up to rounding.
+#define WAVEFRONT_ROW_COUNT 8
+// Bits per axis of the origin part of sort keys. Direction octant takes 3 more bits on top.
+#define WAVEFRONT_ORIGIN_BITS 9
+
+struct Wavefront {
+    // Pixel count of the biggest wave, rounded up to full lanes.
+    uint32_t capacity;
+
+    AOVBuffers* aovs; // Null if no AOV is on
+
+    // Per pixel of the wave.
+    uint32_t pixelCount;
+    PixelAccumulator** pixels;
+    PixelAccumulator* pixelStates;
+    uint64_t* imagePixelIndices; // For the AOVs
+    float* filmX;
+    float* filmY;
+    Sampler* samplers;
+    // Radiance of the current sample, written when the pixel's path is done.
+    Vector3* sampleRadiance;
+
+    // Live paths are PathState split into lane arrays. Slots are compacted after every bounce,
+    // so shading loads and stores whole lanes of them.
+    uint32_t livePathCount;
+    uint32_t* pathPixels;
+    float* rayOrigins[3];
+    float* rayDirections[3];
+    float* radiance[3];
+    float* attenuation[3];
+    float* previousBouncePdf;
+    float* previousBounceSampledLights; // 1 or 0
+    uint32_t* bounceIndices;
+    // Random state of the pixel while its path is in flight. It goes back to the pixel when the path is done.
+    uint32_t* randomStates;
+
+    // Hits of the bounce rays per slot.
+    float* hitDistances;
+    float* hitNormals[3];
+    uint32_t* hitMaterialIndices;
+
+    // Slots in tracing order, sorted by key before every bounce.
+    uint32_t* sortedPaths;
+    uint32_t* sortKeys;
+    uint32_t* sortScratchPaths;
+    uint32_t* sortScratchKeys;
+
+    // Ray origins are quantized in these bounds for sort keys.
+    Vector3 sceneMin;
+    Vector3 sceneScale;
+
+    // Copied from the work queue, see ContinuePath.
+    uint32_t minBounceCount;
+    uint32_t maxBounceCount;
+};
+
+// Lane aligned and zeroed, so lanes past the last slot never read garbage.
+inline float* AllocateWavefrontLanes(uint32_t capacity) {
+    float* result = AllocateLaneArray(float, capacity);
+    memset(result, 0, capacity * sizeof(float));
+    return result;
+}
+
+static void InitializeWavefront(Wavefront* wavefront, WorkQueue* workQueue, uint32_t pixelCount) {
+    World* world = workQueue->world;
+    uint32_t capacity = (pixelCount + LANE_WIDTH - 1) / LANE_WIDTH * LANE_WIDTH;
+
+    wavefront->capacity = capacity;
+    wavefront->minBounceCount = workQueue->minBounceCount;
+    wavefront->maxBounceCount = workQueue->maxBounceCount;
+    wavefront->pixelCount = 0;
+    wavefront->livePathCount = 0;
+    wavefront->pixels = new PixelAccumulator*[capacity];
+    wavefront->pixelStates = new PixelAccumulator[capacity];
+    wavefront->aovs = GetAOVBuffers(workQueue);
+    wavefront->imagePixelIndices = new uint64_t[capacity];
+    wavefront->filmX = new float[capacity];
+    wavefront->filmY = new float[capacity];
+    wavefront->samplers = new Sampler[capacity];
+    wavefront->sampleRadiance = new Vector3[capacity];
+    wavefront->pathPixels = new uint32_t[capacity];
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        wavefront->rayOrigins[axis] = AllocateWavefrontLanes(capacity);
+        wavefront->rayDirections[axis] = AllocateWavefrontLanes(capacity);
+        wavefront->radiance[axis] = AllocateWavefrontLanes(capacity);
+        wavefront->attenuation[axis] = AllocateWavefrontLanes(capacity);
+        wavefront->hitNormals[axis] = AllocateWavefrontLanes(capacity);
+    }
+    wavefront->previousBouncePdf = AllocateWavefrontLanes(capacity);
+    wavefront->previousBounceSampledLights = AllocateWavefrontLanes(capacity);
+    wavefront->bounceIndices = new uint32_t[capacity];
+    wavefront->randomStates = AllocateLaneArray(uint32_t, capacity);
+    memset(wavefront->randomStates, 0, capacity * sizeof(uint32_t));
+    wavefront->hitDistances = AllocateWavefrontLanes(capacity);
+    wavefront->hitMaterialIndices = new uint32_t[capacity];
+    wavefront->sortedPaths = new uint32_t[capacity];
+    wavefront->sortKeys = new uint32_t[capacity];
+    wavefront->sortScratchPaths = new uint32_t[capacity];
+    wavefront->sortScratchKeys = new uint32_t[capacity];
+
+    // Root of the wide BVH bounds everything except planes. Origins on planes outside of it are clamped.
+    BVH* bvh = (BVH*) world->bvh;
+    AABB sceneBounds = EmptyAABB();
+    if (bvh->wideNodeCount > 0) {
+        WideBVHNode* root = bvh->wideNodes;
+        for (uint32_t childIndex = 0; childIndex < LANE_WIDTH; ++childIndex) {
+            if (root->children[childIndex] != WIDE_BVH_EMPTY_CHILD) {
+                for (uint32_t corner = 0; corner < 2; ++corner) {
+                    sceneBounds = Union(sceneBounds, Vector3(GetLane(root->bounds[corner].x, childIndex),
+                                                             GetLane(root->bounds[corner].y, childIndex),
+                                                             GetLane(root->bounds[corner].z, childIndex)));
+                }
+            }
+        }
+    }
+
+    float cellCount = (float) (1 << WAVEFRONT_ORIGIN_BITS);
+    float sceneMin[3];
+    float sceneScale[3];
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        float extent = sceneBounds.max[axis] - sceneBounds.min[axis];
+        sceneMin[axis] = extent > 0.0f ? sceneBounds.min[axis] : 0.0f;
+        sceneScale[axis] = extent > 0.0f ? cellCount / extent : 0.0f;
+    }
+    wavefront->sceneMin = Vector3(sceneMin[0], sceneMin[1], sceneMin[2]);
+    wavefront->sceneScale = Vector3(sceneScale[0], sceneScale[1], sceneScale[2]);
+}
+
+static void FreeWavefront(Wavefront* wavefront) {
+    delete[] wavefront->pixels;
+    delete[] wavefront->pixelStates;
+    delete[] wavefront->imagePixelIndices;
+    delete[] wavefront->filmX;
+    delete[] wavefront->filmY;
+    delete[] wavefront->samplers;
+    delete[] wavefront->sampleRadiance;
+    delete[] wavefront->pathPixels;
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        _mm_free(wavefront->rayOrigins[axis]);
+        _mm_free(wavefront->rayDirections[axis]);
+        _mm_free(wavefront->radiance[axis]);
+        _mm_free(wavefront->attenuation[axis]);
+        _mm_free(wavefront->hitNormals[axis]);
+    }
+    _mm_free(wavefront->previousBouncePdf);
+    _mm_free(wavefront->previousBounceSampledLights);
+    delete[] wavefront->bounceIndices;
+    _mm_free(wavefront->randomStates);
+    _mm_free(wavefront->hitDistances);
+    delete[] wavefront->hitMaterialIndices;
+    delete[] wavefront->sortedPaths;
+    delete[] wavefront->sortKeys;
+    delete[] wavefront->sortScratchPaths;
+    delete[] wavefront->sortScratchKeys;
+}
+
+// Same as StartPath for a slot.
+inline void StartWavefrontPath(Wavefront* wavefront, uint32_t slot, uint32_t pixelIndex, Ray* ray) {
+    wavefront->pathPixels[slot] = pixelIndex;
+    wavefront->randomStates[slot] = wavefront->pixelStates[pixelIndex].randomState;
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        wavefront->rayOrigins[axis][slot] = ray->origin[axis];
+        wavefront->rayDirections[axis][slot] = ray->direction[axis];
+        wavefront->radiance[axis][slot] = 0.0f;
+        wavefront->attenuation[axis][slot] = 1.0f;
+    }
+    wavefront->previousBouncePdf[slot] = 0.0f;
+    wavefront->previousBounceSampledLights[slot] = 0.0f;
+    wavefront->bounceIndices[slot] = 0;
+}
+
+inline void MoveWavefrontPath(Wavefront* wavefront, uint32_t fromSlot, uint32_t toSlot) {
+    wavefront->pathPixels[toSlot] = wavefront->pathPixels[fromSlot];
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        wavefront->rayOrigins[axis][toSlot] = wavefront->rayOrigins[axis][fromSlot];
+        wavefront->rayDirections[axis][toSlot] = wavefront->rayDirections[axis][fromSlot];
+        wavefront->radiance[axis][toSlot] = wavefront->radiance[axis][fromSlot];
+        wavefront->attenuation[axis][toSlot] = wavefront->attenuation[axis][fromSlot];
+    }
+    wavefront->previousBouncePdf[toSlot] = wavefront->previousBouncePdf[fromSlot];
+    wavefront->previousBounceSampledLights[toSlot] = wavefront->previousBounceSampledLights[fromSlot];
+    wavefront->bounceIndices[toSlot] = wavefront->bounceIndices[fromSlot];
+    wavefront->randomStates[toSlot] = wavefront->randomStates[fromSlot];
+}
+
+inline Ray GetWavefrontRay(Wavefront* wavefront, uint32_t slot) {
+    Ray result = {};
+    result.origin = Vector3(wavefront->rayOrigins[0][slot], wavefront->rayOrigins[1][slot],
+                            wavefront->rayOrigins[2][slot]);
+    result.direction = Vector3(wavefront->rayDirections[0][slot], wavefront->rayDirections[1][slot],
+                               wavefront->rayDirections[2][slot]);
+    return result;
+}
+
+inline void SetWavefrontHit(Wavefront* wavefront, uint32_t slot, WorldIntersectionResult* hit) {
+    wavefront->hitDistances[slot] = hit->t;
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        wavefront->hitNormals[axis][slot] = hit->hitNormal[axis];
+    }
+    wavefront->hitMaterialIndices[slot] = hit->hitMaterialIndex;
+}
+
+// Moves the low 10 bits of value to every third bit.
+inline uint32_t SpreadBitsBy3(uint32_t value) {
+    value &= 0x3FF;
+    value = (value | (value << 16)) & 0x030000FF;
+    value = (value | (value << 8)) & 0x0300F00F;
+    value = (value | (value << 4)) & 0x030C30C3;
+    value = (value | (value << 2)) & 0x09249249;
+    return value;
+}
+
+// Direction octant on top, Morton code of the quantized origin below it.
+// Rays next to each other after sorting start close to each other and go the same way.
+inline uint32_t GetRaySortKey(Wavefront* wavefront, Ray* ray) {
+    uint32_t octant = (ray->direction.x < 0.0f) << 2 | (ray->direction.y < 0.0f) << 1 | (ray->direction.z < 0.0f);
+    uint32_t key = octant << (3 * WAVEFRONT_ORIGIN_BITS);
+
+    float maxCell = (float) ((1 << WAVEFRONT_ORIGIN_BITS) - 1);
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        float cell = (ray->origin[axis] - wavefront->sceneMin[axis]) * wavefront->sceneScale[axis];
+        cell = Min(Max(cell, 0.0f), maxCell);
+        key |= SpreadBitsBy3((uint32_t) cell) << (2 - axis);
+    }
+    return key;
+}
+
+// LSD radix sort of slots by their keys, a byte at a time.
+static void SortLivePaths(Wavefront* wavefront) {
+    uint32_t count = wavefront->livePathCount;
+    uint32_t* keys = wavefront->sortKeys;
+    uint32_t* paths = wavefront->sortedPaths;
+    uint32_t* scratchKeys = wavefront->sortScratchKeys;
+    uint32_t* scratchPaths = wavefront->sortScratchPaths;
+
+    for (uint32_t shift = 0; shift < 32; shift += 8) {
+        uint32_t offsets[256] = {};
+        for (uint32_t i = 0; i < count; ++i) {
+            ++offsets[(keys[i] >> shift) & 0xFF];
+        }
+
+        uint32_t offset = 0;
+        for (uint32_t bucket = 0; bucket < 256; ++bucket) {
+            uint32_t bucketCount = offsets[bucket];
+            offsets[bucket] = offset;
+            offset += bucketCount;
+        }
+
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t destIndex = offsets[(keys[i] >> shift) & 0xFF]++;
+            scratchKeys[destIndex] = keys[i];
+            scratchPaths[destIndex] = paths[i];
+        }
+
+        uint32_t* swapKeys = keys;
+        keys = scratchKeys;
+        scratchKeys = swapKeys;
+        uint32_t* swapPaths = paths;
+        paths = scratchPaths;
+        scratchPaths = swapPaths;
+    }
+
+    // Even number of passes, so the result is back in the original buffers.
+}
+
+// ShadePathHit for the lane of slots starting at firstSlot. Light sampling stays scalar, everything else is done
+// a lane at a time. Every path takes the same samples ShadePathHit would. Random samplers draw BSDF samples from
+// lane streams, others get them in the scalar loop.
+// Returns a bit per lane for paths that continue.
+uint32_t ShadePathHitLanes(World* world, Wavefront* wavefront, uint32_t firstSlot, uint64_t* bounceCount) {
+    uint32_t laneCount = wavefront->livePathCount - firstSlot;
+    if (laneCount > LANE_WIDTH) {
+        laneCount = LANE_WIDTH;
+    }
+
+    // Lanes past the last slot are never written back, whatever they compute.
+    ALIGN_LANE float activeLanes[LANE_WIDTH];
+    uint32_t materialIndices[LANE_WIDTH];
+    for (uint32_t laneIndex = 0; laneIndex < LANE_WIDTH; ++laneIndex) {
+        activeLanes[laneIndex] = laneIndex < laneCount ? 1.0f : 0.0f;
+        materialIndices[laneIndex] = laneIndex < laneCount ? wavefront->hitMaterialIndices[firstSlot + laneIndex] : 0;
+    }
+
+    MaterialLane material = GatherMaterialLane(world, materialIndices);
+    LaneF32 hitDistance(wavefront->hitDistances + firstSlot);
+    LaneMask hitMask = (LaneF32(activeLanes) > LaneF32(0.0f)) & (hitDistance < LaneF32(F32Max));
+    LaneVector3 rayOrigin(LaneF32(wavefront->rayOrigins[0] + firstSlot), LaneF32(wavefront->rayOrigins[1] + firstSlot),
+                          LaneF32(wavefront->rayOrigins[2] + firstSlot));
+    LaneVector3 rayDirection(LaneF32(wavefront->rayDirections[0] + firstSlot),
+                             LaneF32(wavefront->rayDirections[1] + firstSlot),
+                             LaneF32(wavefront->rayDirections[2] + firstSlot));
+    LaneVector3 hitNormal(LaneF32(wavefront->hitNormals[0] + firstSlot), LaneF32(wavefront->hitNormals[1] + firstSlot),
+                          LaneF32(wavefront->hitNormals[2] + firstSlot));
+    LaneVector3 pathRadiance(LaneF32(wavefront->radiance[0] + firstSlot), LaneF32(wavefront->radiance[1] + firstSlot),
+                             LaneF32(wavefront->radiance[2] + firstSlot));
+    LaneVector3 pathAttenuation(LaneF32(wavefront->attenuation[0] + firstSlot),
+                                LaneF32(wavefront->attenuation[1] + firstSlot),
+                                LaneF32(wavefront->attenuation[2] + firstSlot));
+    LaneF32 bouncePdf(wavefront->previousBouncePdf + firstSlot);
+    LaneF32 previousBounceSampledLights(wavefront->previousBounceSampledLights + firstSlot);
+
+    // Misses keep full weight, so they add sky emission the same way.
+    LaneF32 emissionWeight(1.0f);
+    LaneMask weightedEmissionMask = hitMask & (previousBounceSampledLights > LaneF32(0.0f)) &
+                                    (material.lightAreaDensity > LaneF32(0.0f));
+    if (!MaskIsZeroed(weightedEmissionMask)) {
+        LaneF32 cosLight = Max(-DotProduct(hitNormal, rayDirection), LaneF32(0.0001f));
+        LaneF32 lightPdf = material.lightAreaDensity * hitDistance * hitDistance / cosLight;
+        Select(&emissionWeight, weightedEmissionMask, PowerHeuristic(bouncePdf, lightPdf));
+    }
+
+    pathRadiance = pathRadiance + pathAttenuation * material.emitColor * emissionWeight;
+    rayOrigin = rayOrigin + rayDirection * hitDistance;
+
+    LaneMask diffuseMask = hitMask & (material.reflection == LaneF32(0.0f)) &
+                           (material.refractiveIndex == LaneF32(0.0f));
+    LaneMask specularMask = hitMask & ((material.reflection != LaneF32(0.0f)) |
+                                       (material.refractiveIndex != LaneF32(0.0f)));
+    uint32_t hitBits = GetMaskBits(hitMask);
+    uint32_t diffuseBits = GetMaskBits(diffuseMask);
+    LaneVector3 diffuseNormal = hitNormal;
+    Select(&diffuseNormal, DotProduct(hitNormal, rayDirection) > LaneF32(0.0f), -hitNormal);
+
+    ALIGN_LANE float origin[3][LANE_WIDTH];
+    ALIGN_LANE float normal[3][LANE_WIDTH];
+    ALIGN_LANE float lightRadiance[3][LANE_WIDTH] = {};
+    ALIGN_LANE float bsdfSamples[BSDF_SAMPLE_COUNT][LANE_WIDTH] = {};
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        StoreLane(origin[axis], rayOrigin[axis]);
+        StoreLane(normal[axis], diffuseNormal[axis]);
+    }
+    bool useLaneRandom = wavefront->samplers[0].type == SamplerType_Random;
+    for (uint32_t laneIndex = 0; laneIndex < laneCount; ++laneIndex) {
+        ++*bounceCount;
+        uint32_t slot = firstSlot + laneIndex;
+        Sampler sampler = wavefront->samplers[wavefront->pathPixels[slot]];
+        sampler.randomState = wavefront->randomStates + slot;
+        uint32_t bounceIndex = wavefront->bounceIndices[slot];
+        if (diffuseBits & (1 << laneIndex)) {
+            Vector3 color = world->materials[materialIndices[laneIndex]].color;
+            if (world->lightCount > 0 && Luminance(color) > 0.0f) {
+                float lightSamples[3];
+                GetSamples(&sampler, GetLightSampleSet(bounceIndex), 3, lightSamples);
+                Vector3 position(origin[0][laneIndex], origin[1][laneIndex], origin[2][laneIndex]);
+                Vector3 surfaceNormal(normal[0][laneIndex], normal[1][laneIndex], normal[2][laneIndex]);
+                Vector3 light = SampleRectangleLights(world, position, surfaceNormal, color, lightSamples, bounceCount);
+                for (uint32_t axis = 0; axis < 3; ++axis) {
+                    lightRadiance[axis][laneIndex] = light[axis];
+                }
+            }
+        }
+
+        if (!useLaneRandom && (hitBits & (1 << laneIndex))) {
+            float samples[BSDF_SAMPLE_COUNT] = {};
+            GetSamples(&sampler, GetBSDFSampleSet(bounceIndex), (diffuseBits & (1 << laneIndex)) ? 2 : BSDF_SAMPLE_COUNT,
+                       samples);
+            for (uint32_t dimension = 0; dimension < BSDF_SAMPLE_COUNT; ++dimension) {
+                bsdfSamples[dimension][laneIndex] = samples[dimension];
+            }
+        }
+    }
+
+    // Every lane draws the numbers of both cases, and keeps the stream of the case it takes.
+    LaneU32 randomState(wavefront->randomStates + firstSlot);
+
+    pathRadiance = pathRadiance + pathAttenuation * LaneVector3(lightRadiance);
+
+    // Same lobes as SampleBSDF. Both cases take the Lambert direction or microfacet normal from the first two numbers,
+    // so their random streams only differ in how many numbers they draw.
+    LaneF32 u1(bsdfSamples[0]);
+    LaneF32 u2(bsdfSamples[1]);
+    LaneF32 lobeChoice(bsdfSamples[2]);
+    LaneF32 fresnelChoice(bsdfSamples[3]);
+    if (useLaneRandom) {
+        LaneU32 nextRandomState = randomState;
+        u1 = RandomUnilateral(&nextRandomState);
+        u2 = RandomUnilateral(&nextRandomState);
+        Select(&randomState, diffuseMask, nextRandomState);
+        lobeChoice = RandomUnilateral(&nextRandomState);
+        fresnelChoice = RandomUnilateral(&nextRandomState);
+        Select(&randomState, specularMask, nextRandomState);
+    }
+
+    // Same as GetSpecularShare.
+    LaneF32 specularShare = material.reflection;
+    Select(&specularShare, material.refractiveIndex != LaneF32(0.0f), LaneF32(1.0f));
+    LaneMask mirrorMask = specularMask & (lobeChoice < specularShare);
+    LaneMask lambertMask = diffuseMask | (specularMask & (lobeChoice >= specularShare));
+    LaneVector3 bounceDirection = rayDirection;
+    LaneVector3 bsdfWeight = material.color;
+    if (!MaskIsZeroed(lambertMask)) {
+        LaneVector3 lambertDirection = SampleCosineHemisphere(diffuseNormal, u1, u2);
+        LaneF32 lambertPdf = Max(DotProduct(diffuseNormal, lambertDirection), LaneF32(0.0f)) * LaneF32(1.0f / PI);
+        Select(&bounceDirection, lambertMask, lambertDirection);
+        Select(&bouncePdf, lambertMask, (LaneF32(1.0f) - specularShare) * lambertPdf);
+    }
+
+    if (!MaskIsZeroed(mirrorMask)) {
+        // Smooth lanes keep the surface normal as their microfacet normal.
+        LaneVector3 outgoing = -rayDirection;
+        LaneF32 alpha = material.roughness * material.roughness;
+        LaneMask roughMask = mirrorMask & (alpha > LaneF32(0.0f));
+        LaneVector3 microfacetNormal = diffuseNormal;
+        if (!MaskIsZeroed(roughMask)) {
+            Select(&microfacetNormal, roughMask, SampleGGXVisibleNormal(diffuseNormal, outgoing, alpha, u1, u2));
+        }
+
+        LaneVector3 mirrorDirection = rayDirection - microfacetNormal *
+                                      (DotProduct(microfacetNormal, rayDirection) * LaneF32(2.0f));
+        LaneF32 lobePdf = specularShare;
+        LaneF32 refracted(0.0f);
+        LaneF32 directionIor(1.0f);
+        LaneF32 outgoingIor(1.0f);
+        LaneMask refractiveMask = mirrorMask & (material.refractiveIndex != LaneF32(0.0f));
+        if (!MaskIsZeroed(refractiveMask)) {
+            LaneF32 cosHitNormal = DotProduct(hitNormal, diffuseNormal);
+            LaneMask enteringMask = cosHitNormal > LaneF32(0.0f);
+            LaneMask exitingMask = cosHitNormal <= LaneF32(0.0f);
+            LaneVector3 orientedNormal = -microfacetNormal;
+            Select(&orientedNormal, enteringMask, microfacetNormal);
+            LaneVector3 refractedDirection;
+            LaneMask refractMask = refractiveMask & Refract(rayDirection, orientedNormal, material.refractiveIndex,
+                                                            &refractedDirection);
+            LaneF32 fresnelCoefficient(1.0f);
+            Select(&fresnelCoefficient, refractMask, Schlick(rayDirection, microfacetNormal, material.refractiveIndex));
+            LaneMask transmitMask = refractMask & (fresnelChoice > fresnelCoefficient);
+            Select(&mirrorDirection, transmitMask, NormalizeExact(refractedDirection));
+            Select(&lobePdf, refractMask, lobePdf * fresnelCoefficient);
+            Select(&lobePdf, transmitMask, specularShare * (LaneF32(1.0f) - fresnelCoefficient));
+            Select(&refracted, transmitMask, LaneF32(1.0f));
+            Select(&directionIor, transmitMask & enteringMask, material.refractiveIndex);
+            Select(&outgoingIor, transmitMask & exitingMask, material.refractiveIndex);
+        }
+
+        LaneMask metalMask = mirrorMask & (material.refractiveIndex == LaneF32(0.0f)) &
+                             (material.metalness > LaneF32(0.0f));
+        if (!MaskIsZeroed(metalMask)) {
+            LaneVector3 fresnel = SchlickConductor(material.color, DotProduct(outgoing, microfacetNormal));
+            Select(&bsdfWeight, metalMask, Lerp(material.color, material.metalness, fresnel));
+        }
+
+        LaneF32 mirrorPdf(0.0f);
+        if (!MaskIsZeroed(roughMask)) {
+            LaneF32 cosOutgoing = DotProduct(diffuseNormal, outgoing);
+            LaneF32 cosDirection = DotProduct(diffuseNormal, mirrorDirection);
+            LaneMask refractedMask = refracted > LaneF32(0.0f);
+            LaneMask wrongSideMask = ((refractedMask & (cosDirection >= LaneF32(0.0f))) |
+                                      ((refracted == LaneF32(0.0f)) & (cosDirection <= LaneF32(0.0f))));
+
+            LaneF32 lambdaOutgoing = GGXLambda(cosOutgoing, alpha);
+            LaneF32 lambdaDirection = GGXLambda(cosDirection, alpha);
+            LaneF32 masking = (LaneF32(1.0f) + lambdaOutgoing) / (LaneF32(1.0f) + lambdaOutgoing + lambdaDirection);
+            Select(&masking, wrongSideMask, LaneF32(0.0f));
+            Select(&bsdfWeight, roughMask, bsdfWeight * masking);
+
+            LaneF32 microfacetOutgoing = DotProduct(microfacetNormal, outgoing);
+            LaneF32 microfacetDirection = DotProduct(microfacetNormal, mirrorDirection);
+            LaneF32 visibleNormalPdf = GGXDistribution(DotProduct(diffuseNormal, microfacetNormal), alpha) *
+                                       microfacetOutgoing / (cosOutgoing * (LaneF32(1.0f) + lambdaOutgoing));
+            LaneF32 denominator = FMulAdd(outgoingIor, microfacetOutgoing, directionIor * microfacetDirection);
+            LaneF32 roughPdf = visibleNormalPdf / (LaneF32(4.0f) * microfacetOutgoing);
+            Select(&roughPdf, refractedMask, visibleNormalPdf * directionIor * directionIor *
+                                             Max(microfacetDirection, -microfacetDirection) /
+                                             (denominator * denominator));
+            Select(&mirrorPdf, roughMask, lobePdf * roughPdf);
+            Select(&mirrorPdf, wrongSideMask, LaneF32(0.0f));
+        }
+        Select(&bounceDirection, mirrorMask, mirrorDirection);
+        Select(&bouncePdf, mirrorMask, mirrorPdf);
+    }
+    pathAttenuation = pathAttenuation * bsdfWeight;
+
+    for (uint32_t axis = 0; axis < 3; ++axis) {
+        StoreLane(wavefront->rayOrigins[axis] + firstSlot, rayOrigin[axis]);
+        StoreLane(wavefront->rayDirections[axis] + firstSlot, bounceDirection[axis]);
+        StoreLane(wavefront->radiance[axis] + firstSlot, pathRadiance[axis]);
+        StoreLane(wavefront->attenuation[axis] + firstSlot, pathAttenuation[axis]);
+    }
+    StoreLane(wavefront->previousBouncePdf + firstSlot, bouncePdf);
+    StoreLane(wavefront->randomStates + firstSlot, randomState);
+    LaneF32 sampledLights(0.0f);
+    Select(&sampledLights, diffuseMask, LaneF32(1.0f));
+    StoreLane(wavefront->previousBounceSampledLights + firstSlot, sampledLights);
+
+    // Russian roulette stays scalar. Most lanes don't need it, and the ones that do only need a single number.
+    uint32_t aliveBits = 0;
+    for (uint32_t laneIndex = 0; laneIndex < laneCount; ++laneIndex) {
+        if (!(hitBits & (1 << laneIndex))) {
+            continue;
+        }
+
+        uint32_t slot = firstSlot + laneIndex;
+        Sampler sampler = wavefront->samplers[wavefront->pathPixels[slot]];
+        sampler.randomState = wavefront->randomStates + slot;
+        Vector3 attenuation(wavefront->attenuation[0][slot], wavefront->attenuation[1][slot],
+                            wavefront->attenuation[2][slot]);
+        if (ContinuePath(&sampler, &attenuation, ++wavefront->bounceIndices[slot], wavefront->minBounceCount,
+                         wavefront->maxBounceCount)) {
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                wavefront->attenuation[axis][slot] = attenuation[axis];
+            }
+            aliveBits |= 1 << laneIndex;
+        }
+    }
+
+    return aliveBits;
+}
+
+// Takes passSampleCount samples for every pixel of the wave. Pixels, their states and film coordinates are filled
+// by the caller. Every sample is traced bounce by bounce over all pixels.
+static void TraceWavefront(World* world, Wavefront* wavefront, CameraFilm* film, uint32_t passSampleCount,
+                           uint64_t* bounceCount, uint64_t* pathRayCount) {
+    for (uint32_t sampleIndex = 0; sampleIndex < passSampleCount; ++sampleIndex) {
+        for (uint32_t pixelIndex = 0; pixelIndex < wavefront->pixelCount; ++pixelIndex) {
+            Sampler* sampler = wavefront->samplers + pixelIndex;
+            sampler->sampleIndex = wavefront->pixelStates[pixelIndex].sampleCount;
+            Ray ray = {};
+            ray.origin = film->position;
+            ray.direction = SampleCameraRayDirection(film, wavefront->filmX[pixelIndex], wavefront->filmY[pixelIndex],
+                                                     sampler);
+            StartWavefrontPath(wavefront, pixelIndex, pixelIndex, &ray);
+        }
+        wavefront->livePathCount = wavefront->pixelCount;
+
+        for (uint32_t bounceIndex = 0; wavefront->livePathCount > 0; ++bounceIndex) {
+            uint32_t livePathCount = wavefront->livePathCount;
+            *pathRayCount += livePathCount;
+            if (bounceIndex > 0) {
+                // Bounce rays go everywhere, so we trace them in sorted order. Packets would visit the union of
+                // their nodes even after sorting. Single ray traversal was faster, neighbours still share cached
+                // nodes and leaves.
+                for (uint32_t slot = 0; slot < livePathCount; ++slot) {
+                    Ray ray = GetWavefrontRay(wavefront, slot);
+                    wavefront->sortKeys[slot] = GetRaySortKey(wavefront, &ray);
+                    wavefront->sortedPaths[slot] = slot;
+                }
+                SortLivePaths(wavefront);
+
+                for (uint32_t i = 0; i < livePathCount; ++i) {
+                    uint32_t slot = wavefront->sortedPaths[i];
+                    Ray ray = GetWavefrontRay(wavefront, slot);
+                    WorldIntersectionResult hit = {};
+                    IntersectWorldWide(world, &ray, &hit);
+                    SetWavefrontHit(wavefront, slot, &hit);
+                }
+            } else {
+                // Camera rays of neighbouring pixels are in neighbouring slots already, so they go in packets as is.
+                for (uint32_t firstSlot = 0; firstSlot < livePathCount; firstSlot += LANE_WIDTH) {
+                    ALIGN_LANE float activeLanes[LANE_WIDTH];
+                    for (uint32_t laneIndex = 0; laneIndex < LANE_WIDTH; ++laneIndex) {
+                        activeLanes[laneIndex] = firstSlot + laneIndex < livePathCount ? 1.0f : 0.0f;
+                    }
+
+                    LaneVector3 rayOriginLane(LaneF32(wavefront->rayOrigins[0] + firstSlot),
+                                              LaneF32(wavefront->rayOrigins[1] + firstSlot),
+                                              LaneF32(wavefront->rayOrigins[2] + firstSlot));
+                    LaneVector3 rayDirectionLane(LaneF32(wavefront->rayDirections[0] + firstSlot),
+                                                 LaneF32(wavefront->rayDirections[1] + firstSlot),
+                                                 LaneF32(wavefront->rayDirections[2] + firstSlot));
+                    WorldIntersectionResult hits[LANE_WIDTH];
+                    IntersectWorldPacket(world, rayOriginLane, rayDirectionLane, LaneF32(activeLanes) > LaneF32(0.0f),
+                                         hits);
+                    for (uint32_t laneIndex = 0; laneIndex < LANE_WIDTH; ++laneIndex) {
+                        uint32_t slot = firstSlot + laneIndex;
+                        SetWavefrontHit(wavefront, slot, hits + laneIndex);
+                        if (slot < livePathCount && wavefront->aovs) {
+                            Ray ray = GetWavefrontRay(wavefront, slot);
+                            uint64_t pixelIndex = wavefront->imagePixelIndices[wavefront->pathPixels[slot]];
+                            AddHitAOVs(world, wavefront->aovs, pixelIndex, ray.direction, hits + laneIndex);
+                        }
+                    }
+                }
+            }
+
+            // Shade a lane of slots at a time. Finished paths leave their radiance to the pixel,
+            // and the others move down to fill the gaps.
+            uint32_t nextLivePathCount = 0;
+            for (uint32_t firstSlot = 0; firstSlot < livePathCount; firstSlot += LANE_WIDTH) {
+                uint32_t aliveBits = ShadePathHitLanes(world, wavefront, firstSlot, bounceCount);
+                uint32_t laneCount = livePathCount - firstSlot < LANE_WIDTH ? livePathCount - firstSlot : LANE_WIDTH;
+                for (uint32_t laneIndex = 0; laneIndex < laneCount; ++laneIndex) {
+                    uint32_t slot = firstSlot + laneIndex;
+                    if (aliveBits & (1 << laneIndex)) {
+                        if (slot != nextLivePathCount) {
+                            MoveWavefrontPath(wavefront, slot, nextLivePathCount);
+                        }
+                        ++nextLivePathCount;
+                    } else {
+                        uint32_t pixelIndex = wavefront->pathPixels[slot];
+                        wavefront->sampleRadiance[pixelIndex] = Vector3(wavefront->radiance[0][slot],
+                                                                        wavefront->radiance[1][slot],
+                                                                        wavefront->radiance[2][slot]);
+                        wavefront->pixelStates[pixelIndex].randomState = wavefront->randomStates[slot];
+                    }
+                }
+            }
+            wavefront->livePathCount = nextLivePathCount;
+        }
+
+        for (uint32_t pixelIndex = 0; pixelIndex < wavefront->pixelCount; ++pixelIndex) {
+            AddPixelSample(wavefront->pixelStates + pixelIndex, wavefront->sampleRadiance[pixelIndex]);
+        }
+    }
+}
+
+// Wavefront is null unless wavefront tracing is on.
+static void RenderTile(WorkQueue* workQueue, WorkDeque* ownDeque, WorkOrder workOrder, Wavefront* wavefront) {
+    Image* image = workQueue->image;
+    World* world = workQueue->world;
+    uint32_t startRowIndex = workOrder.startRowIndex;
+    uint32_t endRowIndex = workOrder.endRowIndex;
+    uint32_t startColumnIndex = workOrder.startColumnIndex;
+    uint32_t endColumnIndex = workOrder.endColumnIndex;
+    uint32_t passSampleCount = workQueue->passSampleCount;
+    bool tracePrimaryPackets = workQueue->tracePrimaryPackets;
+    AOVBuffers* aovs = GetAOVBuffers(workQueue);
+
+    CameraFilm film = MakeCameraFilm(world->camera, image);
+    // Inactive packet lanes still need a sane direction.
+    Vector3 cameraForward = -world->camera->zVec;
+
+    uint64_t totalBounces = 0;
+    uint64_t totalPathRays = 0;
+    uint64_t totalSamples = 0;
+    uint64_t activePixelCount = 0;
+
+    // Packets and waves cover a few rows, so we go through rows in groups. Groups are aligned to the image instead
+    // of the tile, and tiles are only split between groups. So the pixels that share a packet don't depend on splitting.
+    uint32_t rowGroupSize = 1;
+    if (wavefront) {
+        rowGroupSize = WAVEFRONT_ROW_COUNT;
+    } else if (tracePrimaryPackets) {
+        rowGroupSize = PACKET_ROW_COUNT;
+    }
+    uint32_t y = startRowIndex;
+    while (y < endRowIndex) {
+        // Rows we skip keep the samples of the previous passes. Resolve divides by each pixel's own count anyway.
+        if (workQueue->deadlineMs && GetTimeMilliseconds() >= workQueue->deadlineMs) {
+            workQueue->isOutOfTime = true;
+            break;
+        }
+
+        // Some thread ran out of work. Give away the bottom half of the rows we haven't started yet.
+        // This way expensive tiles get split, and the last tiles of the image get shared between all threads.
+        uint32_t remainingRowCount = endRowIndex - y;
+        if (remainingRowCount >= 2 && workQueue->idleThreadCount > 0) {
+            uint32_t splitRowIndex = y + remainingRowCount / 2;
+            splitRowIndex -= splitRowIndex % rowGroupSize;
+            WorkOrder splitOrder = workOrder;
+            splitOrder.startRowIndex = splitRowIndex;
+            if (splitRowIndex > y && PushWork(ownDeque, PackWorkOrder(splitOrder))) {
+                endRowIndex = splitRowIndex;
+            }
+        }
+
+        uint32_t rowGroupStartIndex = y - y % rowGroupSize;
+        uint32_t rowGroupEndIndex = rowGroupStartIndex + rowGroupSize;
+        if (rowGroupEndIndex > endRowIndex) {
+            rowGroupEndIndex = endRowIndex;
+        }
+
+        if (wavefront) {
+            wavefront->pixelCount = 0;
+            for (uint32_t row = y; row < rowGroupEndIndex; ++row) {
+                PixelAccumulator* pixel = workQueue->accumulators + (row * image->width + startColumnIndex);
+                for (uint32_t x = startColumnIndex; x < endColumnIndex; ++x, ++pixel) {
+                    if (pixel->isConverged) {
+                        continue;
+                    }
+
+                    uint32_t pathIndex = wavefront->pixelCount++;
+                    wavefront->pixels[pathIndex] = pixel;
+                    wavefront->pixelStates[pathIndex] = *pixel;
+                    wavefront->imagePixelIndices[pathIndex] = (uint64_t) row * image->width + x;
+                    wavefront->filmX[pathIndex] = (((float) x / (float) image->width) * 2.0f - 1.0f);
+                    wavefront->filmY[pathIndex] = ((float) row / (float) image->height) * -2.0f + 1.0f;
+                    wavefront->samplers[pathIndex] = MakePixelSampler(workQueue, x, row,
+                                                                      wavefront->pixelStates + pathIndex);
+                }
+            }
+
+            TraceWavefront(world, wavefront, &film, passSampleCount, &totalBounces, &totalPathRays);
+
+            for (uint32_t pathIndex = 0; pathIndex < wavefront->pixelCount; ++pathIndex) {
+                PixelAccumulator* pixel = wavefront->pixels[pathIndex];
+                *pixel = wavefront->pixelStates[pathIndex];
+                totalSamples += passSampleCount;
+                activePixelCount += UpdatePixelConvergence(workQueue, pixel);
+            }
+        } else if (!tracePrimaryPackets) {
+            float filmY = ((float) y / (float) image->height) * -2.0f + 1.0f;
+            PixelAccumulator* pixel = workQueue->accumulators + (y * image->width + startColumnIndex);
+            for (uint32_t x = startColumnIndex; x < endColumnIndex; ++x, ++pixel) {
+                if (pixel->isConverged) {
+                    continue;
+                }
+
+                float filmX = (((float) x / (float) image->width) * 2.0f - 1.0f);
+
+                PixelAccumulator pixelState = *pixel;
+                Sampler sampler = MakePixelSampler(workQueue, x, y, &pixelState);
+                uint64_t pixelIndex = (uint64_t) y * image->width + x;
+                for (uint32_t sampleIndex = 0; sampleIndex < passSampleCount; ++sampleIndex) {
+                    sampler.sampleIndex = pixelState.sampleCount;
+                    Ray ray = {};
+                    ray.origin = film.position;
+                    ray.direction = SampleCameraRayDirection(&film, filmX, filmY, &sampler);
+
+                    Vector3 sampleColor = RaytraceWorld(world, &ray, 0, &sampler, workQueue, aovs, pixelIndex,
+                                                        &totalBounces, &totalPathRays);
+                    AddPixelSample(&pixelState, sampleColor);
+                }
+
+                *pixel = pixelState;
+                totalSamples += passSampleCount;
+                activePixelCount += UpdatePixelConvergence(workQueue, pixel);
+            }
+        } else {
+            // Lanes go through the pixel block row by row. Pixels outside of the tile and converged pixels
+            // get inactive lanes. After the first hit every ray continues on its own.
+            uint32_t firstPacketColumnIndex = startColumnIndex - startColumnIndex % PACKET_COLUMN_COUNT;
+            for (uint32_t packetX = firstPacketColumnIndex; packetX < endColumnIndex; packetX += PACKET_COLUMN_COUNT) {
+                PixelAccumulator* pixels[LANE_WIDTH];
+                PixelAccumulator pixelStates[LANE_WIDTH];
+                uint64_t pixelIndices[LANE_WIDTH];
+                Sampler samplers[LANE_WIDTH];
+                float filmXs[LANE_WIDTH];
+                float filmYs[LANE_WIDTH];
+                ALIGN_LANE float activeLanes[LANE_WIDTH];
+                uint32_t activeLaneCount = 0;
+                for (uint32_t laneIndex = 0; laneIndex < LANE_WIDTH; ++laneIndex) {
+                    uint32_t x = packetX + laneIndex % PACKET_COLUMN_COUNT;
+                    uint32_t row = rowGroupStartIndex + laneIndex / PACKET_COLUMN_COUNT;
+                    pixels[laneIndex] = 0;
+                    activeLanes[laneIndex] = 0.0f;
+                    if (x < startColumnIndex || x >= endColumnIndex || row < y || row >= rowGroupEndIndex) {
+                        continue;
+                    }
+
+                    PixelAccumulator* pixel = workQueue->accumulators + (row * image->width + x);
+                    if (pixel->isConverged) {
+                        continue;
+                    }
+
+                    pixels[laneIndex] = pixel;
+                    pixelStates[laneIndex] = *pixel;
+                    pixelIndices[laneIndex] = (uint64_t) row * image->width + x;
+                    samplers[laneIndex] = MakePixelSampler(workQueue, x, row, pixelStates + laneIndex);
+                    filmXs[laneIndex] = (((float) x / (float) image->width) * 2.0f - 1.0f);
+                    filmYs[laneIndex] = ((float) row / (float) image->height) * -2.0f + 1.0f;
+                    activeLanes[laneIndex] = 1.0f;
+                    ++activeLaneCount;
+                }
+
+                if (activeLaneCount == 0) {
+                    continue;
+                }
+
+                LaneMask activeMask = LaneF32(activeLanes) > LaneF32(0.0f);
+                LaneVector3 rayOriginLane(film.position);
+                for (uint32_t sampleIndex = 0; sampleIndex < passSampleCount; ++sampleIndex) {
+                    Vector3 rayDirections[LANE_WIDTH];
+                    ALIGN_LANE float rayDirectionArray[3][LANE_WIDTH];
+                    for (uint32_t laneIndex = 0; laneIndex < LANE_WIDTH; ++laneIndex) {
+                        rayDirections[laneIndex] = cameraForward;
+                        if (pixels[laneIndex]) {
+                            samplers[laneIndex].sampleIndex = pixelStates[laneIndex].sampleCount;
+                            rayDirections[laneIndex] = SampleCameraRayDirection(&film, filmXs[laneIndex], filmYs[laneIndex],
+                                                                                samplers + laneIndex);
+                        }
+                        rayDirectionArray[0][laneIndex] = rayDirections[laneIndex].x;
+                        rayDirectionArray[1][laneIndex] = rayDirections[laneIndex].y;
+                        rayDirectionArray[2][laneIndex] = rayDirections[laneIndex].z;
+                    }
+
+                    WorldIntersectionResult firstHits[LANE_WIDTH];
+                    IntersectWorldPacket(world, rayOriginLane, LaneVector3(rayDirectionArray), activeMask, firstHits);
+
+                    for (uint32_t laneIndex = 0; laneIndex < LANE_WIDTH; ++laneIndex) {
+                        if (!pixels[laneIndex]) {
+                            continue;
+                        }
+
+                        Ray ray = {};
+                        ray.origin = film.position;
+                        ray.direction = rayDirections[laneIndex];
+                        PixelAccumulator* pixelState = pixelStates + laneIndex;
+                        Vector3 sampleColor = RaytraceWorld(world, &ray, firstHits + laneIndex, samplers + laneIndex,
+                                                            workQueue, aovs, pixelIndices[laneIndex],
+                                                            &totalBounces, &totalPathRays);
+                        AddPixelSample(pixelState, sampleColor);
+                    }
+                }
+
+                for (uint32_t laneIndex = 0; laneIndex < LANE_WIDTH; ++laneIndex) {
+                    if (pixels[laneIndex]) {
+                        *pixels[laneIndex] = pixelStates[laneIndex];
+                        totalSamples += passSampleCount;
+                        activePixelCount += UpdatePixelConvergence(workQueue, pixels[laneIndex]);
+                    }
+                }
+            }
+        }
+
+        InterlockedAddAndReturnPrevious(&workQueue->finishedPixelCount, (rowGroupEndIndex - y) * (endColumnIndex - startColumnIndex));
+        y = rowGroupEndIndex;
+    }
+
+    InterlockedAddAndReturnPrevious(&workQueue->totalBouncesComputed, totalBounces);
+    InterlockedAddAndReturnPrevious(&workQueue->totalPathRaysComputed, totalPathRays);
+    InterlockedAddAndReturnPrevious(&workQueue->totalSamplesComputed, totalSamples);
+    InterlockedAddAndReturnPrevious(&workQueue->activePixelCount, activePixelCount);
+}
+
+// Works until every pixel of the image is finished.
+void RaytraceWork(WorkQueue* workQueue, bool reportProgress) {
+    uint32_t threadIndex = InterlockedAddAndReturnPrevious(&workQueue->registeredThreadCount, 1);
+    assert(threadIndex < workQueue->dequeCount);
+    WorkDeque* ownDeque = workQueue->deques + threadIndex;
+
+    // Waves never get wider than the widest tile. Split tiles are only shorter.
+    Wavefront wavefrontStorage;
+    Wavefront* wavefront = 0;
+    if (workQueue->traceWavefront) {
+        uint32_t maxTileWidth = 0;
+        for (uint32_t orderIndex = 0; orderIndex < workQueue->workOrderCount; ++orderIndex) {
+            WorkOrder* workOrder = workQueue->workOrders + orderIndex;
+            uint32_t tileWidth = workOrder->endColumnIndex - workOrder->startColumnIndex;
+            maxTileWidth = tileWidth > maxTileWidth ? tileWidth : maxTileWidth;
+        }
+        wavefront = &wavefrontStorage;
+        InitializeWavefront(wavefront, workQueue, WAVEFRONT_ROW_COUNT * maxTileWidth);
+    }
+
+    uint32_t randomState = Hash32(threadIndex + 1);
+    bool idle = false;
+    while (!workQueue->isOutOfTime && workQueue->finishedPixelCount < workQueue->totalPixelCount) {
+        uint64_t item;
+        bool foundWork = PopWork(ownDeque, &item);
+
+        // Start from a random victim, so thieves don't line up on the same deque.
+        uint32_t victimIndex = XOrShift32(&randomState) % workQueue->dequeCount;
+        for (uint32_t attempt = 0; !foundWork && attempt < workQueue->dequeCount; ++attempt) {
+            if (victimIndex != threadIndex) {
+                foundWork = StealWork(workQueue->deques + victimIndex, &item);
+            }
+            victimIndex = (victimIndex + 1) % workQueue->dequeCount;
+        }
+
+        if (!foundWork) {
+            if (!idle) {
+                InterlockedAddAndReturnPrevious(&workQueue->idleThreadCount, 1);
+                idle = true;
+            }
+            // Last tiles are still being rendered. Don't take the processor from them.
+            YieldThread();
+            continue;
+        }
+
+        if (idle) {
+            InterlockedAddAndReturnPrevious(&workQueue->idleThreadCount, (uint32_t) -1);
+            idle = false;
+        }
+
+        RenderTile(workQueue, ownDeque, UnpackWorkOrder(item), wavefront);
+
+        if (reportProgress) {
+            fprintf(stdout, "Raytracing %.0f%%...\r", 100 * ((float) workQueue->finishedPixelCount / workQueue->totalPixelCount));
+            fflush(stdout);
+        }
+    }
+
+    if (idle) {
+        InterlockedAddAndReturnPrevious(&workQueue->idleThreadCount, (uint32_t) -1);
+    }
+
+    if (wavefront) {
+        FreeWavefront(wavefront);
+    }
+}
+
+void BuildWorldBVH(World* world, BVHStats* stats) {
+    BVH* bvh = BuildBVH(world);
+    world->bvh = bvh;
+
+    stats->nodeCount = bvh->nodeCount;
+    stats->wideNodeCount = bvh->wideNodeCount;
+    stats->leafCount = bvh->leafCount;
+    stats->maxDepth = bvh->maxDepth;
+}
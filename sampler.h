@@ -0,0 +1,297 @@
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+#include "math_util.h"
+
+enum SamplerType {
+    SamplerType_Random,    // Xorshift stream of the pixel
+    SamplerType_Sobol,     // Owen scrambled Sobol, scrambled differently in every pixel
+    SamplerType_BlueNoise, // The same Owen scrambled Sobol in every pixel, shifted by a blue noise mask
+};
+
+// Dimensions of a sample are handed out in sets of up to four. Camera jitter takes the first set and every bounce
+// takes three more: light sampling, the BSDF and Russian roulette. So a dimension means the same thing in every
+// sample of a pixel, and dimensions of a set are stratified together.
+#define SAMPLE_SET_SIZE 4
+#define SAMPLE_SET_CAMERA 0
+#define SAMPLE_SETS_PER_BOUNCE 3
+
+inline uint32_t GetLightSampleSet(uint32_t bounceIndex) {
+    return 1 + SAMPLE_SETS_PER_BOUNCE * bounceIndex;
+}
+
+inline uint32_t GetBSDFSampleSet(uint32_t bounceIndex) {
+    return 2 + SAMPLE_SETS_PER_BOUNCE * bounceIndex;
+}
+
+inline uint32_t GetRouletteSampleSet(uint32_t bounceIndex) {
+    return 3 + SAMPLE_SETS_PER_BOUNCE * bounceIndex;
+}
+
+#define BLUE_NOISE_SIZE 64
+
+// Sampler of one pixel. Sobol samplers only depend on the pixel, the sample index and the set,
+// so samples don't depend on tiles, passes or the order paths are traced.
+struct Sampler {
+    SamplerType type;
+    // Pixel's sample count when the sample started.
+    uint32_t sampleIndex;
+    uint32_t scrambleSeed;
+    uint32_t pixelX;
+    uint32_t pixelY;
+    float* blueNoiseMask;
+    // Random sampler draws from the pixel's stream.
+    uint32_t* randomState;
+};
+
+// Direction numbers of the first four Sobol dimensions from Joe and Kuo. Sets only need four,
+// because every set is scrambled and shuffled with its own seed.
+static const uint32_t sobolDirections[SAMPLE_SET_SIZE][32] = {
+    {
+        0x80000000, 0x40000000, 0x20000000, 0x10000000, 0x08000000, 0x04000000, 0x02000000, 0x01000000,
+        0x00800000, 0x00400000, 0x00200000, 0x00100000, 0x00080000, 0x00040000, 0x00020000, 0x00010000,
+        0x00008000, 0x00004000, 0x00002000, 0x00001000, 0x00000800, 0x00000400, 0x00000200, 0x00000100,
+        0x00000080, 0x00000040, 0x00000020, 0x00000010, 0x00000008, 0x00000004, 0x00000002, 0x00000001,
+    },
+    {
+        0x80000000, 0xc0000000, 0xa0000000, 0xf0000000, 0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+        0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000, 0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+        0x80008000, 0xc000c000, 0xa000a000, 0xf000f000, 0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+        0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0, 0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff,
+    },
+    {
+        0x80000000, 0xc0000000, 0x60000000, 0x90000000, 0xe8000000, 0x5c000000, 0x8e000000, 0xc5000000,
+        0x68800000, 0x9cc00000, 0xee600000, 0x55900000, 0x80680000, 0xc09c0000, 0x60ee0000, 0x90550000,
+        0xe8808000, 0x5cc0c000, 0x8e606000, 0xc5909000, 0x6868e800, 0x9c9c5c00, 0xeeee8e00, 0x5555c500,
+        0x8000e880, 0xc0005cc0, 0x60008e60, 0x9000c590, 0xe8006868, 0x5c009c9c, 0x8e00eeee, 0xc5005555,
+    },
+    {
+        0x80000000, 0xc0000000, 0x20000000, 0x50000000, 0xf8000000, 0x74000000, 0xa2000000, 0x93000000,
+        0xd8800000, 0x25400000, 0x59e00000, 0xe6d00000, 0x78080000, 0xb40c0000, 0x82020000, 0xc3050000,
+        0x208f8000, 0x51474000, 0xfbea2000, 0x75d93000, 0xa0858800, 0x914e5400, 0xdbe79e00, 0x25db6d00,
+        0x58800080, 0xe54000c0, 0x79e00020, 0xb6d00050, 0x800800f8, 0xc00c0074, 0x200200a2, 0x50050093,
+    },
+};
+
+inline uint32_t ReverseBits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+    x = ((x >> 8) & 0x00FF00FF) | ((x & 0x00FF00FF) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Burley 2020, "Practical Hash-based Owen Scrambling". Laine-Karras hash works on reversed bits,
+// where it only lets lower bits affect higher ones. That's nested uniform scrambling in normal bit order.
+inline uint32_t LaineKarrasPermutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47c;
+    x ^= x * 0xb82f1e52;
+    x ^= x * 0xc7afe638;
+    x ^= x * 0x8d22f6e6;
+    return x;
+}
+
+inline uint32_t NestedUniformScramble(uint32_t x, uint32_t seed) {
+    return ReverseBits(LaineKarrasPermutation(ReverseBits(x), seed));
+}
+
+inline uint32_t HashCombine(uint32_t seed, uint32_t value) {
+    return seed ^ (Hash32(value) + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+// A Sobol point is the XOR of the direction numbers of the set index bits. So we XOR the precomputed points
+// of each index byte instead of going through the bits. Shuffled indices have high bits set too, so this is
+// four lookups instead of 32 steps. Points are kept bit reversed, the way the scramble wants them.
+// Filled by InitializeSobolTables.
+static uint32_t sobolByteTables[4][256][SAMPLE_SET_SIZE];
+
+static void InitializeSobolTables() {
+    for (uint32_t byteIndex = 0; byteIndex < 4; ++byteIndex) {
+        for (uint32_t value = 0; value < 256; ++value) {
+            for (uint32_t dimension = 0; dimension < SAMPLE_SET_SIZE; ++dimension) {
+                uint32_t result = 0;
+                for (uint32_t bit = 0; bit < 8; ++bit) {
+                    if (value & (1 << bit)) {
+                        result ^= sobolDirections[dimension][8 * byteIndex + bit];
+                    }
+                }
+                sobolByteTables[byteIndex][value][dimension] = ReverseBits(result);
+            }
+        }
+    }
+}
+
+// Every dimension of the Sobol point at index, bit reversed.
+inline void ReversedSobol(uint32_t index, uint32_t* values) {
+    uint32_t x = 0, y = 0, z = 0, w = 0;
+    for (uint32_t byteIndex = 0; byteIndex < 4; ++byteIndex) {
+        uint32_t* entry = sobolByteTables[byteIndex][(index >> (8 * byteIndex)) & 0xFF];
+        x ^= entry[0];
+        y ^= entry[1];
+        z ^= entry[2];
+        w ^= entry[3];
+    }
+    values[0] = x;
+    values[1] = y;
+    values[2] = z;
+    values[3] = w;
+}
+
+// Writes count numbers of the set in [0, 1) to values. Count is at most SAMPLE_SET_SIZE.
+inline void GetSamples(Sampler* sampler, uint32_t sampleSet, uint32_t count, float* values) {
+    if (sampler->type == SamplerType_Random) {
+        for (uint32_t dimension = 0; dimension < count; ++dimension) {
+            values[dimension] = RandomUnilateral(sampler->randomState);
+        }
+        return;
+    }
+
+    // Shuffling the index with a seed per set decorrelates the sets from each other.
+    uint32_t seed = HashCombine(sampler->scrambleSeed, sampleSet);
+    uint32_t index = NestedUniformScramble(sampler->sampleIndex, seed);
+    uint32_t sobol[SAMPLE_SET_SIZE];
+    ReversedSobol(index, sobol);
+    for (uint32_t dimension = 0; dimension < count; ++dimension) {
+        uint32_t bits = ReverseBits(LaineKarrasPermutation(sobol[dimension], HashCombine(seed, dimension)));
+        float value = (float) (bits >> 8) * (1.0f / 16777216.0f);
+
+        if (sampler->type == SamplerType_BlueNoise) {
+            // Every dimension reads the mask at another offset, so the shifts of different dimensions don't correlate.
+            uint32_t offset = Hash32(sampleSet * SAMPLE_SET_SIZE + dimension + 1);
+            uint32_t maskX = (sampler->pixelX + offset) % BLUE_NOISE_SIZE;
+            uint32_t maskY = (sampler->pixelY + (offset >> 16)) % BLUE_NOISE_SIZE;
+            value += sampler->blueNoiseMask[maskY * BLUE_NOISE_SIZE + maskX];
+            if (value >= 1.0f) {
+                value -= 1.0f;
+            }
+        }
+        values[dimension] = value;
+    }
+}
+
+// Toroidal blue noise mask with void and cluster. Ulichney 1993, "The void-and-cluster method for dither array generation"
+// Every pixel gets its rank in [0, 1). Takes a few tens of milliseconds.
+static float* CreateBlueNoiseMask() {
+    const uint32_t size = BLUE_NOISE_SIZE;
+    const uint32_t pixelCount = size * size;
+    const float sigma = 1.5f;
+
+    // Gaussian of toroidal distance from pixel 0. Energy of a pixel is the sum of this around every set pixel.
+    float* kernel = new float[pixelCount];
+    for (uint32_t y = 0; y < size; ++y) {
+        for (uint32_t x = 0; x < size; ++x) {
+            float dx = (float) (x < size / 2 ? x : size - x);
+            float dy = (float) (y < size / 2 ? y : size - y);
+            kernel[y * size + x] = expf(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+        }
+    }
+
+    uint8_t* pattern = new uint8_t[pixelCount];
+    float* energy = new float[pixelCount];
+    uint32_t* ranks = new uint32_t[pixelCount];
+    memset(pattern, 0, pixelCount);
+    memset(energy, 0, pixelCount * sizeof(float));
+
+    #define UPDATE_ENERGY(pixel, sign) { \
+        uint32_t px = (pixel) % size, py = (pixel) / size; \
+        for (uint32_t y = 0; y < size; ++y) { \
+            for (uint32_t x = 0; x < size; ++x) { \
+                energy[y * size + x] += (sign) * kernel[((y - py) % size) * size + ((x - px) % size)]; \
+            } \
+        } \
+    }
+
+    // Initial pattern is a tenth of the pixels at random. Moving the tightest cluster to the largest void
+    // until that doesn't change anything spreads them evenly.
+    uint32_t randomState = 0x1234567;
+    uint32_t initialCount = pixelCount / 10;
+    for (uint32_t setCount = 0; setCount < initialCount;) {
+        uint32_t pixel = XOrShift32(&randomState) % pixelCount;
+        if (!pattern[pixel]) {
+            pattern[pixel] = 1;
+            UPDATE_ENERGY(pixel, 1.0f);
+            ++setCount;
+        }
+    }
+
+    for (;;) {
+        uint32_t cluster = 0;
+        uint32_t voidPixel = 0;
+        float maxEnergy = -F32Max;
+        for (uint32_t pixel = 0; pixel < pixelCount; ++pixel) {
+            if (pattern[pixel] && energy[pixel] > maxEnergy) {
+                maxEnergy = energy[pixel];
+                cluster = pixel;
+            }
+        }
+        pattern[cluster] = 0;
+        UPDATE_ENERGY(cluster, -1.0f);
+
+        float minEnergy = F32Max;
+        for (uint32_t pixel = 0; pixel < pixelCount; ++pixel) {
+            if (!pattern[pixel] && energy[pixel] < minEnergy) {
+                minEnergy = energy[pixel];
+                voidPixel = pixel;
+            }
+        }
+        pattern[voidPixel] = 1;
+        UPDATE_ENERGY(voidPixel, 1.0f);
+        if (voidPixel == cluster) {
+            break;
+        }
+    }
+
+    // Ranks of the initial pattern go down as we take its tightest clusters away. Then the rest go up as we fill
+    // the largest voids. Past half the pixels, the largest void is the tightest cluster of unset pixels,
+    // because the energy of set and unset pixels adds up to the same everywhere.
+    uint8_t* initialPattern = new uint8_t[pixelCount];
+    float* initialEnergy = new float[pixelCount];
+    memcpy(initialPattern, pattern, pixelCount);
+    memcpy(initialEnergy, energy, pixelCount * sizeof(float));
+    for (uint32_t rank = initialCount; rank > 0; --rank) {
+        uint32_t cluster = 0;
+        float maxEnergy = -F32Max;
+        for (uint32_t pixel = 0; pixel < pixelCount; ++pixel) {
+            if (pattern[pixel] && energy[pixel] > maxEnergy) {
+                maxEnergy = energy[pixel];
+                cluster = pixel;
+            }
+        }
+        pattern[cluster] = 0;
+        UPDATE_ENERGY(cluster, -1.0f);
+        ranks[cluster] = rank - 1;
+    }
+
+    memcpy(pattern, initialPattern, pixelCount);
+    memcpy(energy, initialEnergy, pixelCount * sizeof(float));
+    for (uint32_t rank = initialCount; rank < pixelCount; ++rank) {
+        uint32_t voidPixel = 0;
+        float minEnergy = F32Max;
+        for (uint32_t pixel = 0; pixel < pixelCount; ++pixel) {
+            if (!pattern[pixel] && energy[pixel] < minEnergy) {
+                minEnergy = energy[pixel];
+                voidPixel = pixel;
+            }
+        }
+        pattern[voidPixel] = 1;
+        UPDATE_ENERGY(voidPixel, 1.0f);
+        ranks[voidPixel] = rank;
+    }
+    #undef UPDATE_ENERGY
+
+    float* mask = new float[pixelCount];
+    for (uint32_t pixel = 0; pixel < pixelCount; ++pixel) {
+        mask[pixel] = ((float) ranks[pixel] + 0.5f) / (float) pixelCount;
+    }
+
+    delete[] kernel;
+    delete[] pattern;
+    delete[] energy;
+    delete[] ranks;
+    delete[] initialPattern;
+    delete[] initialEnergy;
+    return mask;
+}
+
+#endif
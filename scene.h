@@ -2,7 +2,6 @@
 #define _SCENE_H_
 
 #include "math_util.h"
-#include "simd.h"
 
 #if defined(PLATFORM_WIN32) && defined(WIN32_GPU)
 #define ALIGN_GPU __declspec(align(16))
@@ -14,7 +13,9 @@ ALIGN_GPU struct Material {
     Vector3 color{ 0.0f, 0.0f, 0.0f };
     float refractiveIndex; // Refractive index of material. 0 means no refraction.
     Vector3 emitColor{ 0.0f, 0.0f, 0.0f };
-    float reflection; // 0 is pure diffuse, 1 is mirror.
+    float reflection; // 0 is pure diffuse, 1 is mirror. Dielectrics ignore it, they are always specular.
+    float roughness; // 0 is a perfect mirror. GGX alpha is roughness squared.
+    float metalness; // Blends the mirror tint from the flat color to Schlick's Fresnel with color as F0.
 };
 
 ALIGN_GPU struct Sphere {
@@ -23,12 +24,6 @@ ALIGN_GPU struct Sphere {
     uint32_t materialIndex;
 };
 
-struct SphereSoALane {
-    LaneVector3 position;
-    LaneF32 radiusSquared;
-    LaneF32 materialIndex;
-};
-
 ALIGN_GPU struct Plane {
     Vector3 normal;
     float d;
@@ -46,10 +41,13 @@ ALIGN_GPU struct RectangleXY {
     uint32_t materialIndex;
 };
 
-struct RectangleLane {
-    LaneMatrix4 transformMatrix;
-    LaneVector3 normal{ 0.0f, 0.0, 1.0f };
-    LaneF32 materialIndex;
+// Indexed triangle mesh. Every 3 consecutive indices make a triangle.
+struct Mesh {
+    uint32_t vertexCount;
+    Vector3* vertices;
+    uint32_t triangleCount;
+    uint32_t* indices;
+    uint32_t materialIndex;
 };
 
 static const Vector3 XAxis = Vector3(1.0f, 0.0f, 0.0f);
@@ -174,6 +172,17 @@ struct Camera {
     }
 };
 
+// Emissive rectangle that we sample directly for next event estimation.
+struct RectangleLight {
+    Vector3 corner;
+    Vector3 edgeU;
+    Vector3 edgeV;
+    Vector3 normal;
+    uint32_t materialIndex;
+    // Lights are picked proportional to their power. This is the running sum of pick probabilities.
+    float cumulativeProbability;
+};
+
 struct World {
     uint32_t materialCount;
     Material* materials;
@@ -181,15 +190,84 @@ struct World {
     Plane* planes;
     uint32_t sphereCount;
     Sphere* spheres;
-    uint32_t sphereSoAArrayCount;
-    SphereSoALane* sphereSoAArray;
     uint32_t rectangleCount;
     RectangleXY* rectangles;
-    uint32_t rectangleLaneArrayCount;
-    RectangleLane* rectangleLaneArray;
+    uint32_t meshCount;
+    Mesh* meshes;
     Camera* camera;
+    // Acceleration structure over spheres, rectangles and mesh triangles. Built by the SIMD backend's buildBVH
+    // after the scene is created. Its layout depends on the lane width, so only the backend knows its type.
+    void* bvh;
+
+    uint32_t lightCount;
+    RectangleLight* lights;
+    // Per material, pick probability of a light divided by its area, which is the area PDF of light sampling.
+    // Since lights are picked proportional to area * emission, it's the same for every light with the same material.
+    // That's how we can weight emission we hit by chance without knowing which light we hit.
+    // Zero for materials we don't sample directly.
+    float* lightAreaDensities;
 };
 
+// Builds the light list from emissive rectangles. Rectangle transforms must be inverted already.
+// Emissive materials that are also used by other primitives are left out. We can't sample those primitives,
+// so hits on them must not be weighted as if we could.
+static void CreateRectangleLights(World* world) {
+    bool* isSampleable = new bool[world->materialCount];
+    for (uint32_t materialIndex = 0; materialIndex < world->materialCount; ++materialIndex) {
+        isSampleable[materialIndex] = Luminance(world->materials[materialIndex].emitColor) > 0.0f;
+    }
+    for (uint32_t planeIndex = 0; planeIndex < world->planeCount; ++planeIndex) {
+        isSampleable[world->planes[planeIndex].materialIndex] = false;
+    }
+    for (uint32_t sphereIndex = 0; sphereIndex < world->sphereCount; ++sphereIndex) {
+        isSampleable[world->spheres[sphereIndex].materialIndex] = false;
+    }
+    for (uint32_t meshIndex = 0; meshIndex < world->meshCount; ++meshIndex) {
+        isSampleable[world->meshes[meshIndex].materialIndex] = false;
+    }
+
+    world->lightCount = 0;
+    world->lights = new RectangleLight[world->rectangleCount];
+    world->lightAreaDensities = new float[world->materialCount];
+    for (uint32_t materialIndex = 0; materialIndex < world->materialCount; ++materialIndex) {
+        world->lightAreaDensities[materialIndex] = 0.0f;
+    }
+
+    float totalPower = 0.0f;
+    for (uint32_t rectangleIndex = 0; rectangleIndex < world->rectangleCount; ++rectangleIndex) {
+        RectangleXY* rect = world->rectangles + rectangleIndex;
+        if (!isSampleable[rect->materialIndex]) {
+            continue;
+        }
+
+        // Rectangle is [-1, 1] on XY plane in its local space.
+        Matrix4 localToWorld = Inverse(rect->transformMatrix);
+        RectangleLight* light = world->lights + world->lightCount++;
+        light->corner = (localToWorld * Vector4(-1.0f, -1.0f, 0.0f, 1.0f)).xyz();
+        light->edgeU = (localToWorld * Vector4(2.0f, 0.0f, 0.0f, 0.0f)).xyz();
+        light->edgeV = (localToWorld * Vector4(0.0f, 2.0f, 0.0f, 0.0f)).xyz();
+        light->normal = CrossProduct(light->edgeU, light->edgeV);
+        float area = Lenght(light->normal);
+        light->normal = light->normal / area;
+        light->materialIndex = rect->materialIndex;
+
+        totalPower += area * Luminance(world->materials[rect->materialIndex].emitColor);
+        light->cumulativeProbability = totalPower;
+    }
+
+    for (uint32_t lightIndex = 0; lightIndex < world->lightCount; ++lightIndex) {
+        RectangleLight* light = world->lights + lightIndex;
+        light->cumulativeProbability /= totalPower;
+        world->lightAreaDensities[light->materialIndex] = Luminance(world->materials[light->materialIndex].emitColor) / totalPower;
+    }
+    // Float sums might not end up at exactly 1
+    if (world->lightCount > 0) {
+        world->lights[world->lightCount - 1].cumulativeProbability = 1.0f;
+    }
+
+    delete[] isSampleable;
+}
+
 World* createScene() {
     // Y is up.
     Vector3 globalUpVector = Vector3(0.0f, 1.0f, 0.0f);
@@ -252,39 +330,6 @@ World* createScene() {
     spheres[7] = sphere8;
 
 
-    // We use AoSoA layout for sphere data. fixed simd-lane size arrays of each member.
-    const uint32_t sphereSoAArrayCount = (sphereCount + LANE_WIDTH - 1) / LANE_WIDTH;
-    SphereSoALane* sphereSoAArray = new SphereSoALane[sphereSoAArrayCount];
-
-    for (int i = 0; i < sphereSoAArrayCount; ++i) {
-        ALIGN_LANE float spheresPositionX[LANE_WIDTH];
-        ALIGN_LANE float spheresPositionY[LANE_WIDTH];
-        ALIGN_LANE float spheresPositionZ[LANE_WIDTH];
-        ALIGN_LANE float spheresRadiusSquared[LANE_WIDTH];
-        ALIGN_LANE float spheresMaterialIndex[LANE_WIDTH];
-
-        uint32_t remainingSpheres = sphereCount - i * LANE_WIDTH;
-        uint32_t len = (remainingSpheres / LANE_WIDTH) > 0 ? LANE_WIDTH : remainingSpheres % LANE_WIDTH;
-        for (int j = 0; j < len; ++j) {
-            uint32_t sphereIndex = j + i * LANE_WIDTH;
-            Sphere s = spheres[sphereIndex];
-            spheresPositionX[j] = s.position.x;
-            spheresPositionY[j] = s.position.y;
-            spheresPositionZ[j] = s.position.z;
-            spheresRadiusSquared[j] = s.radius * s.radius;
-            spheresMaterialIndex[j] = s.materialIndex;
-        }
-
-        SphereSoALane sphereSoA = {};
-        sphereSoA.position = LaneVector3(LaneF32(spheresPositionX),
-            LaneF32(spheresPositionY),
-            LaneF32(spheresPositionZ));
-        sphereSoA.radiusSquared = LaneF32(spheresRadiusSquared);
-        sphereSoA.materialIndex = LaneF32(spheresMaterialIndex);
-
-        sphereSoAArray[i] = sphereSoA;
-    }
-
     Material defaultMaterial = {};
     //    defaultMaterial.emitColor = Vector3(0.1f, 0.2f, 0.4f);
 
@@ -300,7 +345,9 @@ World* createScene() {
 
     Material sphere3Material = {};
     sphere3Material.color = Vector3(0.8f, 0.6f, 0.2f);
-    sphere3Material.reflection = 0.9f;
+    sphere3Material.reflection = 1.0f;
+    sphere3Material.roughness = 0.3f;
+    sphere3Material.metalness = 1.0f;
 
     Material sphere4Material = {};
     sphere4Material.color = Vector3(1.0f, 1.0f, 1.0f) * 0.9f;
@@ -335,16 +382,38 @@ World* createScene() {
     world->planeCount = 1;
     world->planes = plane;
     world->sphereCount = sphereCount;
-    world->sphereSoAArrayCount = sphereSoAArrayCount;
-    world->sphereSoAArray = sphereSoAArray;
     world->spheres = spheres;
     world->rectangleCount = 0;
+    world->meshCount = 0;
     world->camera = camera;
+    world->bvh = 0;
+    CreateRectangleLights(world);
 
     return world;
 }
 
-World* CreateCornellBoxScene() {
+// Scales and moves mesh so its largest side is size long and its bottom center sits on position.
+static void PlaceMesh(Mesh* mesh, Vector3 position, float size) {
+    Vector3 minPoint = Vector3(F32Max, F32Max, F32Max);
+    Vector3 maxPoint = Vector3(-F32Max, -F32Max, -F32Max);
+    for (uint32_t vertexIndex = 0; vertexIndex < mesh->vertexCount; ++vertexIndex) {
+        minPoint = Min(minPoint, mesh->vertices[vertexIndex]);
+        maxPoint = Max(maxPoint, mesh->vertices[vertexIndex]);
+    }
+
+    Vector3 extent = maxPoint - minPoint;
+    float maxExtent = Max(Max(extent.x, extent.y), extent.z);
+    float scale = maxExtent > 0.0f ? size / maxExtent : 1.0f;
+    Vector3 bottomCenter = Vector3((minPoint.x + maxPoint.x) * 0.5f, minPoint.y, (minPoint.z + maxPoint.z) * 0.5f);
+
+    for (uint32_t vertexIndex = 0; vertexIndex < mesh->vertexCount; ++vertexIndex) {
+        Vector3* vertex = mesh->vertices + vertexIndex;
+        *vertex = (*vertex - bottomCenter) * scale + position;
+    }
+}
+
+// If a model is given, it replaces the boxes. Model is placed on the floor in the middle of the room.
+World* CreateCornellBoxScene(Mesh* model = 0) {
     Vector3 globalUpVector = Vector3(0.0f, 1.0f, 0.0f);
 
     Material defaultMaterial = {};
@@ -384,8 +453,8 @@ World* CreateCornellBoxScene() {
     Box box2 = CreateBox(Vector3(-2.0f, -4.0f, -8.0f), Vector3(2.0f, 4.0f, 2.0f), 1);
     RotateBox(&box2, Vector3(0.0f, 1.0f, 0.0f), 0.3f);
 
-    uint32_t rectangleCount = 18;
-    RectangleXY* rectangles = new RectangleXY[rectangleCount];
+    uint32_t rectangleCount = model ? 6 : 18;
+    RectangleXY* rectangles = new RectangleXY[18];
     rectangles[0] = lightRect;
     rectangles[1] = bottomRect;
     rectangles[2] = rightRect;
@@ -410,44 +479,15 @@ World* CreateCornellBoxScene() {
         rect->transformMatrix = Inverse(rect->transformMatrix);
     }
 
-    // We use AoSoA layout for rectangle data. fixed simd-lane size arrays of each member.
-    const uint32_t rectangleLaneArrayCount = (rectangleCount + LANE_WIDTH - 1) / LANE_WIDTH;
-    RectangleLane* rectangleLaneArray = new RectangleLane[rectangleLaneArrayCount];
-
-    for (int i = 0; i < rectangleLaneArrayCount; ++i) {
-        ALIGN_LANE float rectanglesTransformMatrixArray[4][4][LANE_WIDTH];
-        ALIGN_LANE float rectanglesNormal[3][LANE_WIDTH];
-        ALIGN_LANE float rectanglesMaterialIndex[LANE_WIDTH];
-
-        // Put scalar rectangle values into the arrays
-        uint32_t remainingRectangles = rectangleCount - i * LANE_WIDTH;
-        uint32_t len = (remainingRectangles / LANE_WIDTH) > 0 ? LANE_WIDTH : remainingRectangles % LANE_WIDTH;
-        for (int j = 0; j < len; ++j) {
-            uint32_t rectangleIndex = j + i * LANE_WIDTH;
-            RectangleXY* rect = rectangles + rectangleIndex;
-
-            for (uint32_t rowIndex = 0; rowIndex < 4; ++rowIndex) {
-                for (uint32_t columnIndex = 0; columnIndex < 4; ++columnIndex) {
-                    rectanglesTransformMatrixArray[rowIndex][columnIndex][j] = rect->transformMatrix[rowIndex][columnIndex];
-                }
-            }
-
-            rectanglesNormal[0][j] = rect->normal.x;
-            rectanglesNormal[1][j] = rect->normal.y;
-            rectanglesNormal[2][j] = rect->normal.z;
-            rectanglesMaterialIndex[j] = rect->materialIndex;
-        }
-
-        // Put those arrays into SIMD registers.
-        RectangleLane rectangleLane = {};
-        rectangleLane.transformMatrix = LaneMatrix4(rectanglesTransformMatrixArray);
-        rectangleLane.normal = LaneVector3(rectanglesNormal);
-        rectangleLane.materialIndex = LaneF32(rectanglesMaterialIndex);
-
-        rectangleLaneArray[i] = rectangleLane;
+    uint32_t meshCount = 0;
+    Mesh* meshes = 0;
+    if (model) {
+        meshCount = 1;
+        meshes = model;
+        model->materialIndex = 1;
+        PlaceMesh(model, Vector3(0.0f, -8.0f, -6.0f), 10.0f);
     }
 
-
     Camera* camera = new Camera(Vector3(0.0f, 1.0f, 20.0f));
 
     // I used raw pointers for scene objects. Freeing heap memory is callers responsibilty.
@@ -458,12 +498,13 @@ World* CreateCornellBoxScene() {
     world->materials = materials;
     world->planeCount = 0;
     world->sphereCount = 0;
-    world->sphereSoAArrayCount = 0;
     world->rectangleCount = rectangleCount;
     world->rectangles = rectangles;
-    world->rectangleLaneArrayCount = rectangleLaneArrayCount;
-    world->rectangleLaneArray = rectangleLaneArray;
+    world->meshCount = meshCount;
+    world->meshes = meshes;
     world->camera = camera;
+    world->bvh = 0;
+    CreateRectangleLights(world);
 
     return world;
 }
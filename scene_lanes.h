@@ -0,0 +1,191 @@
+// Lane packs of scene primitives. BVH leaves store primitives in these, so they are intersected a pack at a time.
+// Pack size is the lane width, so simd_backends.cpp includes this once per backend. No include guard on purpose.
+
+struct SphereSoALane {
+    LaneVector3 position;
+    LaneF32 radiusSquared;
+    LaneF32 materialIndex;
+};
+
+struct RectangleLane {
+    LaneMatrix4 transformMatrix;
+    LaneVector3 normal;
+    LaneF32 materialIndex;
+};
+
+// We store one vertex and two edges instead of three vertices. That's what Möller–Trumbore test uses directly,
+// so edges are computed once when packing instead of on every intersection.
+struct TriangleLane {
+    LaneVector3 vertex0;
+    LaneVector3 edge1;
+    LaneVector3 edge2;
+    LaneF32 materialIndex;
+};
+
+// Packs the given spheres into AoSoA lanes. fixed simd-lane size arrays of each member.
+// Unused lanes of the last pack get a negative squared radius, so they never pass the discriminant test.
+// Returns the number of lane packs written to dest.
+static uint32_t PackSphereLanes(SphereSoALane* dest, Sphere* spheres, uint32_t* sphereIndices, uint32_t sphereCount) {
+    const uint32_t laneCount = (sphereCount + LANE_WIDTH - 1) / LANE_WIDTH;
+    for (uint32_t i = 0; i < laneCount; ++i) {
+        ALIGN_LANE float spheresPositionX[LANE_WIDTH] = {};
+        ALIGN_LANE float spheresPositionY[LANE_WIDTH] = {};
+        ALIGN_LANE float spheresPositionZ[LANE_WIDTH] = {};
+        ALIGN_LANE float spheresRadiusSquared[LANE_WIDTH];
+        ALIGN_LANE float spheresMaterialIndex[LANE_WIDTH] = {};
+
+        for (uint32_t j = 0; j < LANE_WIDTH; ++j) {
+            spheresRadiusSquared[j] = -F32Max;
+        }
+
+        uint32_t remainingSpheres = sphereCount - i * LANE_WIDTH;
+        uint32_t len = remainingSpheres < LANE_WIDTH ? remainingSpheres : LANE_WIDTH;
+        for (uint32_t j = 0; j < len; ++j) {
+            Sphere s = spheres[sphereIndices[j + i * LANE_WIDTH]];
+            spheresPositionX[j] = s.position.x;
+            spheresPositionY[j] = s.position.y;
+            spheresPositionZ[j] = s.position.z;
+            spheresRadiusSquared[j] = s.radius * s.radius;
+            spheresMaterialIndex[j] = s.materialIndex;
+        }
+
+        SphereSoALane sphereSoA = {};
+        sphereSoA.position = LaneVector3(LaneF32(spheresPositionX),
+            LaneF32(spheresPositionY),
+            LaneF32(spheresPositionZ));
+        sphereSoA.radiusSquared = LaneF32(spheresRadiusSquared);
+        sphereSoA.materialIndex = LaneF32(spheresMaterialIndex);
+
+        dest[i] = sphereSoA;
+    }
+
+    return laneCount;
+}
+
+// Same AoSoA packing for rectangles. Rectangle transform matrices must be already inverted.
+// Unused lanes get a zero matrix. It makes local ray direction zero, so the hit distance becomes NaN and never passes the tests.
+static uint32_t PackRectangleLanes(RectangleLane* dest, RectangleXY* rectangles, uint32_t* rectangleIndices, uint32_t rectangleCount) {
+    const uint32_t laneCount = (rectangleCount + LANE_WIDTH - 1) / LANE_WIDTH;
+    for (uint32_t i = 0; i < laneCount; ++i) {
+        ALIGN_LANE float rectanglesTransformMatrixArray[4][4][LANE_WIDTH] = {};
+        ALIGN_LANE float rectanglesNormal[3][LANE_WIDTH] = {};
+        ALIGN_LANE float rectanglesMaterialIndex[LANE_WIDTH] = {};
+
+        // Put scalar rectangle values into the arrays
+        uint32_t remainingRectangles = rectangleCount - i * LANE_WIDTH;
+        uint32_t len = remainingRectangles < LANE_WIDTH ? remainingRectangles : LANE_WIDTH;
+        for (uint32_t j = 0; j < len; ++j) {
+            RectangleXY* rect = rectangles + rectangleIndices[j + i * LANE_WIDTH];
+
+            for (uint32_t rowIndex = 0; rowIndex < 4; ++rowIndex) {
+                for (uint32_t columnIndex = 0; columnIndex < 4; ++columnIndex) {
+                    rectanglesTransformMatrixArray[rowIndex][columnIndex][j] = rect->transformMatrix[rowIndex][columnIndex];
+                }
+            }
+
+            rectanglesNormal[0][j] = rect->normal.x;
+            rectanglesNormal[1][j] = rect->normal.y;
+            rectanglesNormal[2][j] = rect->normal.z;
+            rectanglesMaterialIndex[j] = rect->materialIndex;
+        }
+
+        // Put those arrays into SIMD registers.
+        RectangleLane rectangleLane = {};
+        rectangleLane.transformMatrix = LaneMatrix4(rectanglesTransformMatrixArray);
+        rectangleLane.normal = LaneVector3(rectanglesNormal);
+        rectangleLane.materialIndex = LaneF32(rectanglesMaterialIndex);
+
+        dest[i] = rectangleLane;
+    }
+
+    return laneCount;
+}
+
+// AoSoA packing for triangles. Triangles are addressed by mesh and triangle index pairs.
+// Unused lanes get zero edges. Determinant becomes zero and the barycentric tests fail on NaN.
+static uint32_t PackTriangleLanes(TriangleLane* dest, Mesh* meshes, uint32_t* meshIndices, uint32_t* triangleIndices, uint32_t triangleCount) {
+    const uint32_t laneCount = (triangleCount + LANE_WIDTH - 1) / LANE_WIDTH;
+    for (uint32_t i = 0; i < laneCount; ++i) {
+        ALIGN_LANE float trianglesVertex0[3][LANE_WIDTH] = {};
+        ALIGN_LANE float trianglesEdge1[3][LANE_WIDTH] = {};
+        ALIGN_LANE float trianglesEdge2[3][LANE_WIDTH] = {};
+        ALIGN_LANE float trianglesMaterialIndex[LANE_WIDTH] = {};
+
+        uint32_t remainingTriangles = triangleCount - i * LANE_WIDTH;
+        uint32_t len = remainingTriangles < LANE_WIDTH ? remainingTriangles : LANE_WIDTH;
+        for (uint32_t j = 0; j < len; ++j) {
+            Mesh* mesh = meshes + meshIndices[j + i * LANE_WIDTH];
+            uint32_t* indices = mesh->indices + 3 * triangleIndices[j + i * LANE_WIDTH];
+            Vector3 vertex0 = mesh->vertices[indices[0]];
+            Vector3 edge1 = mesh->vertices[indices[1]] - vertex0;
+            Vector3 edge2 = mesh->vertices[indices[2]] - vertex0;
+
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                trianglesVertex0[axis][j] = vertex0[axis];
+                trianglesEdge1[axis][j] = edge1[axis];
+                trianglesEdge2[axis][j] = edge2[axis];
+            }
+            trianglesMaterialIndex[j] = mesh->materialIndex;
+        }
+
+        TriangleLane triangleLane = {};
+        triangleLane.vertex0 = LaneVector3(trianglesVertex0);
+        triangleLane.edge1 = LaneVector3(trianglesEdge1);
+        triangleLane.edge2 = LaneVector3(trianglesEdge2);
+        triangleLane.materialIndex = LaneF32(trianglesMaterialIndex);
+
+        dest[i] = triangleLane;
+    }
+
+    return laneCount;
+}
+
+// Copies primitive laneIndex of a pack into every lane of dest. Packs are made of LaneF32 members only,
+// so this works for any of them with memberCount = sizeof(pack) / sizeof(LaneF32).
+// Packet tracing tests one primitive against a lane of rays this way, with the same intersection functions as single rays.
+inline void BroadcastPrimitive(void* dest, void* pack, uint32_t memberCount, uint32_t laneIndex) {
+    LaneF32* destLanes = (LaneF32*) dest;
+    LaneF32* packLanes = (LaneF32*) pack;
+    for (uint32_t memberIndex = 0; memberIndex < memberCount; ++memberIndex) {
+        destLanes[memberIndex] = LaneF32(GetLane(packLanes[memberIndex], laneIndex));
+    }
+}
+
+// Material fields of a lane of hits, for shading a batch of paths together.
+struct MaterialLane {
+    LaneVector3 color;
+    LaneVector3 emitColor;
+    LaneF32 reflection;
+    LaneF32 refractiveIndex;
+    LaneF32 roughness;
+    LaneF32 metalness;
+    LaneF32 lightAreaDensity;
+};
+
+// SSE4 has no gather instructions, so every backend gathers through the stack.
+inline MaterialLane GatherMaterialLane(World* world, uint32_t* materialIndices) {
+    ALIGN_LANE float fields[11][LANE_WIDTH];
+    for (uint32_t laneIndex = 0; laneIndex < LANE_WIDTH; ++laneIndex) {
+        uint32_t materialIndex = materialIndices[laneIndex];
+        Material* material = world->materials + materialIndex;
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            fields[axis][laneIndex] = material->color[axis];
+            fields[3 + axis][laneIndex] = material->emitColor[axis];
+        }
+        fields[6][laneIndex] = material->reflection;
+        fields[7][laneIndex] = material->refractiveIndex;
+        fields[8][laneIndex] = material->roughness;
+        fields[9][laneIndex] = material->metalness;
+        fields[10][laneIndex] = world->lightAreaDensities[materialIndex];
+    }
+
+    MaterialLane result;
+    result.color = LaneVector3(fields);
+    result.emitColor = LaneVector3(fields + 3);
+    result.reflection = LaneF32(fields[6]);
+    result.refractiveIndex = LaneF32(fields[7]);
+    result.roughness = LaneF32(fields[8]);
+    result.metalness = LaneF32(fields[9]);
+    result.lightAreaDensity = LaneF32(fields[10]);
+    return result;
+}
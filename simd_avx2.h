@@ -1,17 +1,30 @@
 #ifndef _SIMD_AVX2_H_
 #define _SIMD_AVX2_H_
 
+// 8-wide lanes. Backend is only picked when the CPU has FMA too, so we use it unconditionally.
+
 struct LaneF32 {
     __m256 m;
 
-    LaneF32();
+    // Default constructor and copy are trivial, so compiler generated constructors of structs with lane members
+    // don't call anything. Those are compiled without the backend's target pragma and couldn't inline our calls.
+    LaneF32() = default;
     LaneF32(float value);
     LaneF32(const float* value);
-    LaneF32(const LaneF32& copy);
 };
 
-inline LaneF32::LaneF32() {
+// Result of a lane comparison. Lanes are all ones or all zeros, like blendv expects.
+struct LaneMask {
+    __m256 m;
+};
 
+// Integer lanes. Only what random number generation needs.
+struct LaneU32 {
+    __m256i m;
+
+    LaneU32() = default;
+    LaneU32(uint32_t value);
+    LaneU32(const uint32_t* value);
 };
 
 inline LaneF32::LaneF32(float value) {
@@ -22,10 +35,6 @@ inline LaneF32::LaneF32(const float* value) {
     this->m = _mm256_load_ps(value);
 };
 
-inline LaneF32::LaneF32(const LaneF32& copy) {
-    this->m = copy.m;
-};
-
 inline LaneF32 operator-(const LaneF32 left, const LaneF32 right) {
     LaneF32 result;
     result.m = _mm256_sub_ps(left.m, right.m);
@@ -54,34 +63,48 @@ inline LaneF32 operator/(const LaneF32 left, const LaneF32 right) {
     return result;
 };
 
-inline LaneF32 operator>(const LaneF32 left, const LaneF32 right) {
-    LaneF32 result;
+inline LaneMask operator>(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
     result.m = _mm256_cmp_ps(left.m, right.m, _CMP_GT_OQ);
 
     return result;
 };
 
-inline LaneF32 operator<(const LaneF32 left, const LaneF32 right) {
-    LaneF32 result;
+inline LaneMask operator<(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
     result.m = _mm256_cmp_ps(left.m, right.m, _CMP_LT_OQ);
 
     return result;
 };
 
-inline LaneF32 operator<=(const LaneF32 left, const LaneF32 right) {
-    LaneF32 result;
+inline LaneMask operator<=(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
     result.m = _mm256_cmp_ps(left.m, right.m, _CMP_LE_OQ);
 
     return result;
 }
 
-inline LaneF32 operator>=(const LaneF32 left, const LaneF32 right) {
-    LaneF32 result;
+inline LaneMask operator>=(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
     result.m = _mm256_cmp_ps(left.m, right.m, _CMP_GE_OQ);
 
     return result;
 }
 
+inline LaneMask operator==(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
+    result.m = _mm256_cmp_ps(left.m, right.m, _CMP_EQ_OQ);
+
+    return result;
+}
+
+inline LaneMask operator!=(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
+    result.m = _mm256_cmp_ps(left.m, right.m, _CMP_NEQ_UQ);
+
+    return result;
+}
+
 inline LaneF32 operator|(const LaneF32 left, const LaneF32 right) {
     LaneF32 result;
     result.m = _mm256_or_ps(left.m, right.m);
@@ -96,6 +119,20 @@ inline LaneF32 operator&(const LaneF32 left, const LaneF32 right) {
     return result;
 };
 
+inline LaneMask operator|(const LaneMask left, const LaneMask right) {
+    LaneMask result;
+    result.m = _mm256_or_ps(left.m, right.m);
+
+    return result;
+};
+
+inline LaneMask operator&(const LaneMask left, const LaneMask right) {
+    LaneMask result;
+    result.m = _mm256_and_ps(left.m, right.m);
+
+    return result;
+};
+
 inline LaneF32 operator-(const LaneF32 value) {
     LaneF32 result;
     result.m = _mm256_xor_ps(value.m, _mm256_set1_ps(-0.0f));
@@ -105,22 +142,14 @@ inline LaneF32 operator-(const LaneF32 value) {
 
 inline LaneF32 FMulAdd(const LaneF32 left, const LaneF32 right, const LaneF32 addend) {
     LaneF32 result;
-#ifdef __FMA__
     result.m = _mm256_fmadd_ps(left.m, right.m, addend.m);
-#else
-    result = (left * right) + addend;
-#endif
 
     return result;
 };
 
 inline LaneF32 FMulSub(const LaneF32 left, const LaneF32 right, const LaneF32 sub) {
     LaneF32 result;
-#ifdef __FMA__
     result.m = _mm256_fmsub_ps(left.m, right.m, sub.m);
-#else
-    result = (left * right) - sub;
-#endif
 
     return result;
 };
@@ -129,6 +158,14 @@ inline void StoreLane(float* dest, LaneF32 lane) {
     _mm256_store_ps(dest, lane.m);
 };
 
+// LaneF32(const float*) needs aligned memory, this doesn't.
+inline LaneF32 LoadUnaligned(const float* value) {
+    LaneF32 result;
+    result.m = _mm256_loadu_ps(value);
+
+    return result;
+};
+
 inline LaneF32 SquareRoot(LaneF32 value) {
     LaneF32 result;
     result.m = _mm256_sqrt_ps(value.m);
@@ -143,14 +180,102 @@ inline LaneF32 RSquareRoot(LaneF32 value) {
     return result;
 };
 
-inline bool MaskIsZeroed(LaneF32 mask) {
+inline LaneF32 Min(const LaneF32 left, const LaneF32 right) {
+    LaneF32 result;
+    result.m = _mm256_min_ps(left.m, right.m);
+
+    return result;
+};
+
+inline LaneF32 Max(const LaneF32 left, const LaneF32 right) {
+    LaneF32 result;
+    result.m = _mm256_max_ps(left.m, right.m);
+
+    return result;
+};
+
+// Returns one bit per lane. Bit i is set if lane i of the mask is set.
+inline uint32_t GetMaskBits(LaneMask mask) {
+    return _mm256_movemask_ps(mask.m);
+};
+
+inline bool MaskIsZeroed(LaneMask mask) {
     bool result = _mm256_movemask_ps(mask.m) == 0;
 
     return result;
 };
 
-inline void Select(LaneF32* dest, LaneF32 mask, LaneF32 right) {
+inline void Select(LaneF32* dest, LaneMask mask, LaneF32 right) {
     dest->m = _mm256_blendv_ps(dest->m, right.m, mask.m);
 };
 
+inline LaneU32::LaneU32(uint32_t value) {
+    this->m = _mm256_set1_epi32((int32_t) value);
+};
+
+inline LaneU32::LaneU32(const uint32_t* value) {
+    this->m = _mm256_load_si256((const __m256i*) value);
+};
+
+inline LaneU32 operator^(const LaneU32 left, const LaneU32 right) {
+    LaneU32 result;
+    result.m = _mm256_xor_si256(left.m, right.m);
+
+    return result;
+};
+
+inline LaneU32 operator|(const LaneU32 left, const LaneU32 right) {
+    LaneU32 result;
+    result.m = _mm256_or_si256(left.m, right.m);
+
+    return result;
+};
+
+inline LaneU32 operator<<(const LaneU32 value, const uint32_t shift) {
+    LaneU32 result;
+    result.m = _mm256_slli_epi32(value.m, shift);
+
+    return result;
+};
+
+// Logical shift, zeros come in from the top.
+inline LaneU32 operator>>(const LaneU32 value, const uint32_t shift) {
+    LaneU32 result;
+    result.m = _mm256_srli_epi32(value.m, shift);
+
+    return result;
+};
+
+inline void StoreLane(uint32_t* dest, LaneU32 lane) {
+    _mm256_store_si256((__m256i*) dest, lane.m);
+};
+
+// Same bits read as floats.
+inline LaneF32 CastToF32(LaneU32 value) {
+    LaneF32 result;
+    result.m = _mm256_castsi256_ps(value.m);
+
+    return result;
+};
+
+inline void Select(LaneU32* dest, LaneMask mask, LaneU32 right) {
+    dest->m = _mm256_blendv_epi8(dest->m, right.m, _mm256_castps_si256(mask.m));
+};
+
+inline float HorizontalMin(LaneF32 value) {
+    __m256 m = _mm256_min_ps(value.m, _mm256_permute2f128_ps(value.m, value.m, 1));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm256_cvtss_f32(m);
+};
+
+inline float HorizontalMax(LaneF32 value) {
+    __m256 m = _mm256_max_ps(value.m, _mm256_permute2f128_ps(value.m, value.m, 1));
+    m = _mm256_max_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm256_max_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm256_cvtss_f32(m);
+};
+
 #endif
\ No newline at end of file
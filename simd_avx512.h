@@ -0,0 +1,275 @@
+#ifndef _SIMD_AVX512_H_
+#define _SIMD_AVX512_H_
+
+// 16-wide lanes. Only needs AVX-512F, which has FMA.
+// Comparisons write opmask registers, so masks are 16-bit integers and Select is a masked blend.
+// Float bitwise ops are AVX-512DQ, so we go through integer ops instead.
+
+struct LaneF32 {
+    __m512 m;
+
+    // Default constructor and copy are trivial, so compiler generated constructors of structs with lane members
+    // don't call anything. Those are compiled without the backend's target pragma and couldn't inline our calls.
+    LaneF32() = default;
+    LaneF32(float value);
+    LaneF32(const float* value);
+};
+
+// Result of a lane comparison. Bit i is set if lane i is set.
+struct LaneMask {
+    __mmask16 m;
+};
+
+// Integer lanes. Only what random number generation needs.
+struct LaneU32 {
+    __m512i m;
+
+    LaneU32() = default;
+    LaneU32(uint32_t value);
+    LaneU32(const uint32_t* value);
+};
+
+inline LaneF32::LaneF32(float value) {
+    this->m = _mm512_set1_ps(value);
+};
+
+inline LaneF32::LaneF32(const float* value) {
+    this->m = _mm512_load_ps(value);
+};
+
+inline LaneF32 operator-(const LaneF32 left, const LaneF32 right) {
+    LaneF32 result;
+    result.m = _mm512_sub_ps(left.m, right.m);
+
+    return result;
+};
+
+inline LaneF32 operator+(const LaneF32 left, const LaneF32 right) {
+    LaneF32 result;
+    result.m = _mm512_add_ps(left.m, right.m);
+
+    return result;
+};
+
+inline LaneF32 operator*(const LaneF32 left, const LaneF32 right) {
+    LaneF32 result;
+    result.m = _mm512_mul_ps(left.m, right.m);
+
+    return result;
+};
+
+inline LaneF32 operator/(const LaneF32 left, const LaneF32 right) {
+    LaneF32 result;
+    result.m = _mm512_div_ps(left.m, right.m);
+
+    return result;
+};
+
+inline LaneMask operator>(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
+    result.m = _mm512_cmp_ps_mask(left.m, right.m, _CMP_GT_OQ);
+
+    return result;
+};
+
+inline LaneMask operator<(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
+    result.m = _mm512_cmp_ps_mask(left.m, right.m, _CMP_LT_OQ);
+
+    return result;
+};
+
+inline LaneMask operator<=(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
+    result.m = _mm512_cmp_ps_mask(left.m, right.m, _CMP_LE_OQ);
+
+    return result;
+}
+
+inline LaneMask operator>=(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
+    result.m = _mm512_cmp_ps_mask(left.m, right.m, _CMP_GE_OQ);
+
+    return result;
+}
+
+inline LaneMask operator==(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
+    result.m = _mm512_cmp_ps_mask(left.m, right.m, _CMP_EQ_OQ);
+
+    return result;
+}
+
+inline LaneMask operator!=(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
+    result.m = _mm512_cmp_ps_mask(left.m, right.m, _CMP_NEQ_UQ);
+
+    return result;
+}
+
+inline LaneF32 operator|(const LaneF32 left, const LaneF32 right) {
+    LaneF32 result;
+    result.m = _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(left.m), _mm512_castps_si512(right.m)));
+
+    return result;
+};
+
+inline LaneF32 operator&(const LaneF32 left, const LaneF32 right) {
+    LaneF32 result;
+    result.m = _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(left.m), _mm512_castps_si512(right.m)));
+
+    return result;
+};
+
+inline LaneMask operator|(const LaneMask left, const LaneMask right) {
+    LaneMask result;
+    result.m = left.m | right.m;
+
+    return result;
+};
+
+inline LaneMask operator&(const LaneMask left, const LaneMask right) {
+    LaneMask result;
+    result.m = left.m & right.m;
+
+    return result;
+};
+
+inline LaneF32 operator-(const LaneF32 value) {
+    LaneF32 result;
+    result.m = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(value.m), _mm512_set1_epi32(0x80000000)));
+
+    return result;
+};
+
+inline LaneF32 FMulAdd(const LaneF32 left, const LaneF32 right, const LaneF32 addend) {
+    LaneF32 result;
+    result.m = _mm512_fmadd_ps(left.m, right.m, addend.m);
+
+    return result;
+};
+
+inline LaneF32 FMulSub(const LaneF32 left, const LaneF32 right, const LaneF32 sub) {
+    LaneF32 result;
+    result.m = _mm512_fmsub_ps(left.m, right.m, sub.m);
+
+    return result;
+};
+
+inline void StoreLane(float* dest, LaneF32 lane) {
+    _mm512_store_ps(dest, lane.m);
+};
+
+// LaneF32(const float*) needs aligned memory, this doesn't.
+inline LaneF32 LoadUnaligned(const float* value) {
+    LaneF32 result;
+    result.m = _mm512_loadu_ps(value);
+
+    return result;
+};
+
+inline LaneF32 SquareRoot(LaneF32 value) {
+    LaneF32 result;
+    result.m = _mm512_sqrt_ps(value.m);
+
+    return result;
+};
+
+inline LaneF32 RSquareRoot(LaneF32 value) {
+    LaneF32 result;
+    result.m = _mm512_rsqrt14_ps(value.m);
+
+    return result;
+};
+
+inline LaneF32 Min(const LaneF32 left, const LaneF32 right) {
+    LaneF32 result;
+    result.m = _mm512_min_ps(left.m, right.m);
+
+    return result;
+};
+
+inline LaneF32 Max(const LaneF32 left, const LaneF32 right) {
+    LaneF32 result;
+    result.m = _mm512_max_ps(left.m, right.m);
+
+    return result;
+};
+
+// Returns one bit per lane. Bit i is set if lane i of the mask is set.
+inline uint32_t GetMaskBits(LaneMask mask) {
+    return mask.m;
+};
+
+inline bool MaskIsZeroed(LaneMask mask) {
+    bool result = mask.m == 0;
+
+    return result;
+};
+
+inline void Select(LaneF32* dest, LaneMask mask, LaneF32 right) {
+    dest->m = _mm512_mask_blend_ps(mask.m, dest->m, right.m);
+};
+
+inline LaneU32::LaneU32(uint32_t value) {
+    this->m = _mm512_set1_epi32((int32_t) value);
+};
+
+inline LaneU32::LaneU32(const uint32_t* value) {
+    this->m = _mm512_load_si512((const void*) value);
+};
+
+inline LaneU32 operator^(const LaneU32 left, const LaneU32 right) {
+    LaneU32 result;
+    result.m = _mm512_xor_si512(left.m, right.m);
+
+    return result;
+};
+
+inline LaneU32 operator|(const LaneU32 left, const LaneU32 right) {
+    LaneU32 result;
+    result.m = _mm512_or_si512(left.m, right.m);
+
+    return result;
+};
+
+inline LaneU32 operator<<(const LaneU32 value, const uint32_t shift) {
+    LaneU32 result;
+    result.m = _mm512_slli_epi32(value.m, shift);
+
+    return result;
+};
+
+// Logical shift, zeros come in from the top.
+inline LaneU32 operator>>(const LaneU32 value, const uint32_t shift) {
+    LaneU32 result;
+    result.m = _mm512_srli_epi32(value.m, shift);
+
+    return result;
+};
+
+inline void StoreLane(uint32_t* dest, LaneU32 lane) {
+    _mm512_store_si512((void*) dest, lane.m);
+};
+
+// Same bits read as floats.
+inline LaneF32 CastToF32(LaneU32 value) {
+    LaneF32 result;
+    result.m = _mm512_castsi512_ps(value.m);
+
+    return result;
+};
+
+inline void Select(LaneU32* dest, LaneMask mask, LaneU32 right) {
+    dest->m = _mm512_mask_blend_epi32(mask.m, dest->m, right.m);
+};
+
+inline float HorizontalMin(LaneF32 value) {
+    return _mm512_reduce_min_ps(value.m);
+};
+
+inline float HorizontalMax(LaneF32 value) {
+    return _mm512_reduce_max_ps(value.m);
+};
+
+#endif
@@ -0,0 +1,127 @@
+#include "render.h"
+
+// Everything that depends on the lane width (lane types, primitive packs, BVH and the render loop) is compiled
+// once per instruction set, each in its own namespace. The rest of the program is compiled for baseline x86-64,
+// so one binary runs everywhere, and we pick the widest backend the CPU supports at startup.
+// GCC and Clang need target pragmas to use instructions that command line doesn't enable. MSVC emits any intrinsic.
+// Scalar inline functions from shared headers can still be inlined into backend code.
+
+#define LANE_WIDTH 4
+#define LANE_ALIGNMENT 16
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("sse4.1"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+#endif
+namespace SSE4 {
+#include "simd_sse.h"
+#include "simd_lane.h"
+#include "scene_lanes.h"
+#include "bsdf_lanes.h"
+#include "bvh.cpp"
+#include "render_kernels.cpp"
+#include "denoise.cpp"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+#undef LANE_WIDTH
+#undef LANE_ALIGNMENT
+
+#define LANE_WIDTH 8
+#define LANE_ALIGNMENT 32
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+namespace AVX2 {
+#include "simd_avx2.h"
+#include "simd_lane.h"
+#include "scene_lanes.h"
+#include "bsdf_lanes.h"
+#include "bvh.cpp"
+#include "render_kernels.cpp"
+#include "denoise.cpp"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+#undef LANE_WIDTH
+#undef LANE_ALIGNMENT
+
+#define LANE_WIDTH 16
+#define LANE_ALIGNMENT 64
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+// GCC 12 warns about _mm512_undefined_ps inside its own intrinsics. Fixed in 12.3.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+namespace AVX512 {
+#include "simd_avx512.h"
+#include "simd_lane.h"
+#include "scene_lanes.h"
+#include "bsdf_lanes.h"
+#include "bvh.cpp"
+#include "render_kernels.cpp"
+#include "denoise.cpp"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+#endif
+#undef LANE_WIDTH
+#undef LANE_ALIGNMENT
+
+// Narrowest first.
+static SIMDBackend simdBackends[] = {
+    { "sse4", 4, CPUFeature_SSE41, SSE4::BuildWorldBVH, SSE4::RaytraceWork, SSE4::DenoiseRows },
+    { "avx2", 8, CPUFeature_AVX2, AVX2::BuildWorldBVH, AVX2::RaytraceWork, AVX2::DenoiseRows },
+    { "avx512", 16, CPUFeature_AVX512, AVX512::BuildWorldBVH, AVX512::RaytraceWork, AVX512::DenoiseRows },
+};
+
+// Returns the backend with the given name, or the widest one the CPU supports if name is null.
+// Returns 0 and prints the reason if there is no such backend or the CPU can't run it.
+static SIMDBackend* SelectSIMDBackend(const char* name) {
+    uint32_t cpuFeatures = GetCPUFeatures();
+    uint32_t backendCount = sizeof(simdBackends) / sizeof(simdBackends[0]);
+    for (uint32_t backendIndex = backendCount; backendIndex > 0; --backendIndex) {
+        SIMDBackend* backend = simdBackends + (backendIndex - 1);
+        if (name && strcmp(name, backend->name) != 0) {
+            continue;
+        }
+
+        if ((cpuFeatures & backend->requiredCPUFeatures) != backend->requiredCPUFeatures) {
+            if (name) {
+                fprintf(stderr, "This CPU doesn't support %s\n", name);
+                return 0;
+            }
+            continue;
+        }
+
+        return backend;
+    }
+
+    if (name) {
+        fprintf(stderr, "Unknown SIMD backend %s. Available backends are:", name);
+        for (uint32_t backendIndex = 0; backendIndex < backendCount; ++backendIndex) {
+            fprintf(stderr, " %s", simdBackends[backendIndex].name);
+        }
+        fprintf(stderr, "\n");
+    } else {
+        fprintf(stderr, "This CPU doesn't support SSE4.1\n");
+    }
+    return 0;
+}
@@ -0,0 +1,414 @@
+// Vector and matrix types made of lanes. LaneF32 comes from the backend's simd_*.h file,
+// so simd_backends.cpp includes this once per backend inside the backend's namespace. No include guard on purpose.
+
+// Lane overloads in the backend namespace hide the global scalar ones. Arguments of our own types
+// find them anyway by argument dependent lookup, but plain floats don't.
+using ::Min;
+using ::Max;
+using ::Clamp;
+using ::Lerp;
+using ::Refract;
+using ::Schlick;
+using ::OrthonormalBasis;
+using ::SampleCosineHemisphere;
+using ::PowerHeuristic;
+using ::XOrShift32;
+using ::RandomUnilateral;
+using ::RandomBilateral;
+
+// Lane values are plain float arrays in memory.
+inline float GetLane(LaneF32 value, uint32_t laneIndex) {
+    return ((float*) &value)[laneIndex];
+}
+
+// Every lane is its own stream, the same numbers the scalar functions give for that lane's state.
+inline LaneU32 XOrShift32(LaneU32* state) {
+    LaneU32 x = *state;
+    x = x ^ (x << 13);
+    x = x ^ (x >> 17);
+    x = x ^ (x << 5);
+    *state = x;
+    return x;
+}
+
+inline LaneF32 RandomUnilateral(LaneU32* state) {
+    LaneU32 bits = (XOrShift32(state) >> 9) | LaneU32(0x3F800000);
+    return CastToF32(bits) - LaneF32(1.0f);
+}
+
+inline LaneF32 RandomBilateral(LaneU32* state) {
+    return FMulSub(LaneF32(2.0f), RandomUnilateral(state), LaneF32(1.0f));
+}
+
+// Wide vector3 struct
+struct LaneVector3 {
+    LaneF32 x;
+    LaneF32 y;
+    LaneF32 z;
+
+    LaneVector3() = default;
+    LaneVector3(LaneF32 x, LaneF32 y, LaneF32 z);
+    LaneVector3(float arr[3][LANE_WIDTH]);
+    LaneVector3(Vector3 vector);
+
+    LaneF32& operator[](int index);
+};
+
+inline LaneVector3::LaneVector3(LaneF32 x, LaneF32 y, LaneF32 z) {
+    this->x = x;
+    this->y = y;
+    this->z = z;
+};
+
+inline LaneVector3::LaneVector3(float arr[3][LANE_WIDTH]) {
+    this->x = LaneF32(arr[0]);
+    this->y = LaneF32(arr[1]);
+    this->z = LaneF32(arr[2]);
+}
+
+inline LaneVector3::LaneVector3(Vector3 vector) {
+    this->x = LaneF32(vector.x);
+    this->y = LaneF32(vector.y);
+    this->z = LaneF32(vector.z);
+};
+
+inline LaneF32& LaneVector3::operator[](int index) {
+    return (&x)[index];
+};
+
+inline LaneVector3 operator-(const LaneVector3 v) {
+    LaneVector3 result;
+    result.x = -v.x;
+    result.y = -v.y;
+    result.z = -v.z;
+
+    return result;
+};
+
+inline LaneVector3 operator+(const LaneVector3 left, const LaneVector3 right) {
+    return LaneVector3(left.x + right.x, left.y + right.y, left.z + right.z);
+};
+
+inline LaneVector3 operator-(const LaneVector3 left, const LaneVector3 right) {
+    return LaneVector3(left.x - right.x, left.y - right.y, left.z - right.z);
+};
+
+inline LaneVector3 operator*(const LaneVector3 left, const LaneF32 right) {
+    return LaneVector3(left.x * right, left.y * right, left.z * right);
+};
+
+inline LaneVector3 operator*(const LaneVector3 left, const LaneVector3 right) {
+    return LaneVector3(left.x * right.x, left.y * right.y, left.z * right.z);
+};
+
+inline LaneF32 DotProduct(const LaneVector3 left, const LaneVector3 right) {
+    return FMulAdd(left.x, right.x, FMulAdd(left.y, right.y, (left.z * right.z)));
+};
+
+inline LaneVector3 CrossProduct(const LaneVector3 left, const LaneVector3 right) {
+    return LaneVector3(FMulSub(left.y, right.z, left.z * right.y),
+                       FMulSub(left.z, right.x, left.x * right.z),
+                       FMulSub(left.x, right.y, left.y * right.x));
+};
+
+inline LaneVector3 Normalize(const LaneVector3 v) {
+  const LaneF32 dot = DotProduct(v, v);
+  const LaneF32 factor = RSquareRoot(dot);
+  return LaneVector3(v.x * factor, v.y * factor, v.z * factor);
+};
+
+// Normalize above uses the approximate reciprocal square root, which is fine for hit normals.
+// Directions we keep tracing and weighting by cosines use this one.
+inline LaneVector3 NormalizeExact(const LaneVector3 v) {
+    const LaneF32 factor = LaneF32(1.0f) / SquareRoot(DotProduct(v, v));
+    return LaneVector3(v.x * factor, v.y * factor, v.z * factor);
+}
+
+inline void Select(LaneVector3* dest, LaneMask mask, LaneVector3 right) {
+    Select(&(dest->x), mask, right.x);
+    Select(&(dest->y), mask, right.y);
+    Select(&(dest->z), mask, right.z);
+};
+
+inline LaneVector3 FMulAdd(const LaneVector3 left, const LaneVector3 right, const LaneVector3 addend) {
+    LaneVector3 result;
+    result.x = FMulAdd(left.x, right.x, addend.x);
+    result.y = FMulAdd(left.y, right.y, addend.y);
+    result.z = FMulAdd(left.z, right.z, addend.z);
+
+    return result;
+}
+
+inline LaneVector3 FMulAdd(const LaneVector3 left, const LaneF32 right, const LaneVector3 addend) {
+    LaneVector3 result;
+    result.x = FMulAdd(left.x, right, addend.x);
+    result.y = FMulAdd(left.y, right, addend.y);
+    result.z = FMulAdd(left.z, right, addend.z);
+
+    return result;
+}
+
+// Wide vector4 struct
+struct LaneVector4 {
+    LaneF32 x;
+    LaneF32 y;
+    LaneF32 z;
+    LaneF32 w;
+
+    LaneVector4() = default;
+    LaneVector4(LaneF32 x, LaneF32 y, LaneF32 z, LaneF32 w);
+    LaneVector4(LaneVector3 v, LaneF32 w);
+    LaneVector4(Vector4 vector);
+
+    LaneF32& operator[](int index);
+    LaneVector3 xyz();
+};
+
+inline LaneVector4::LaneVector4(LaneF32 x, LaneF32 y, LaneF32 z, LaneF32 w) {
+    this->x = x;
+    this->y = y;
+    this->z = z;
+    this->w = w;
+};
+
+inline LaneVector4::LaneVector4(LaneVector3 v, LaneF32 w) {
+    this->x = v.x;
+    this->y = v.y;
+    this->z = v.z;
+    this->w = w;
+};
+
+
+inline LaneVector4::LaneVector4(Vector4 vector) {
+    this->x = LaneF32(vector.x);
+    this->y = LaneF32(vector.y);
+    this->z = LaneF32(vector.z);
+    this->w = LaneF32(vector.w);
+};
+
+inline LaneF32& LaneVector4::operator[](int index) {
+    return (&x)[index];
+};
+
+inline LaneVector3 LaneVector4::xyz() {
+    return LaneVector3(x, y, z);
+}
+
+inline LaneVector4 operator-(const LaneVector4 v) {
+    LaneVector4 result;
+    result.x = -v.x;
+    result.y = -v.y;
+    result.z = -v.z;
+    result.w = -v.w;
+
+    return result;
+};
+
+inline LaneVector4 operator+(const LaneVector4 left, const LaneVector4 right) {
+    return LaneVector4(left.x + right.x, left.y + right.y, left.z + right.z, left.w + right.w);
+};
+
+inline LaneVector4 operator-(const LaneVector4 left, const LaneVector4 right) {
+    return LaneVector4(left.x - right.x, left.y - right.y, left.z - right.z, left.w - right.w);
+};
+
+inline LaneVector4 operator*(const LaneVector4 left, const LaneF32 right) {
+    return LaneVector4(left.x * right, left.y * right, left.z * right, left.w * right);
+};
+
+inline LaneF32 DotProduct(const LaneVector4 left, const LaneVector4 right) {
+    return FMulAdd(left.x, right.x, FMulAdd(left.y, right.y, FMulAdd(left.z, right.z, (left.w * right.w))));
+};
+
+inline LaneVector4 Normalize(const LaneVector4 v) {
+    const LaneF32 dot = DotProduct(v, v);
+    const LaneF32 factor = RSquareRoot(dot);
+    return LaneVector4(v.x * factor, v.y * factor, v.z * factor, v.w * factor);
+};
+
+inline void Select(LaneVector4* dest, LaneMask mask, LaneVector4 right) {
+    Select(&(dest->x), mask, right.x);
+    Select(&(dest->y), mask, right.y);
+    Select(&(dest->z), mask, right.z);
+    Select(&(dest->w), mask, right.w);
+};
+
+inline LaneVector4 FMulAdd(const LaneVector4 left, const LaneVector4 right, const LaneVector4 addend) {
+    LaneVector4 result;
+    result.x = FMulAdd(left.x, right.x, addend.x);
+    result.y = FMulAdd(left.y, right.y, addend.y);
+    result.z = FMulAdd(left.z, right.z, addend.z);
+    result.w = FMulAdd(left.w, right.w, addend.w);
+
+    return result;
+}
+
+inline LaneVector4 FMulAdd(const LaneVector4 left, const LaneF32 right, const LaneVector4 addend) {
+    LaneVector4 result;
+    result.x = FMulAdd(left.x, right, addend.x);
+    result.y = FMulAdd(left.y, right, addend.y);
+    result.z = FMulAdd(left.z, right, addend.z);
+    result.w = FMulAdd(left.w, right, addend.w);
+
+    return result;
+}
+
+// Wide matrix4 struct
+struct LaneMatrix4 {
+    LaneVector4 data[4];
+
+    LaneMatrix4() = default;
+    LaneMatrix4(LaneVector4 v1, LaneVector4 v2, LaneVector4 v3, LaneVector4 v4);
+    LaneMatrix4(float array[4][4][LANE_WIDTH]);
+
+    LaneVector4& operator[](int index);
+};
+
+inline LaneMatrix4::LaneMatrix4(LaneVector4 v1, LaneVector4 v2, LaneVector4 v3, LaneVector4 v4) {
+    data[0] = v1;
+    data[1] = v2;
+    data[2] = v3;
+    data[3] = v4;
+}
+
+inline LaneMatrix4::LaneMatrix4(float arr[4][4][LANE_WIDTH]) {
+    for (uint32_t row = 0; row < 4; ++row) {
+        for (uint32_t column = 0; column < 4; ++column) {
+            data[row][column] = LaneF32(arr[row][column]);
+        }
+    }
+}
+
+inline LaneVector4& LaneMatrix4::operator[](int index) {
+    return data[index];
+}
+
+inline LaneVector4 operator*(LaneMatrix4 left, LaneVector4 right) {
+    LaneVector4 result;
+    result.x = DotProduct(left[0], right);
+    result.y = DotProduct(left[1], right);
+    result.z = DotProduct(left[2], right);
+    result.w = DotProduct(left[3], right);
+
+    return result;
+}
+
+inline LaneMatrix4 operator*(LaneMatrix4& left, LaneMatrix4& right) {
+    LaneMatrix4 result;
+    for (uint32_t row = 0; row < 4; ++row) {
+        LaneVector4 rowVector = left[row];
+        for (uint32_t column = 0; column < 4; ++column) {
+            LaneVector4 columnVector = LaneVector4(right[0][column], right[1][column], right[2][column], right[3][column]);
+            LaneF32 value = DotProduct(rowVector, columnVector);
+
+            result[row][column] = value;
+        }
+    }
+
+    return result;
+}
+
+inline LaneMatrix4 Transpose(LaneMatrix4& mat) {
+    LaneMatrix4 result;
+    for (uint32_t row = 0; row < 4; ++row) {
+        for (uint32_t column = 0; column < 4; ++column) {
+            result[row][column] = mat[column][row];
+        }
+    }
+    return result;
+}
+
+// Lane versions of the shading functions in math_util.h. They work like the scalar ones, but both sides of every
+// branch are computed and blended, and sin/cos are polynomials. So results differ from scalar ones in the last bits.
+
+inline LaneF32 Clamp(LaneF32 low, LaneF32 value, LaneF32 high) {
+    return Min(Max(value, low), high);
+}
+
+inline LaneVector3 Lerp(LaneVector3 left, LaneF32 factor, LaneVector3 right) {
+    return left * (LaneF32(1.0f) - factor) + right * factor;
+}
+
+// Angle must be in [-PI, PI]. It's folded to [-PI / 2, PI / 2] where Taylor series up to x^11 and x^12
+// are accurate to float precision.
+inline void SinCos(LaneF32 angle, LaneF32* sine, LaneF32* cosine) {
+    LaneF32 x = angle;
+    LaneF32 cosineSign(1.0f);
+    LaneMask aboveHalfPi = x > LaneF32(HALF_PI);
+    LaneMask belowMinusHalfPi = x < LaneF32(-HALF_PI);
+    Select(&x, aboveHalfPi, LaneF32(PI) - x);
+    Select(&x, belowMinusHalfPi, LaneF32(-PI) - x);
+    Select(&cosineSign, aboveHalfPi | belowMinusHalfPi, LaneF32(-1.0f));
+
+    LaneF32 x2 = x * x;
+    LaneF32 s = FMulAdd(x2, LaneF32(-1.0f / 39916800.0f), LaneF32(1.0f / 362880.0f));
+    s = FMulAdd(x2, s, LaneF32(-1.0f / 5040.0f));
+    s = FMulAdd(x2, s, LaneF32(1.0f / 120.0f));
+    s = FMulAdd(x2, s, LaneF32(-1.0f / 6.0f));
+    *sine = FMulAdd(x * x2, s, x);
+
+    LaneF32 c = FMulAdd(x2, LaneF32(1.0f / 479001600.0f), LaneF32(-1.0f / 3628800.0f));
+    c = FMulAdd(x2, c, LaneF32(1.0f / 40320.0f));
+    c = FMulAdd(x2, c, LaneF32(-1.0f / 720.0f));
+    c = FMulAdd(x2, c, LaneF32(1.0f / 24.0f));
+    c = FMulAdd(x2, c, LaneF32(-0.5f));
+    *cosine = FMulAdd(x2, c, LaneF32(1.0f)) * cosineSign;
+}
+
+inline LaneMask Refract(LaneVector3 incidentVector, LaneVector3 normal,
+                        LaneF32 refractiveIndex, LaneVector3* refractionDirection) {
+    LaneF32 cosIncidentAngle = Clamp(LaneF32(-1.0f), DotProduct(incidentVector, normal), LaneF32(1.0f));
+    // Coming from outside the surface where cos is negative, otherwise from inside.
+    LaneMask isOutside = cosIncidentAngle < LaneF32(0.0f);
+    LaneVector3 hitNormal = -normal;
+    LaneF32 refractiveIndexRatio = refractiveIndex;
+    Select(&hitNormal, isOutside, normal);
+    Select(&refractiveIndexRatio, isOutside, LaneF32(1.0f) / refractiveIndex);
+    Select(&cosIncidentAngle, isOutside, -cosIncidentAngle);
+
+    LaneF32 discriminant = LaneF32(1.0f) - refractiveIndexRatio * refractiveIndexRatio *
+                           (LaneF32(1.0f) - cosIncidentAngle * cosIncidentAngle);
+    LaneF32 sqrtDiscriminant = SquareRoot(Max(discriminant, LaneF32(0.0f)));
+    *refractionDirection = incidentVector * refractiveIndexRatio + hitNormal *
+                           (refractiveIndexRatio * cosIncidentAngle - sqrtDiscriminant);
+    // Lanes with total internal reflection are off.
+    return discriminant >= LaneF32(0.0f);
+}
+
+inline LaneF32 Schlick(LaneVector3 incidentVector, LaneVector3 normal, LaneF32 refractiveIndex) {
+    LaneF32 cosIncidentAngle = Clamp(LaneF32(-1.0f), DotProduct(incidentVector, normal), LaneF32(1.0f));
+    LaneF32 cosine = Max(cosIncidentAngle, -cosIncidentAngle);
+    LaneF32 r0 = (LaneF32(1.0f) - refractiveIndex) / (LaneF32(1.0f) + refractiveIndex);
+    r0 = r0 * r0;
+    LaneF32 m = LaneF32(1.0f) - cosine;
+    LaneF32 m2 = m * m;
+    return FMulAdd(LaneF32(1.0f) - r0, m2 * m2 * m, r0);
+}
+
+inline void OrthonormalBasis(LaneVector3 normal, LaneVector3* tangent, LaneVector3* bitangent) {
+    // copysign(1, z) with bit operations
+    LaneF32 sign = (normal.z & LaneF32(-0.0f)) | LaneF32(1.0f);
+    LaneF32 a = LaneF32(-1.0f) / (sign + normal.z);
+    LaneF32 b = normal.x * normal.y * a;
+    *tangent = LaneVector3(LaneF32(1.0f) + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+    *bitangent = LaneVector3(b, sign + normal.y * normal.y * a, -normal.y);
+}
+
+// Same distribution as the scalar one, but phi goes from -PI to PI so SinCos can take it directly.
+inline LaneVector3 SampleCosineHemisphere(LaneVector3 normal, LaneF32 u1, LaneF32 u2) {
+    LaneF32 radius = SquareRoot(u1);
+    LaneF32 phi = LaneF32(PI) * FMulSub(LaneF32(2.0f), u2, LaneF32(1.0f));
+    LaneF32 sinPhi, cosPhi;
+    SinCos(phi, &sinPhi, &cosPhi);
+
+    LaneVector3 tangent, bitangent;
+    OrthonormalBasis(normal, &tangent, &bitangent);
+    return tangent * (radius * cosPhi) + bitangent * (radius * sinPhi) +
+           normal * SquareRoot(Max(LaneF32(0.0f), LaneF32(1.0f) - u1));
+}
+
+inline LaneF32 PowerHeuristic(LaneF32 pdf, LaneF32 otherPdf) {
+    LaneF32 pdfSquared = pdf * pdf;
+    LaneF32 otherPdfSquared = otherPdf * otherPdf;
+    return pdfSquared / (pdfSquared + otherPdfSquared);
+}
@@ -1,17 +1,30 @@
 #ifndef _SIMD_SSE_H_
 #define _SIMD_SSE_H_
 
+// 4-wide lanes. Select needs SSE4.1 blendv.
+
 struct LaneF32 {
     __m128 m;
 
-    LaneF32();
+    // Default constructor and copy are trivial, so compiler generated constructors of structs with lane members
+    // don't call anything. Those are compiled without the backend's target pragma and couldn't inline our calls.
+    LaneF32() = default;
     LaneF32(float value);
     LaneF32(const float* value);
-    LaneF32(const LaneF32& copy);
 };
 
-inline LaneF32::LaneF32() {
+// Result of a lane comparison. Lanes are all ones or all zeros, like blendv expects.
+struct LaneMask {
+    __m128 m;
+};
 
+// Integer lanes. Only what random number generation needs.
+struct LaneU32 {
+    __m128i m;
+
+    LaneU32() = default;
+    LaneU32(uint32_t value);
+    LaneU32(const uint32_t* value);
 };
 
 inline LaneF32::LaneF32(float value) {
@@ -22,10 +35,6 @@ inline LaneF32::LaneF32(const float* value) {
     this->m = _mm_load_ps(value);
 };
 
-inline LaneF32::LaneF32(const LaneF32& copy) {
-    this->m = copy.m;
-};
-
 inline LaneF32 operator-(const LaneF32 left, const LaneF32 right) {
     LaneF32 result;
     result.m = _mm_sub_ps(left.m, right.m);
@@ -54,34 +63,48 @@ inline LaneF32 operator/(const LaneF32 left, const LaneF32 right) {
     return result;
 };
 
-inline LaneF32 operator>(const LaneF32 left, const LaneF32 right) {
-    LaneF32 result;
+inline LaneMask operator>(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
     result.m = _mm_cmpgt_ps(left.m, right.m);
 
     return result;
 };
 
-inline LaneF32 operator<(const LaneF32 left, const LaneF32 right) {
-    LaneF32 result;
+inline LaneMask operator<(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
     result.m = _mm_cmplt_ps(left.m, right.m);
 
     return result;
 };
 
-inline LaneF32 operator<=(const LaneF32 left, const LaneF32 right) {
-    LaneF32 result;
+inline LaneMask operator<=(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
     result.m = _mm_cmple_ps(left.m, right.m);
 
     return result;
 }
 
-inline LaneF32 operator>=(const LaneF32 left, const LaneF32 right) {
-    LaneF32 result;
+inline LaneMask operator>=(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
     result.m = _mm_cmpge_ps(left.m, right.m);
 
     return result;
 }
 
+inline LaneMask operator==(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
+    result.m = _mm_cmpeq_ps(left.m, right.m);
+
+    return result;
+}
+
+inline LaneMask operator!=(const LaneF32 left, const LaneF32 right) {
+    LaneMask result;
+    result.m = _mm_cmpneq_ps(left.m, right.m);
+
+    return result;
+}
+
 inline LaneF32 operator|(const LaneF32 left, const LaneF32 right) {
     LaneF32 result;
     result.m = _mm_or_ps(left.m, right.m);
@@ -96,6 +119,20 @@ inline LaneF32 operator&(const LaneF32 left, const LaneF32 right) {
     return result;
 };
 
+inline LaneMask operator|(const LaneMask left, const LaneMask right) {
+    LaneMask result;
+    result.m = _mm_or_ps(left.m, right.m);
+
+    return result;
+};
+
+inline LaneMask operator&(const LaneMask left, const LaneMask right) {
+    LaneMask result;
+    result.m = _mm_and_ps(left.m, right.m);
+
+    return result;
+};
+
 inline LaneF32 operator-(const LaneF32 value) {
     LaneF32 result;
     result.m = _mm_xor_ps(value.m, _mm_set1_ps(-0.0f));
@@ -128,6 +165,14 @@ inline void StoreLane(float* dest, LaneF32 lane) {
     _mm_store_ps(dest, lane.m);
 };
 
+// LaneF32(const float*) needs aligned memory, this doesn't.
+inline LaneF32 LoadUnaligned(const float* value) {
+    LaneF32 result;
+    result.m = _mm_loadu_ps(value);
+
+    return result;
+};
+
 inline LaneF32 SquareRoot(LaneF32 value) {
     LaneF32 result;
     result.m = _mm_sqrt_ps(value.m);
@@ -142,14 +187,100 @@ inline LaneF32 RSquareRoot(LaneF32 value) {
     return result;
 };
 
-inline bool MaskIsZeroed(LaneF32 mask) {
+inline LaneF32 Min(const LaneF32 left, const LaneF32 right) {
+    LaneF32 result;
+    result.m = _mm_min_ps(left.m, right.m);
+
+    return result;
+};
+
+inline LaneF32 Max(const LaneF32 left, const LaneF32 right) {
+    LaneF32 result;
+    result.m = _mm_max_ps(left.m, right.m);
+
+    return result;
+};
+
+// Returns one bit per lane. Bit i is set if lane i of the mask is set.
+inline uint32_t GetMaskBits(LaneMask mask) {
+    return _mm_movemask_ps(mask.m);
+};
+
+inline bool MaskIsZeroed(LaneMask mask) {
     bool result = _mm_movemask_ps(mask.m) == 0;
 
     return result;
 };
 
-inline void Select(LaneF32* dest, LaneF32 mask, LaneF32 right) {
+inline void Select(LaneF32* dest, LaneMask mask, LaneF32 right) {
     dest->m = _mm_blendv_ps(dest->m, right.m, mask.m);
 };
 
+inline LaneU32::LaneU32(uint32_t value) {
+    this->m = _mm_set1_epi32((int32_t) value);
+};
+
+inline LaneU32::LaneU32(const uint32_t* value) {
+    this->m = _mm_load_si128((const __m128i*) value);
+};
+
+inline LaneU32 operator^(const LaneU32 left, const LaneU32 right) {
+    LaneU32 result;
+    result.m = _mm_xor_si128(left.m, right.m);
+
+    return result;
+};
+
+inline LaneU32 operator|(const LaneU32 left, const LaneU32 right) {
+    LaneU32 result;
+    result.m = _mm_or_si128(left.m, right.m);
+
+    return result;
+};
+
+inline LaneU32 operator<<(const LaneU32 value, const uint32_t shift) {
+    LaneU32 result;
+    result.m = _mm_slli_epi32(value.m, shift);
+
+    return result;
+};
+
+// Logical shift, zeros come in from the top.
+inline LaneU32 operator>>(const LaneU32 value, const uint32_t shift) {
+    LaneU32 result;
+    result.m = _mm_srli_epi32(value.m, shift);
+
+    return result;
+};
+
+inline void StoreLane(uint32_t* dest, LaneU32 lane) {
+    _mm_store_si128((__m128i*) dest, lane.m);
+};
+
+// Same bits read as floats.
+inline LaneF32 CastToF32(LaneU32 value) {
+    LaneF32 result;
+    result.m = _mm_castsi128_ps(value.m);
+
+    return result;
+};
+
+inline void Select(LaneU32* dest, LaneMask mask, LaneU32 right) {
+    dest->m = _mm_blendv_epi8(dest->m, right.m, _mm_castps_si128(mask.m));
+};
+
+inline float HorizontalMin(LaneF32 value) {
+    __m128 m = _mm_min_ps(value.m, _mm_shuffle_ps(value.m, value.m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm_cvtss_f32(m);
+};
+
+inline float HorizontalMax(LaneF32 value) {
+    __m128 m = _mm_max_ps(value.m, _mm_shuffle_ps(value.m, value.m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm_cvtss_f32(m);
+};
+
 #endif
\ No newline at end of file
@@ -29,6 +29,8 @@ struct Material {
     float refractiveIndex; // Refractive index of material. 0 means no refraction.
     Vector3 emitColor;
     float reflection; // 0 is pure diffuse, 1 is mirror.
+    float roughness; // 0 is a perfect mirror. GGX alpha is roughness squared.
+    float metalness; // Blends the mirror tint from the flat color to Schlick's Fresnel with color as F0.
 };
 
 struct Sphere {
@@ -0,0 +1,101 @@
+#ifndef _WORK_DEQUE_H_
+#define _WORK_DEQUE_H_
+
+#include "platform.h"
+
+#define CACHE_LINE_SIZE 64
+
+// Chase-Lev work stealing deque with a fixed capacity.
+// Owner thread pushes and pops at the bottom, other threads steal from the top.
+// Owner only touches the shared top index when the deque is about to get empty, so in the common case
+// every thread works on its own cache lines.
+// Items are single 64-bit words, so reading an item is atomic and thieves don't need extra storage.
+struct WorkDeque {
+    volatile uint32_t top;
+    uint8_t topPadding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+
+    volatile uint32_t bottom;
+    uint32_t capacity; // Power of two
+    volatile uint64_t* items;
+    uint8_t bottomPadding[CACHE_LINE_SIZE - 2 * sizeof(uint32_t) - sizeof(uint64_t*)];
+};
+
+inline void InitializeWorkDeque(WorkDeque* deque, uint32_t minCapacity) {
+    uint32_t capacity = 1;
+    while (capacity < minCapacity) {
+        capacity *= 2;
+    }
+
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->capacity = capacity;
+    deque->items = new uint64_t[capacity];
+}
+
+// Deque can be reused for another batch of work. Only safe while no thread is using it.
+inline void ClearWorkDeque(WorkDeque* deque) {
+    deque->top = 0;
+    deque->bottom = 0;
+}
+
+// Only the owner can push. Returns false if the deque is full.
+inline bool PushWork(WorkDeque* deque, uint64_t item) {
+    uint32_t bottom = deque->bottom;
+    uint32_t top = deque->top;
+    if (bottom - top >= deque->capacity) {
+        return false;
+    }
+
+    // x86 doesn't reorder stores, and volatile keeps the compiler from doing it.
+    // So thieves never see the new bottom before the item.
+    deque->items[bottom & (deque->capacity - 1)] = item;
+    deque->bottom = bottom + 1;
+    return true;
+}
+
+// Only the owner can pop. Takes the most recently pushed item.
+inline bool PopWork(WorkDeque* deque, uint64_t* item) {
+    uint32_t bottom = deque->bottom - 1;
+    deque->bottom = bottom;
+    // Thieves must see the reserved bottom before we read top. Otherwise we both can take the last item.
+    FullMemoryBarrier();
+    uint32_t top = deque->top;
+
+    int32_t remainingCount = (int32_t) (bottom - top);
+    if (remainingCount < 0) {
+        // Empty
+        deque->bottom = bottom + 1;
+        return false;
+    }
+
+    *item = deque->items[bottom & (deque->capacity - 1)];
+    if (remainingCount > 0) {
+        return true;
+    }
+
+    // That was the last item. A thief might be taking it too, so whoever moves top first gets it.
+    bool won = InterlockedCompareExchangeAndReturnPrevious(&deque->top, top + 1, top) == top;
+    deque->bottom = bottom + 1;
+    return won;
+}
+
+// Any thread can steal. Takes the oldest item. Returns false if the deque is empty or we lost a race.
+inline bool StealWork(WorkDeque* deque, uint64_t* item) {
+    uint32_t top = deque->top;
+    FullMemoryBarrier();
+    uint32_t bottom = deque->bottom;
+    if ((int32_t) (bottom - top) <= 0) {
+        return false;
+    }
+
+    // Owner can't overwrite this slot before top moves past it, so it's fine to read it before the exchange.
+    uint64_t stolenItem = deque->items[top & (deque->capacity - 1)];
+    if (InterlockedCompareExchangeAndReturnPrevious(&deque->top, top + 1, top) != top) {
+        return false;
+    }
+
+    *item = stolenItem;
+    return true;
+}
+
+#endif